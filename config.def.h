@@ -363,14 +363,19 @@ unsigned int hyperlinkstyle = 1;
 /* Show a hyperlink hint at the bottom of the screen */
 unsigned int showhyperlinkhint = 1;
 
-/* Specifies how many hyperlinks can be cached on the primary screen and the
- * scrollback. When the cache is full, the oldest hyperlinks will be thrown
- * away. Default value is 8192, maximum value is 65536. */
-unsigned int hyperlinkcache_pri = 8192;
+/* Specifies how much memory in bytes the hyperlinks of the primary screen and
+ * the scrollback can use. When it is used up, the oldest hyperlinks will be
+ * thrown away. Default value is 1 MiB. */
+unsigned int hyperlinkmemory_pri = 1 << 20;
 
-/* Specifies how many hyperlinks can be cached on the alternate screen.
- * Default value is 1024, maximum value is 65536. */
-unsigned int hyperlinkcache_alt = 1024;
+/* Specifies how much memory in bytes the hyperlinks of the alternate screen
+ * can use. Default value is 128 KiB. */
+unsigned int hyperlinkmemory_alt = 1 << 17;
+
+/* Specifies how many bytes of printer and dump output can wait for the output
+ * file (see -o). Output that does not fit is thrown away until the file
+ * catches up. Default value is 1 MiB. */
+unsigned int printbuffersize = 1 << 20;
 
 /*
  * Default colour and shape of the mouse cursor
@@ -417,6 +422,8 @@ static Shortcut shortcuts[] = {
 	{ XK_ANY_MOD,           XK_Break,       sendbreak,       {.i =  0} },
 	{ ControlMask,          XK_Print,       toggleprinter,   {.i =  0} },
 	{ ShiftMask,            XK_Print,       printscreen,     {.i =  0} },
+	{ TERMMOD,              XK_Print,       printoutput,     {.i =  0} },
+	//{ TERMMOD,              XK_,           printoutputjson, {.i =  0} },
 	{ XK_ANY_MOD,           XK_Print,       printsel,        {.i =  0} },
 	{ TERMMOD,              XK_Prior,       zoom,            {.f = +1} },
 	{ TERMMOD,              XK_Next,        zoom,            {.f = -1} },
@@ -427,6 +434,7 @@ static Shortcut shortcuts[] = {
 	{ TERMMOD,              XK_P,           changealpha,     {.f = -0.05} },
 	//{ TERMMOD,              XK_,           changealphaunfocused, {.f = +0.05} },
 	//{ TERMMOD,              XK_,           changealphaunfocused, {.f = -0.05} },
+	{ TERMMOD,              XK_S,           dumpstats,       {.i =  0} },
 	{ ShiftMask,            XK_Page_Up,     kscrollup,       {.i = -1}, S_PRI },
 	{ ShiftMask,            XK_Page_Down,   kscrolldown,     {.i = -1}, S_PRI },
 	{ TERMMOD,              XK_Y,           clippaste,       {.i =  0} },
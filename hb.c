@@ -11,7 +11,6 @@
 #include "hb.h"
 
 #define FEATURE(c1,c2,c3,c4) { .tag = HB_TAG(c1,c2,c3,c4), .value = 1, .start = HB_FEATURE_GLOBAL_START, .end = HB_FEATURE_GLOBAL_END }
-#define BUFFER_STEP 256
 
 hb_font_t *hbfindfont(XftFont *match);
 
@@ -27,12 +26,6 @@ typedef struct {
 
 static HbFontCache hbfontcache = { 0, NULL };
 
-typedef struct {
-	size_t capacity;
-	Rune *runes;
-} RuneBuffer;
-
-static RuneBuffer hbrunebuffer = { 0, NULL };
 static hb_buffer_t *hbbuffer;
 
 /*
@@ -94,9 +87,9 @@ hbfindfont(XftFont *match)
 void
 hbtransform(HbTransformData *data, XftFont *xfont, const Glyph *glyphs, int start, int length)
 {
-	uint32_t mode;
+	const Rune *runes;
 	unsigned int glyph_count;
-	int rune_idx, glyph_idx, end = start + length;
+	int n, glyph_idx, end = start + length;
 	hb_buffer_t *buffer = hbbuffer;
 
 	hb_font_t *font = hbfindfont(xfont);
@@ -108,21 +101,18 @@ hbtransform(HbTransformData *data, XftFont *xfont, const Glyph *glyphs, int star
 	hb_buffer_reset(buffer);
 	hb_buffer_set_direction(buffer, HB_DIRECTION_LTR);
 	hb_buffer_set_cluster_level(buffer, HB_BUFFER_CLUSTER_LEVEL_MONOTONE_CHARACTERS);
-
-	/* Resize the buffer if required length is larger. */
-	if (hbrunebuffer.capacity < length) {
-		hbrunebuffer.capacity = (length / BUFFER_STEP + 1) * BUFFER_STEP;
-		hbrunebuffer.runes = realloc(hbrunebuffer.runes, hbrunebuffer.capacity * sizeof(Rune));
-	}
-
-	/* Fill buffer with codepoints. */
-	for (rune_idx = 0, glyph_idx = start; glyph_idx < end; glyph_idx++, rune_idx++) {
-		hbrunebuffer.runes[rune_idx] = glyphs[glyph_idx].u;
-		mode = glyphs[glyph_idx].mode;
-		if (mode & ATTR_WDUMMY)
-			hbrunebuffer.runes[rune_idx] = 0x0020;
+	hb_buffer_set_content_type(buffer, HB_BUFFER_CONTENT_TYPE_UNICODE);
+
+	/* Fill buffer with codepoints, every code point of a grapheme cluster
+	 * belongs to the cluster of its cell. */
+	for (glyph_idx = start; glyph_idx < end; glyph_idx++) {
+		if (glyphs[glyph_idx].mode & ATTR_WDUMMY) {
+			hb_buffer_add(buffer, 0x0020, glyph_idx - start);
+			continue;
+		}
+		for (n = glyphrunes(&glyphs[glyph_idx].u, &runes); n > 0; n--)
+			hb_buffer_add(buffer, *runes++, glyph_idx - start);
 	}
-	hb_buffer_add_codepoints(buffer, hbrunebuffer.runes, length, 0, length);
 
 	/* Shape the segment. */
 	hb_shape(font, buffer, features, sizeof(features)/sizeof(hb_feature_t));
@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+# Generates width.h from the Unicode Character Database.
+#
+#   mkwidth.py UCDDIR > width.h
+#
+# UCDDIR has to contain EastAsianWidth.txt, extracted/DerivedGeneralCategory.txt
+# (or DerivedGeneralCategory.txt) and emoji/emoji-data.txt (or emoji-data.txt)
+# from https://www.unicode.org/Public/UCD/latest/ucd/
+
+import os
+import re
+import sys
+
+NRUNES = 0x110000
+BLOCK = 128
+
+RUNE_BOXDRAW = 4
+
+# ranges that isboxdraw() can draw, see patch/boxdraw.c
+BOXDRAW = [(0x2500, 0x25ff), (0x2800, 0x28ff), (0xf5d0, 0xf60f)]
+
+# unassigned code points in these ranges default to wide
+DEFAULTWIDE = [(0x3400, 0x4dbf), (0x4e00, 0x9fff), (0xf900, 0xfaff),
+               (0x20000, 0x2fffd), (0x30000, 0x3fffd)]
+
+# format characters that are visible
+VISIBLEFORMAT = {0x00ad, 0x0600, 0x0601, 0x0602, 0x0603, 0x0604, 0x0605,
+                 0x06dd, 0x070f, 0x0890, 0x0891, 0x08e2, 0x110bd, 0x110cd}
+
+# Hangul vowels and final consonants join the preceding syllable
+JAMO = [(0x1160, 0x11ff), (0xd7b0, 0xd7ff)]
+
+
+def ucdfile(dir, *names):
+	for name in names:
+		path = os.path.join(dir, name)
+		if os.path.exists(path):
+			return path
+	sys.exit("mkwidth: %s not found in %s" % (names[0], dir))
+
+
+def parse(path, props):
+	"""returns the code points of every property in props"""
+	found = {p: set() for p in props}
+	version = None
+	line_re = re.compile(r"^([0-9A-F]+)(?:\.\.([0-9A-F]+))?\s*;\s*(\w+)")
+	with open(path, encoding="utf-8") as f:
+		for line in f:
+			if version is None:
+				m = re.search(r"-(\d+\.\d+\.\d+)\.txt", line)
+				if m:
+					version = m.group(1)
+			m = line_re.match(line)
+			if not m or m.group(3) not in found:
+				continue
+			first = int(m.group(1), 16)
+			last = int(m.group(2), 16) if m.group(2) else first
+			found[m.group(3)].update(range(first, last + 1))
+	return found, version
+
+
+def inranges(c, ranges):
+	return any(a <= c <= b for a, b in ranges)
+
+
+def main():
+	if len(sys.argv) != 2:
+		sys.exit("usage: mkwidth.py UCDDIR > width.h")
+	dir = sys.argv[1]
+
+	eaw, version = parse(ucdfile(dir, "EastAsianWidth.txt"), ["W", "F"])
+	gc, _ = parse(ucdfile(dir, "extracted/DerivedGeneralCategory.txt",
+	                      "DerivedGeneralCategory.txt"), ["Mn", "Me", "Cf", "Cc"])
+	emoji, _ = parse(ucdfile(dir, "emoji/emoji-data.txt", "emoji-data.txt"),
+	                 ["Emoji_Presentation"])
+
+	wide = eaw["W"] | eaw["F"] | emoji["Emoji_Presentation"]
+	zero = gc["Mn"] | gc["Me"] | (gc["Cf"] - VISIBLEFORMAT)
+	assigned = wide | zero | gc["Cc"]
+
+	data = bytearray(NRUNES)
+	for c in range(NRUNES):
+		if c in zero or inranges(c, JAMO):
+			w = 0
+		elif c in wide or (c not in assigned and inranges(c, DEFAULTWIDE)):
+			w = 2
+		else:
+			w = 1
+		if inranges(c, BOXDRAW):
+			w |= RUNE_BOXDRAW
+		data[c] = w
+
+	blocks = {}
+	index = []
+	for i in range(0, NRUNES, BLOCK):
+		block = bytes(data[i:i + BLOCK])
+		index.append(blocks.setdefault(block, len(blocks)))
+	if len(blocks) > 256:
+		sys.exit("mkwidth: too many blocks")
+
+	out = sys.stdout
+	out.write("/* Generated by mkwidth.py from the Unicode %s character database,\n"
+	          " * do not edit. */\n\n" % (version or "unknown"))
+	out.write("#define RUNE_WIDTH      3  /* 0, 1 or 2 columns */\n")
+	out.write("#define RUNE_BOXDRAW    %d  /* can be drawn by isboxdraw() */\n\n" % RUNE_BOXDRAW)
+	out.write("#define RUNEBLOCK       %d\n\n" % BLOCK)
+	out.write("static const unsigned char runeindex[%d] = {\n" % len(index))
+	for i in range(0, len(index), 16):
+		out.write("\t" + ", ".join("%3d" % v for v in index[i:i + 16]) + ",\n")
+	out.write("};\n\n")
+	out.write("static const unsigned char runeblocks[%d][RUNEBLOCK] = {\n" % len(blocks))
+	for block in blocks:
+		out.write("\t{\n")
+		for i in range(0, BLOCK, 32):
+			out.write("\t\t" + ",".join(str(v) for v in block[i:i + 32]) + ",\n")
+		out.write("\t},\n")
+	out.write("};\n")
+
+
+if __name__ == "__main__":
+	main()
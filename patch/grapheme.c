@@ -0,0 +1,147 @@
+/* Cells that need more than one code point, like a letter followed by
+ * combining marks or an emoji ZWJ sequence, hold GLYPH_CLUSTER | id in
+ * Glyph.u. The code points of the clusters are interned in a pool and
+ * never freed, so these cells are copied and overwritten like any other. */
+
+#define GRAPHEME_MAX 65536  /* later clusters keep only their first code point */
+
+typedef struct {
+	uint off;
+	uint len;
+	uint hash;
+} Grapheme;
+
+static struct {
+	Grapheme *clusters;
+	uint count, size;
+	uint *table;       /* cluster ids + 1 hashed by their code points */
+	uint tablesize;
+	Rune *pool;
+	size_t poolused, poolsize;
+} graphemes;
+
+static uint
+graphemehash(const Rune *runes, int len)
+{
+	uint h = 2166136261u;
+	int i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ runes[i]) * 16777619u;
+	return h;
+}
+
+static void
+growgraphemetable(void)
+{
+	uint i, j, mask;
+
+	free(graphemes.table);
+	graphemes.tablesize = MAX(graphemes.tablesize * 2, 256);
+	graphemes.table = xmalloc(graphemes.tablesize * sizeof(*graphemes.table));
+	memset(graphemes.table, 0, graphemes.tablesize * sizeof(*graphemes.table));
+
+	mask = graphemes.tablesize - 1;
+	for (i = 0; i < graphemes.count; i++) {
+		for (j = graphemes.clusters[i].hash & mask; graphemes.table[j]; j = (j + 1) & mask)
+			;
+		graphemes.table[j] = i + 1;
+	}
+}
+
+/* returns the id of the cluster or -1 if there is no room for another one */
+static int
+interngrapheme(const Rune *runes, int len)
+{
+	Grapheme *g;
+	uint i, mask, hash = graphemehash(runes, len);
+
+	if ((graphemes.count + 1) * 2 > graphemes.tablesize)
+		growgraphemetable();
+
+	mask = graphemes.tablesize - 1;
+	for (i = hash & mask; graphemes.table[i]; i = (i + 1) & mask) {
+		g = &graphemes.clusters[graphemes.table[i] - 1];
+		if (g->hash == hash && g->len == len &&
+		    !memcmp(graphemes.pool + g->off, runes, len * sizeof(Rune)))
+			return graphemes.table[i] - 1;
+	}
+	if (graphemes.count == GRAPHEME_MAX)
+		return -1;
+
+	if (graphemes.count == graphemes.size) {
+		graphemes.size = MAX(graphemes.size * 2, 64);
+		graphemes.clusters = xrealloc(graphemes.clusters, graphemes.size * sizeof(Grapheme));
+	}
+	if (graphemes.poolused + len > graphemes.poolsize) {
+		graphemes.poolsize = MAX(graphemes.poolsize * 2, graphemes.poolused + len + 256);
+		graphemes.pool = xrealloc(graphemes.pool, graphemes.poolsize * sizeof(Rune));
+	}
+
+	g = &graphemes.clusters[graphemes.count];
+	g->off = graphemes.poolused;
+	g->len = len;
+	g->hash = hash;
+	memcpy(graphemes.pool + g->off, runes, len * sizeof(Rune));
+	graphemes.poolused += len;
+	graphemes.table[i] = ++graphemes.count;
+	return graphemes.count - 1;
+}
+
+int
+glyphrunes(const Rune *u, const Rune **runes)
+{
+	Grapheme *g;
+
+	if (!(*u & GLYPH_CLUSTER)) {
+		*runes = u;
+		return 1;
+	}
+	g = &graphemes.clusters[*u & ~GLYPH_CLUSTER];
+	*runes = graphemes.pool + g->off;
+	return g->len;
+}
+
+Rune
+clusterbase(Rune u)
+{
+	return graphemes.pool[graphemes.clusters[u & ~GLYPH_CLUSTER].off];
+}
+
+/* Adds a combining mark or a character after a zero width joiner to the
+ * cluster of the previous character. Returns 0 if it has to be printed on
+ * its own. */
+static int
+tcombine(Rune u, int width)
+{
+	Rune runes[CLUSTER_MAXLEN];
+	const Rune *prev;
+	Glyph *gp;
+	int n, id, x = term.c.x;
+
+	if (!(term.c.state & CURSOR_WRAPNEXT))
+		x--;
+	if (x < 0)
+		return 0;
+	gp = &term.line[term.c.y][x];
+	if ((gp->mode & ATTR_WDUMMY) && x > 0)
+		gp--;
+	if (!(gp->mode & ATTR_SET) || (gp->mode & ATTR_WDUMMY))
+		return 0;
+
+	/* marks that do not fit are dropped */
+	if ((n = glyphrunes(&gp->u, &prev)) == CLUSTER_MAXLEN)
+		return width == 0;
+	memcpy(runes, prev, n * sizeof(Rune));
+	runes[n++] = u;
+	if ((id = interngrapheme(runes, n)) < 0)
+		return width == 0;
+
+	gp->u = GLYPH_CLUSTER | id;
+	gp->mode &= ~ATTR_BOXDRAW;
+	tlineput(term.line[term.c.y], gp - term.line[term.c.y], 0);
+	term.lastzwj = (u == 0x200d);
+	term.dirty[term.c.y] = 1;
+	LINEHDR(term.line[term.c.y])->gen = ++term.textgen;
+	return 1;
+}
@@ -0,0 +1 @@
+static int tcombine(Rune u, int width);
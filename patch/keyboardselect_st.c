@@ -1,5 +1,9 @@
 #define PCRE2_CODE_UNIT_WIDTH 32
 #include <pcre2.h>
+#include <pthread.h>
+
+#define KBDS_SEARCHCHUNK  (1 << 16)  /* characters the search worker scans at a time */
+#define KBDS_SEARCHPOLL   20         /* ms between the polls of the search worker */
 
 enum keyboardselect_mode {
 	KBDS_MODE_MOVE    = 0,
@@ -35,6 +39,7 @@ typedef struct {
 	KCursor c;
 	unsigned int len;
 	wchar_t *matched_substring;
+	int label;
 } RegexKCursor;
 
 typedef struct {
@@ -46,6 +51,7 @@ typedef struct {
 typedef struct {
 	KCursor c;
 	char *url;
+	int label;
 } UrlKCursor;
 
 typedef struct {
@@ -77,6 +83,103 @@ typedef struct {
 	size_t size;
 } KCursorArray;
 
+typedef struct {
+	int x;
+	int y;
+} KPos;
+
+typedef struct {
+	int *array;
+	size_t used;
+	size_t size;
+} KMatchArray;
+
+typedef struct {
+	int x1;
+	int x2;
+} KSpan;
+
+typedef struct {
+	KSpan *array;
+	size_t used;
+	size_t size;
+} KSpanArray;
+
+typedef struct {
+	const void *key;
+	size_t len;
+	int label;
+} KLabelKey;
+
+/* The search index is a flattened copy of the screen and the history where
+ * wrapped lines are joined and logical lines are separated by 0. It is kept
+ * until term.textgen changes, and the matches of the last query are kept so
+ * that typing another character only has to filter them. A large range is
+ * scanned by kbds_worker while the matches are published progressively. */
+static struct {
+	uint gen;
+	int valid;
+	int top;        /* first indexed row, rows are relative to term.scr = 0 */
+	int row, col;
+	Rune *text;
+	Rune *fold;     /* case folded text, built on demand */
+	int folded;
+	KPos *pos;      /* position of every character of text */
+	int len, size;
+	Rune *query;    /* query of the cached matches */
+	int qlen;
+	int ignorecase;
+	int from, to;   /* range of the searched match offsets */
+	int scanned;    /* the range is scanned up to this offset */
+	int highlight;  /* new matches are highlighted */
+	int nvalid;     /* matches that pass the wordonly check */
+	int current;    /* number of the match at the cursor, 0 if unknown */
+	KMatchArray match; /* offsets of the matches in text */
+} kbds_index;
+
+/* The worker only reads the index and the query, which are not changed
+ * until it is stopped, and hands the matches of every chunk over through
+ * found. */
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	int running;
+	int cancel;
+	int done;
+	int scanned;
+	const Rune *text;
+	KMatchArray found;
+} kbds_worker = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* a find-next that waits for the matches that decide it */
+static struct {
+	int active;
+	int dir;
+	int quant;
+	int off;
+} kbds_pending;
+
+/* Highlights and labels are not written into the glyphs, they are kept in
+ * this list and composited over the rows when they are drawn. They belong
+ * to a line, so they move with it when the screen scrolls, and they are no
+ * longer drawn once the text of the line changes. */
+typedef struct {
+	Line line;
+	uint gen;       /* generation of the text of the line */
+	int x1, x2;
+	ushort mode;    /* ATTR_HIGHLIGHT or ATTR_FLASH_LABEL */
+	char text[16];  /* text of a label */
+} KOverlay;
+
+static struct {
+	KOverlay *array;
+	size_t used;
+	size_t size;
+	int sorted;
+} kbds_overlay;
+
+static char kbds_status[64];             /* status drawn on the first row */
+static int kbds_searchbar;               /* the search bar is drawn on the last row */
 static int kbds_in_use, kbds_quant;
 static int kbds_seltype = SEL_REGULAR;
 static int kbds_mode;
@@ -84,13 +187,23 @@ static int kbds_finddir, kbds_findtill;
 static int kbds_scrolldownonexit;
 static Rune kbds_findchar;
 static KCursor kbds_c, kbds_oc;
-static CharArray flash_next_char_record, flash_used_label, flash_used_double_label;
+static CharArray flash_next_char_record, flash_used_label;
 static KCursorArray flash_kcursor_record;
 static KCursorArray flash_kcursor_match;
 static RegexKCursorArray regex_kcursor_record;
 static UrlKCursorArray url_kcursor_record;
-static int hit_input_first = 0;
-static Rune hit_input_first_label;
+static KSpanArray *regex_row_spans;      /* recorded matches of every row */
+static char *kbds_labels;                /* labels of the regex and url modes */
+static int kbds_nlabels, kbds_labelwidth;
+static char kbds_labelinput[16];         /* typed part of a label */
+static int kbds_labelinputlen;
+static struct {
+	KLabelKey *keys;
+	size_t size;
+} kbds_labelhash;                        /* label of every matched string */
+static pcre2_code **kbds_regex;           /* compiled pattern_list */
+static int kbds_nregex;
+static pcre2_match_data *kbds_regexmd;
 
 static const char *flash_key_label[] = {
 	"j", "f", "d", "k", "l", "h", "g", "a", "s", "o",
@@ -230,29 +343,226 @@ reset_kcursor_array(KCursorArray *a) {
 	a->size = 0;
 }
 
+void
+insert_match_array(KMatchArray *a, int element) {
+	if (a->used == a->size) {
+		a->size = a->size == 0 ? 64 : a->size * 2;
+		a->array = (int *)xrealloc(a->array, a->size * sizeof(int));
+	}
+	a->array[a->used++] = element;
+}
+
+/* insert the span unless it overlaps a span of the array */
 int
-is_in_flash_used_label(Rune label) {
-	int i;
-	for ( i = 0; i < flash_used_label.used; i++) {
-		if (label == flash_used_label.array[i]) {
-			return 1;
+insert_span_array(KSpanArray *a, KSpan element) {
+	size_t lo = 0, hi = a->used, mid;
+
+	// the spans do not overlap, so they are sorted by both ends
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (a->array[mid].x2 < element.x1)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < a->used && a->array[lo].x1 <= element.x2)
+		return 0;
+
+	if (a->used == a->size) {
+		a->size = a->size == 0 ? 4 : a->size * 2;
+		a->array = (KSpan *)xrealloc(a->array, a->size * sizeof(KSpan));
+	}
+	memmove(&a->array[lo + 1], &a->array[lo], (a->used - lo) * sizeof(KSpan));
+	a->array[lo] = element;
+	a->used++;
+	return 1;
+}
+
+uint
+kbds_hash(const void *key, size_t len)
+{
+	const unsigned char *p = key;
+	uint h = 2166136261u;
+
+	while (len--)
+		h = (h ^ *p++) * 16777619u;
+	return h;
+}
+
+/* returns the label of a matched string, or a new label for a new string */
+int
+kbds_labelof(const void *key, size_t len)
+{
+	KLabelKey *keys;
+	size_t i, j, size, mask;
+
+	if (kbds_nlabels * 2 >= kbds_labelhash.size) {
+		size = MAX(kbds_labelhash.size * 2, 64);
+		keys = xmalloc(size * sizeof(KLabelKey));
+		memset(keys, 0, size * sizeof(KLabelKey));
+		for (i = 0; i < kbds_labelhash.size; i++) {
+			if (!kbds_labelhash.keys[i].key)
+				continue;
+			j = kbds_hash(kbds_labelhash.keys[i].key, kbds_labelhash.keys[i].len);
+			for (j &= size - 1; keys[j].key; j = (j + 1) & (size - 1))
+				;
+			keys[j] = kbds_labelhash.keys[i];
 		}
+		free(kbds_labelhash.keys);
+		kbds_labelhash.keys = keys;
+		kbds_labelhash.size = size;
+	}
+
+	mask = kbds_labelhash.size - 1;
+	keys = kbds_labelhash.keys;
+	for (i = kbds_hash(key, len) & mask; keys[i].key; i = (i + 1) & mask) {
+		if (keys[i].len == len && !memcmp(keys[i].key, key, len))
+			return keys[i].label;
+	}
+	keys[i].key = key;
+	keys[i].len = len;
+	keys[i].label = kbds_nlabels;
+	return kbds_nlabels++;
+}
+
+void
+kbds_resetlabels(void)
+{
+	if (kbds_labelhash.keys)
+		memset(kbds_labelhash.keys, 0, kbds_labelhash.size * sizeof(KLabelKey));
+	kbds_nlabels = kbds_labelinputlen = 0;
+}
+
+char *
+kbds_label(int label)
+{
+	return kbds_labels + label * (kbds_labelwidth + 1);
+}
+
+/* Labels that all have the same width are a prefix-free code, so the widest
+ * label decides when the typed label is complete. Single labels keep one key
+ * free, double labels begin with the hand-picked flash_double_key_label. */
+void
+kbds_makelabels(int n)
+{
+	static char doubles[128][128], init;
+	int i, j, k, d, w, cap, a = LEN(flash_key_label);
+	char *l;
+
+	if (!init) {
+		for (i = 0; i < LEN(flash_double_key_label); i++)
+			doubles[(int)flash_double_key_label[i][0]][(int)flash_double_key_label[i][1]] = 1;
+		init = 1;
+	}
+
+	for (w = 1, cap = a - 1; cap < n && w < LEN(kbds_labelinput) - 1; w++)
+		cap = (w == 1) ? a * a : cap * a;
+
+	kbds_labelwidth = w;
+	kbds_labels = xrealloc(kbds_labels, MAX(n, 1) * (w + 1));
+
+	i = 0;
+	if (w == 2) {
+		for (; i < n && i < LEN(flash_double_key_label); i++)
+			strcpy(kbds_label(i), flash_double_key_label[i]);
+	}
+	for (k = 0; i < n; k++) {
+		l = kbds_label(i);
+		for (d = k, j = w - 1; j >= 0; j--, d /= a)
+			l[j] = *flash_key_label[d % a];
+		l[w] = '\0';
+		if (w != 2 || !doubles[(int)l[0]][(int)l[1]])
+			i++;
 	}
-	return 0;
 }
 
 int
-is_in_flash_used_double_label(Rune label) {
+kbds_overlaycmp(const void *a, const void *b)
+{
+	const KOverlay *o1 = a, *o2 = b;
+
+	/* labels are drawn over the highlights of their row */
+	if (o1->line != o2->line)
+		return (uintptr_t)o1->line < (uintptr_t)o2->line ? -1 : 1;
+	if (o1->mode != o2->mode)
+		return o1->mode == ATTR_HIGHLIGHT ? -1 : 1;
+	return o1->x1 - o2->x1;
+}
+
+void
+kbds_addoverlay(int y, int x1, int x2, ushort mode, const char *text)
+{
+	KOverlay *o;
+
+	if (kbds_overlay.used == kbds_overlay.size) {
+		kbds_overlay.size = kbds_overlay.size == 0 ? 16 : kbds_overlay.size * 2;
+		kbds_overlay.array = xrealloc(kbds_overlay.array,
+		                              kbds_overlay.size * sizeof(KOverlay));
+	}
+	o = &kbds_overlay.array[kbds_overlay.used++];
+	o->line = TLINE(y);
+	o->gen = LINEHDR(o->line)->gen;
+	o->x1 = x1;
+	o->x2 = x2;
+	o->mode = mode;
+	o->text[0] = '\0';
+	if (text)
+		snprintf(o->text, sizeof(o->text), "%s", text);
+	kbds_overlay.sorted = 0;
+}
+
+/* remove the items of the given modes */
+void
+kbds_clearoverlay(ushort mode)
+{
+	size_t i, n;
+
+	for (i = n = 0; i < kbds_overlay.used; i++) {
+		if (!(kbds_overlay.array[i].mode & mode))
+			kbds_overlay.array[n++] = kbds_overlay.array[i];
+	}
+	kbds_overlay.used = n;
+}
+
+/* show the part of the label that is not typed yet over the match */
+void
+kbds_drawlabel(KCursor c, int label)
+{
+	char *l = kbds_label(label);
+
+	if (strncmp(l, kbds_labelinput, kbds_labelinputlen))
+		return;
+	kbds_addoverlay(c.y, c.x + kbds_labelinputlen, c.x + kbds_labelwidth - 1,
+	                ATTR_FLASH_LABEL, l + kbds_labelinputlen);
+}
+
+void
+kbds_showlabels(void)
+{
 	int i;
-	for ( i = 0; i < flash_used_double_label.used; i++) {
-		if (label == flash_used_double_label.array[i]) {
+
+	kbds_clearoverlay(ATTR_FLASH_LABEL);
+	if (kbds_isurlmode()) {
+		for (i = 0; i < url_kcursor_record.used; i++)
+			kbds_drawlabel(url_kcursor_record.array[i].c, url_kcursor_record.array[i].label);
+	} else if (kbds_isregexmode()) {
+		for (i = 0; i < regex_kcursor_record.used; i++)
+			kbds_drawlabel(regex_kcursor_record.array[i].c, regex_kcursor_record.array[i].label);
+	}
+	tfulldirt();
+}
+
+int
+is_in_flash_used_label(Rune label) {
+	int i;
+	for ( i = 0; i < flash_used_label.used; i++) {
+		if (label == flash_used_label.array[i]) {
 			return 1;
 		}
 	}
 	return 0;
 }
 
-
 int
 is_in_flash_next_char_record(Rune label) {
 	Rune nc;
@@ -267,88 +577,181 @@ is_in_flash_next_char_record(Rune label) {
 	return 0;
 }
 
+/* Composes the status shown in the top right corner. It is empty if the
+ * keyboard selection is off or the cursor is behind it. */
 void
-kbds_drawstatusbar(int y)
+kbds_makestatus(char *status, size_t size)
 {
 	static char *modes[] = {
 		" MOVE ", "", " SELECT ", " RSELECT ", " LSELECT ",
 		" SEARCH FW ", " SEARCH BW ", " FIND FW ", " FIND BW ",
 		" FLASH ", " REGEX ", "  URL "
 	};
-	static char quant[20] = { ' ' };
-	static Glyph g;
-	int i, n, m;
-	int mlen, qlen;
+	int m, n = 0;
 
+	status[0] = '\0';
 	if (!kbds_in_use)
 		return;
 
-	g.mode = 0;
-	g.fg = kbselectfg;
-	g.bg = kbselectbg;
-
-	/* draw the mode */
-	if (y == 0) {
-		if (kbds_isurlmode())
-			m = 11;
-		else if (kbds_isregexmode())
-			m = 10;
-		else if (kbds_isflashmode())
-			m = 9;
-		else if (kbds_issearchmode())
-			m = 5 + (kbds_searchobj.dir < 0 ? 1 : 0);
-		else if (kbds_mode & KBDS_MODE_FIND)
-			m = 7 + (kbds_finddir < 0 ? 1 : 0);
-		else if (kbds_mode & KBDS_MODE_SELECT)
-			m = 2 + (kbds_seltype == SEL_RECTANGULAR ? 1 : 0);
-		else
-			m = kbds_mode;
-		mlen = strlen(modes[m]);
-		qlen = kbds_quant ? snprintf(quant+1, sizeof quant-1, "%i", kbds_quant) + 1 : 0;
-		/* do not draw the mode if the cursor is behind it. */
-		if (kbds_c.y != y || kbds_c.x < term.col - qlen - mlen) {
-			for (n = mlen, i = term.col-1; i >= 0 && n > 0; i--) {
-				g.u = modes[m][--n];
-				xdrawglyph(g, i, y);
-			}
-			for (n = qlen; i >= 0 && n > 0; i--) {
-				g.u = quant[--n];
-				xdrawglyph(g, i, y);
-			}
+	if (kbds_isurlmode())
+		m = 11;
+	else if (kbds_isregexmode())
+		m = 10;
+	else if (kbds_isflashmode())
+		m = 9;
+	else if (kbds_issearchmode())
+		m = 5 + (kbds_searchobj.dir < 0 ? 1 : 0);
+	else if (kbds_mode & KBDS_MODE_FIND)
+		m = 7 + (kbds_finddir < 0 ? 1 : 0);
+	else if (kbds_mode & KBDS_MODE_SELECT)
+		m = 2 + (kbds_seltype == SEL_RECTANGULAR ? 1 : 0);
+	else
+		m = kbds_mode;
+
+	/* number of the current match and the matches found so far */
+	if (kbds_index.highlight && kbds_index.qlen > 0) {
+		n = kbds_index.current
+			? snprintf(status, size, " %i/%i", kbds_index.current, kbds_index.nvalid)
+			: snprintf(status, size, " %i", kbds_index.nvalid);
+		if (kbds_index.scanned < kbds_index.to)
+			n += snprintf(status + n, size - n, "+");
+	}
+	if (kbds_quant)
+		n += snprintf(status + n, size - n, " %i", kbds_quant);
+	n += snprintf(status + n, size - n, "%s", modes[m]);
+
+	/* do not draw the mode if the cursor is behind it. */
+	if (kbds_c.y == 0 && kbds_c.x >= term.col - n)
+		status[0] = '\0';
+}
+
+/* Marks the rows of the status and the search bar dirty when they change,
+ * they are drawn with the row in kbds_overlayline(). */
+void
+kbds_updatestatus(void)
+{
+	char status[LEN(kbds_status)];
+	int bar = kbds_issearchmode() || kbds_isflashmode();
+
+	kbds_makestatus(status, sizeof(status));
+	if (strcmp(status, kbds_status)) {
+		strcpy(kbds_status, status);
+		term.dirty[0] = 1;
+	}
+	if (bar != kbds_searchbar) {
+		kbds_searchbar = bar;
+		term.dirty[term.row-1] = 1;
+	}
+}
+
+Glyph
+kbds_barglyph(Rune u, ushort mode)
+{
+	return (Glyph){ .u = u, .mode = mode, .fg = kbselectfg, .bg = kbselectbg };
+}
+
+void
+kbds_drawstatus(Line line)
+{
+	int i, n = strlen(kbds_status), x = term.col - n;
+
+	if (x > 0 && (line[x-1].mode & ATTR_WIDE))
+		line[x-1] = kbds_barglyph(' ', 0);
+	for (i = MAX(-x, 0); i < n; i++)
+		line[x+i] = kbds_barglyph(kbds_status[i], 0);
+}
+
+void
+kbds_drawsearchbar(Line line)
+{
+	int i, x;
+
+	for (x = 0; x < term.col; x++)
+		line[x] = kbds_barglyph(' ', 0);
+	/* search direction */
+	line[0].u = (kbds_searchobj.dir > 0) ? '/' : '?';
+	/* search string and cursor */
+	for (i = 0; i < kbds_searchobj.len && i+1 < term.col; i++) {
+		line[i+1] = kbds_barglyph(kbds_searchobj.str[i].u,
+		                          kbds_searchobj.str[i].mode & (ATTR_WIDE | ATTR_WDUMMY));
+		if (i == kbds_searchobj.cx)
+			line[i+1].mode |= ATTR_REVERSE;
+	}
+	if (i == kbds_searchobj.cx && i+1 < term.col)
+		line[i+1].mode |= ATTR_REVERSE;
+}
+
+/* Returns the line with the overlay of screen row y drawn over it. The line
+ * itself is returned when the row has no overlay, otherwise a copy that is
+ * valid until the next call. */
+Line
+kbds_overlayline(Line line, int y)
+{
+	static Glyph *buf;
+	static int bufsize;
+	KOverlay *o = NULL, *end = NULL;
+	size_t lo, hi, mid;
+	int x, i;
+	int status = (y == 0 && kbds_status[0]);
+	int bar = (y == term.row-1 && kbds_searchbar);
+
+	if (!kbds_in_use)
+		return line;
+
+	if (kbds_overlay.used > 0) {
+		if (!kbds_overlay.sorted) {
+			qsort(kbds_overlay.array, kbds_overlay.used, sizeof(KOverlay), kbds_overlaycmp);
+			kbds_overlay.sorted = 1;
+		}
+		for (lo = 0, hi = kbds_overlay.used; lo < hi; ) {
+			mid = (lo + hi) / 2;
+			if ((uintptr_t)kbds_overlay.array[mid].line < (uintptr_t)line)
+				lo = mid + 1;
+			else
+				hi = mid;
 		}
+		end = &kbds_overlay.array[kbds_overlay.used];
+		if (lo < kbds_overlay.used && kbds_overlay.array[lo].line == line)
+			o = &kbds_overlay.array[lo];
 	}
+	if (!o && !status && !bar)
+		return line;
 
-	/* draw the search bar */
-	if (y == term.row-1 && (kbds_issearchmode() || kbds_isflashmode())) {
-		/* search bar */
-		for (g.u = ' ', i = 0; i < term.col; i++)
-			xdrawglyph(g, i, y);
-		/* search direction */
-		g.u = (kbds_searchobj.dir > 0) ? '/' : '?';
-		xdrawglyph(g, 0, y);
-		/* search string and cursor */
-		for (i = 0; i < kbds_searchobj.len; i++) {
-			g.u = kbds_searchobj.str[i].u;
-			g.mode = kbds_searchobj.str[i].mode;
-			if (g.mode & ATTR_WDUMMY)
-				continue;
-			if (g.mode & ATTR_WIDE) {
-				MODBIT(g.mode, i == kbds_searchobj.cx, ATTR_REVERSE);
-				xdrawglyph(g, i + 1, y);
-			} else if (i == kbds_searchobj.cx) {
-				g.mode = ATTR_WIDE;
-				xdrawglyph(g, i + 1, y);
-				g.mode = ATTR_REVERSE;
-				xdrawglyph(g, i + 1, y);
-			} else if (g.u != ' ') {
-				g.mode = ATTR_WIDE;
-				xdrawglyph(g, i + 1, y);
+	if (bufsize < term.col) {
+		bufsize = term.col;
+		buf = xrealloc(buf, bufsize * sizeof(Glyph));
+	}
+	memcpy(buf, line, term.col * sizeof(Glyph));
+
+	for (; o && o < end && o->line == line; o++) {
+		if (o->gen != LINEHDR(line)->gen)
+			continue;
+		if (o->mode == ATTR_HIGHLIGHT) {
+			for (x = MAX(o->x1, 0); x <= o->x2 && x < term.col; x++)
+				buf[x].mode |= ATTR_HIGHLIGHT;
+			continue;
+		}
+		for (i = 0, x = o->x1; o->text[i] && x < term.col; i++, x++) {
+			/* do not leave half of a wide character around the label */
+			if ((buf[x].mode & ATTR_WIDE) && x+1 < term.col) {
+				buf[x+1].u = ' ';
+				buf[x+1].mode &= ~ATTR_WDUMMY;
+			} else if ((buf[x].mode & ATTR_WDUMMY) && x > 0 &&
+			           !(buf[x-1].mode & ATTR_FLASH_LABEL)) {
+				buf[x-1].u = ' ';
+				buf[x-1].mode &= ~(ATTR_WIDE | ATTR_BOXDRAW);
 			}
+			buf[x].u = o->text[i];
+			buf[x].mode &= ~(ATTR_WIDE | ATTR_WDUMMY | ATTR_BOXDRAW);
+			buf[x].mode |= ATTR_FLASH_LABEL;
 		}
-		g.u = ' ';
-		g.mode = (i == kbds_searchobj.cx) ? ATTR_REVERSE : 0;
-		xdrawglyph(g, i + 1, y);
 	}
+
+	if (bar)
+		kbds_drawsearchbar(buf);
+	if (status)
+		kbds_drawstatus(buf);
+	return buf;
 }
 
 void
@@ -372,7 +775,7 @@ kbds_deletechar(void)
 int
 kbds_insertchar(Rune u)
 {
-	int w = (wcwidth(u) > 1) ? 2 : 1;
+	int w = (runewidth(u) > 1) ? 2 : 1;
 	int cx = kbds_searchobj.cx;
 	int size = kbds_searchobj.maxlen - cx - w;
 
@@ -484,7 +887,6 @@ void
 kbds_setmode(int mode)
 {
 	kbds_mode = mode;
-	term.dirty[0] = 1;
 }
 
 void
@@ -509,37 +911,15 @@ kbds_copytoclipboard(void)
 	} else {
 		selextend(kbds_c.x, kbds_c.y, kbds_seltype, 1);
 	}
-	xsetsel(getsel());
+	xownsel();
 }
 
 void
 kbds_clearhighlights(void)
 {
-	int x, y;
-	Line line;
-	Rune u;
-
-	for (y = (IS_SET(MODE_ALTSCREEN) ? 0 : -term.histf); y < term.row; y++) {
-		line = TLINEABS(y);
-		for (x = 0; x < term.col; x++) {
-			if ((kbds_isurlmode()||kbds_isregexmode()) && line[x].mode & ATTR_FLASH_LABEL && hit_input_first == 1 && is_in_flash_used_label(line[x].u) == 1) {
-				line[x].mode &= ~ATTR_FLASH_LABEL;
-				u = line[x].u;
-				line[x].u = line[x].ubk;
-				line[x].ubk = u; //backup the first hit label for judge in double hit
-				continue;
-			}
-			if ((kbds_isurlmode()||kbds_isregexmode()) && line[x].mode & ATTR_FLASH_LABEL && hit_input_first == 1 && is_in_flash_used_double_label(line[x].u) == 1 && line[x-1].ubk == hit_input_first_label) {
-				continue;
-			}
-			if(hit_input_first == 0)
-				line[x].mode &= ~ATTR_HIGHLIGHT;
-			if (line[x].mode & ATTR_FLASH_LABEL) {
-				line[x].mode &= ~ATTR_FLASH_LABEL;
-				line[x].u = line[x].ubk;
-			}
-		}
-	}
+	kbds_index.highlight = kbds_index.current = 0;
+	kbds_pending.active = 0;
+	kbds_clearoverlay(ATTR_HIGHLIGHT | ATTR_FLASH_LABEL);
 	tfulldirt();
 }
 
@@ -608,14 +988,13 @@ kbds_isdelim(KCursor c, int xoff, wchar_t *delims)
 {
 	if (xoff && !kbds_moveforward(&c, xoff, KBDS_WRAP_LINE))
 		return 1;
-	return wcschr(delims, c.line[c.x].u) != NULL;
+	return wcschr(delims, GLYPHRUNE(c.line[c.x].u)) != NULL;
 }
 
 void
 kbds_jumptoprompt(int dy)
 {
 	int x = 0, y = kbds_c.y + dy, bot, prevscr;
-	Line line;
 
 	for (bot = kbds_bot(); bot > kbds_top(); bot--) {
 		if (tlinelen(TLINE(bot)) > 0)
@@ -627,16 +1006,15 @@ kbds_jumptoprompt(int dy)
 
 	LIMIT(y, kbds_top(), bot);
 
-	for (; y >= kbds_top() && y <= bot; y += dy) {
-		for (line = TLINE(y), x = 0; x < term.col; x++) {
-			if (line[x].extra & EXT_FTCS_PROMPT_PS1)
-				goto found;
-		}
-		x = 0;
+	if (LINEHDR(TLINE(y))->prompt >= 0) {
+		x = LINEHDR(TLINE(y))->prompt;
+	} else if ((y = findprompt(y - term.scr, dy)) != INT_MIN &&
+	           BETWEEN(y + term.scr, kbds_top(), bot)) {
+		y += term.scr;
+		x = LINEHDR(TLINE(y))->prompt;
+	} else {
+		y = dy < 0 ? kbds_top() : bot;
 	}
-
-found:
-	LIMIT(y, kbds_top(), bot);
 	kbds_moveto(x, y);
 
 	/* align the prompt to the top unless select mode is on */
@@ -647,37 +1025,300 @@ found:
 	}
 }
 
+void
+kbds_scanindex(const Rune *text, int from, int to, KMatchArray *m)
+{
+	const Rune *q = kbds_index.query;
+	int shift[256];
+	int i, qlen = kbds_index.qlen, last = qlen - 1;
+
+	/* Horspool with the bad character table indexed by the low byte */
+	for (i = 0; i < LEN(shift); i++)
+		shift[i] = qlen;
+	for (i = 0; i < last; i++)
+		shift[q[i] & 0xff] = last - i;
+
+	for (i = from; i < to && i + qlen <= kbds_index.len; i += shift[text[i+last] & 0xff]) {
+		if (text[i+last] == q[last] && !memcmp(text + i, q, last * sizeof(Rune)))
+			insert_match_array(m, i);
+	}
+}
+
+void *
+kbds_searchworker(void *arg)
+{
+	KMatchArray m = { 0 };
+	int i, from, to, cancel;
+
+	for (from = kbds_index.from;; from = to) {
+		to = MIN(from + KBDS_SEARCHCHUNK, kbds_index.to);
+		m.used = 0;
+		kbds_scanindex(kbds_worker.text, from, to, &m);
+
+		pthread_mutex_lock(&kbds_worker.lock);
+		if (!(cancel = kbds_worker.cancel)) {
+			for (i = 0; i < m.used; i++)
+				insert_match_array(&kbds_worker.found, m.array[i]);
+			kbds_worker.scanned = to;
+			kbds_worker.done = (to == kbds_index.to);
+		}
+		pthread_mutex_unlock(&kbds_worker.lock);
+
+		if (cancel || to == kbds_index.to)
+			break;
+	}
+	free(m.array);
+	return NULL;
+}
+
+/* stop the worker, the matches it has not scanned are dropped */
+void
+kbds_stopsearch(void)
+{
+	if (!kbds_worker.running)
+		return;
+
+	pthread_mutex_lock(&kbds_worker.lock);
+	kbds_worker.cancel = 1;
+	pthread_mutex_unlock(&kbds_worker.lock);
+	pthread_join(kbds_worker.thread, NULL);
+
+	kbds_worker.running = 0;
+	kbds_worker.found.used = 0;
+	kbds_index.qlen = kbds_index.match.used = kbds_index.nvalid = 0;
+	kbds_pending.active = 0;
+}
+
+void
+kbds_buildindex(void)
+{
+	Line line;
+	int x, y, len, n, top;
+
+	top = IS_SET(MODE_ALTSCREEN) ? 0 : -term.histf;
+	if (kbds_index.valid && kbds_index.gen == term.textgen &&
+	    kbds_index.top == top && kbds_index.row == term.row &&
+	    kbds_index.col == term.col)
+		return;
+
+	kbds_stopsearch();
+	n = (term.row - top) * (term.col + 1);
+	if (n > kbds_index.size) {
+		kbds_index.text = xrealloc(kbds_index.text, n * sizeof(Rune));
+		kbds_index.pos = xrealloc(kbds_index.pos, n * sizeof(KPos));
+		kbds_index.size = n;
+	}
+
+	for (n = 0, y = top; y < term.row; y++) {
+		line = TLINEABS(y);
+		len = tlinelen(line);
+		for (x = 0; x < len; x++) {
+			if (line[x].mode & ATTR_WDUMMY)
+				continue;
+			kbds_index.text[n] = GLYPHRUNE(line[x].u);
+			kbds_index.pos[n].x = x;
+			kbds_index.pos[n++].y = y;
+		}
+		/* the separator also marks the end of the line for the cursor */
+		if (len == 0 || !(line[len-1].mode & ATTR_WRAP) || y == term.row-1) {
+			kbds_index.text[n] = 0;
+			kbds_index.pos[n].x = len;
+			kbds_index.pos[n++].y = y;
+		}
+	}
+
+	kbds_index.len = n;
+	kbds_index.gen = term.textgen;
+	kbds_index.top = top;
+	kbds_index.row = term.row;
+	kbds_index.col = term.col;
+	kbds_index.qlen = kbds_index.match.used = 0;
+	kbds_index.folded = 0;
+	kbds_index.valid = 1;
+}
+
+Rune *
+kbds_indextext(int ignorecase)
+{
+	int i;
+
+	if (!ignorecase)
+		return kbds_index.text;
+
+	if (!kbds_index.folded) {
+		kbds_index.fold = xrealloc(kbds_index.fold, kbds_index.size * sizeof(Rune));
+		for (i = 0; i < kbds_index.len; i++)
+			kbds_index.fold[i] = casefold(kbds_index.text[i]);
+		kbds_index.folded = 1;
+	}
+	return kbds_index.fold;
+}
+
+void
+kbds_startsearch(const Rune *text)
+{
+	kbds_index.scanned = kbds_index.from;
+	if (kbds_index.to - kbds_index.from > KBDS_SEARCHCHUNK) {
+		kbds_worker.text = text;
+		kbds_worker.cancel = kbds_worker.done = 0;
+		kbds_worker.scanned = kbds_index.from;
+		kbds_worker.found.used = 0;
+		kbds_worker.running = pthread_create(&kbds_worker.thread, NULL,
+		                                     kbds_searchworker, NULL) == 0;
+		if (kbds_worker.running)
+			return;
+	}
+	kbds_scanindex(text, kbds_index.from, kbds_index.to, &kbds_index.match);
+	kbds_index.scanned = kbds_index.to;
+}
+
+/* offset of the first character of row y or below it */
 int
-kbds_ismatch(KCursor c)
+kbds_rowoffset(int y)
 {
-	KCursor p, m = c;
-	int i, next;
+	int lo = 0, hi = kbds_index.len, mid;
 
-	if (c.x + kbds_searchobj.len > c.len && (!kbds_iswrapped(&c) || c.y >= kbds_bot()))
-		return 0;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (kbds_index.pos[mid].y < y)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
 
-	if (kbds_searchobj.wordonly && !kbds_isdelim(c, -1, kbds_sdelim))
-		return 0;
+int
+kbds_isindexdelim(int off)
+{
+	Rune u = (off < 0 || off >= kbds_index.len) ? 0 : kbds_index.text[off];
 
-	for (next = 0, i = 0; i < kbds_searchobj.len; i++) {
-		if (kbds_searchobj.str[i].mode & ATTR_WDUMMY)
-			continue;
-		if ((next++ && !kbds_moveforward(&c, 1, KBDS_WRAP_LINE)) ||
-		    (!kbds_searchobj.ignorecase && kbds_searchobj.str[i].u != c.line[c.x].u) ||
-		    (kbds_searchobj.ignorecase && casefold(kbds_searchobj.str[i].u) != casefold(c.line[c.x].u)))
-			return 0;
+	return u == 0 || wcschr(kbds_sdelim, u) != NULL;
+}
+
+int
+kbds_iswordmatch(int off)
+{
+	return !kbds_searchobj.wordonly ||
+	       (kbds_isindexdelim(off - 1) && kbds_isindexdelim(off + kbds_index.qlen));
+}
+
+/* count the valid matches from the i-th match on */
+void
+kbds_countmatches(int i)
+{
+	if (i == 0)
+		kbds_index.nvalid = 0;
+	for (; i < kbds_index.match.used; i++)
+		kbds_index.nvalid += kbds_iswordmatch(kbds_index.match.array[i]);
+}
+
+void
+kbds_findmatches(int onscreen)
+{
+	static Rune *q;
+	static int qsize;
+	Rune *text;
+	int i, n, qlen, from, to, restart = 0, ic = kbds_searchobj.ignorecase;
+
+	kbds_buildindex();
+
+	if (qsize < kbds_searchobj.len + 1) {
+		qsize = kbds_searchobj.len + 1;
+		q = xrealloc(q, qsize * sizeof(Rune));
+	}
+	for (qlen = 0, i = 0; i < kbds_searchobj.len; i++) {
+		if (!(kbds_searchobj.str[i].mode & ATTR_WDUMMY))
+			q[qlen++] = ic ? casefold(kbds_searchobj.str[i].u) : kbds_searchobj.str[i].u;
 	}
 
-	if (kbds_searchobj.wordonly && !kbds_isdelim(c, 1, kbds_sdelim))
-		return 0;
+	if (qlen == 0) {
+		kbds_stopsearch();
+		kbds_index.qlen = kbds_index.match.used = kbds_index.nvalid = 0;
+		return;
+	}
 
-	for (c = m, i = 0; i < kbds_searchobj.len; i++) {
-		if (!(kbds_searchobj.str[i].mode & ATTR_WDUMMY)) {
-			c.line[c.x].mode |= ATTR_HIGHLIGHT;
-			kbds_moveforward(&c, 1, KBDS_WRAP_LINE | KBDS_WRAP_EDGE);
+	/* flash labels are only shown on the screen */
+	from = onscreen ? kbds_rowoffset(-term.scr) : 0;
+	to = onscreen ? kbds_rowoffset(term.row-1 - term.scr) : kbds_index.len;
+
+	if (kbds_index.qlen == qlen && kbds_index.ignorecase == ic &&
+	    kbds_index.from == from && kbds_index.to == to &&
+	    !memcmp(kbds_index.query, q, qlen * sizeof(Rune))) {
+		/* the same search is running or done, wordonly may differ */
+		kbds_countmatches(0);
+		return;
+	}
+
+	text = kbds_indextext(ic);
+	if (kbds_index.qlen > 0 && kbds_index.qlen <= qlen && kbds_index.ignorecase == ic &&
+	    kbds_index.from == from && kbds_index.to == to && kbds_index.scanned == to &&
+	    !memcmp(kbds_index.query, q, kbds_index.qlen * sizeof(Rune))) {
+		/* the query was extended, filter the previous matches */
+		for (n = 0, i = 0; i < kbds_index.match.used; i++) {
+			if (kbds_index.match.array[i] + qlen <= kbds_index.len &&
+			    !memcmp(text + kbds_index.match.array[i] + kbds_index.qlen,
+			            q + kbds_index.qlen, (qlen - kbds_index.qlen) * sizeof(Rune)))
+				kbds_index.match.array[n++] = kbds_index.match.array[i];
 		}
+		kbds_index.match.used = n;
+	} else {
+		kbds_stopsearch();
+		kbds_index.match.used = 0;
+		restart = 1;
 	}
 
+	kbds_index.query = xrealloc(kbds_index.query, qlen * sizeof(Rune));
+	memcpy(kbds_index.query, q, qlen * sizeof(Rune));
+	kbds_index.qlen = qlen;
+	kbds_index.ignorecase = ic;
+	kbds_index.from = from;
+	kbds_index.to = to;
+	kbds_index.current = 0;
+	if (restart)
+		kbds_startsearch(text);
+	kbds_countmatches(0);
+}
+
+KCursor
+kbds_matchcursor(int off)
+{
+	KCursor c;
+
+	c.x = kbds_index.pos[off].x;
+	c.y = kbds_index.pos[off].y + term.scr;
+	c.line = TLINE(c.y);
+	c.len = tlinelen(c.line);
+	return c;
+}
+
+/* highlight n characters from c on and return the position after them */
+KCursor
+kbds_addhighlight(KCursor c, int n, int wrap)
+{
+	int x1, x2, y, moved;
+
+	for (x1 = c.x; n > 0; n--) {
+		x2 = c.x;
+		y = c.y;
+		moved = kbds_moveforward(&c, 1, wrap);
+		if (!moved || n == 1 || c.y != y) {
+			kbds_addoverlay(y, x1, x2, ATTR_HIGHLIGHT, NULL);
+			x1 = c.x;
+		}
+		if (!moved)
+			break;
+	}
+	return c;
+}
+
+void
+kbds_markmatch(KCursor c)
+{
+	KCursor p, m = c;
+
+	c = kbds_addhighlight(c, kbds_index.qlen, KBDS_WRAP_LINE | KBDS_WRAP_EDGE);
+
 	if (kbds_isflashmode()) {
 		/* Move the cursor to the end of the previous line if the line
 		 * was not wrapped, because we want to keep the label on the
@@ -690,13 +1331,10 @@ kbds_ismatch(KCursor c)
 				c = p;
 			}
 		}
-		c.line[c.x].ubk = c.line[c.x].u;
-		insert_char_array(&flash_next_char_record, c.line[c.x].u);
+		insert_char_array(&flash_next_char_record, GLYPHRUNE(c.line[c.x].u));
 		insert_kcursor_array(&flash_kcursor_record, c);
 		insert_kcursor_array(&flash_kcursor_match, m);
 	}
-
-	return 1;
 }
 
 int
@@ -706,6 +1344,7 @@ kbds_searchall(void)
 	int count = 0;
 	int i, j, is_invalid_label;
 	CharArray valid_label;
+	char label[2] = { 0 };
 	Rune nc;
 
 	init_char_array(&flash_next_char_record, 1);
@@ -717,14 +1356,14 @@ kbds_searchall(void)
 	if (!kbds_searchobj.len)
 		return 0;
 
-	int begin = kbds_isflashmode() ? 0 : kbds_top();
-	int end = kbds_isflashmode() ? MAX(term.row-2, 0) : kbds_bot();
+	kbds_findmatches(kbds_isflashmode());
+	kbds_index.highlight = !kbds_isflashmode();
 
-	for (c.y = begin; c.y <= end; c.y++) {
-		c.line = TLINE(c.y);
-		c.len = tlinelen(c.line);
-		for (c.x = 0; c.x < c.len; c.x++)
-			count += kbds_ismatch(c);
+	for (i = 0; i < kbds_index.match.used; i++) {
+		if (!kbds_iswordmatch(kbds_index.match.array[i]))
+			continue;
+		kbds_markmatch(kbds_matchcursor(kbds_index.match.array[i]));
+		count++;
 	}
 
 	for (i = 0; i < LEN(flash_key_label); i++) {
@@ -742,343 +1381,232 @@ kbds_searchall(void)
 		}
 	}
 
-	for ( i = 0; i < flash_kcursor_record.used; i++) {
-		if (i < valid_label.used) {
-			flash_kcursor_record.array[i].line[flash_kcursor_record.array[i].x].mode |= ATTR_FLASH_LABEL;
-			insert_char_array(&flash_used_label, valid_label.array[i]);
-			flash_kcursor_record.array[i].line[flash_kcursor_record.array[i].x].u = valid_label.array[i];
-		}
+	for ( i = 0; i < flash_kcursor_record.used && i < valid_label.used; i++) {
+		c = flash_kcursor_record.array[i];
+		label[0] = valid_label.array[i];
+		kbds_addoverlay(c.y, c.x, c.x, ATTR_FLASH_LABEL, label);
+		insert_char_array(&flash_used_label, valid_label.array[i]);
 	}
 
 	reset_char_array(&valid_label);
 
 	tfulldirt();
 
-	return count;
+	return (kbds_index.scanned < kbds_index.to) ? -1 : count;
 }
 
-int apply_regex_result(KCursor c, RegexResult result) {
-	KCursor m;
-	RegexKCursor regex_kcursor, rd;
-	KCursor target_cursor;
+void
+kbds_freepatterns(void)
+{
 	int i;
-	int is_cross_match;
-	int is_same_value_regex = 0;
-
-	target_cursor.y = c.y;
-	target_cursor.line = TLINE(target_cursor.y);
-	target_cursor.len = tlinelen(target_cursor.line);
-	target_cursor.x = c.x;
-
-	// get the real position of match cursor
-	for(i = 0; i < result.start; i++) {
-		if (target_cursor.line[target_cursor.x].mode & ATTR_WDUMMY) {
-			i--;
-		}
-		kbds_moveforward(&target_cursor, 1, KBDS_WRAP_LINE);
-	}
 
-	m.y = target_cursor.y;
-	m.line = TLINE(m.y);
-	m.len = tlinelen(m.line);
-	m.x = target_cursor.x;
-	regex_kcursor.c = m;
-	regex_kcursor.len = result.len;
-	regex_kcursor.matched_substring = result.matched_substring;
-	regex_kcursor.c.line[regex_kcursor.c.x].ubk = regex_kcursor.c.line[regex_kcursor.c.x].u;
-	is_cross_match = 0;
-	// check the match position is cross match
-	for (i = 0; i < regex_kcursor_record.used; i++) {
-		rd = regex_kcursor_record.array[i];
-
-		if (regex_kcursor.c.y == rd.c.y &&
-			(regex_kcursor.c.x == rd.c.x ||
-				(regex_kcursor.c.x > rd.c.x && regex_kcursor.c.x <= (rd.c.x + rd.len - 1)) ||
-				(regex_kcursor.c.x < rd.c.x && (regex_kcursor.c.x + regex_kcursor.len -1) >= rd.c.x)
-			)
-		   ) {
-			is_cross_match = 1;
-			break;
-		}
+	for (i = 0; i < kbds_nregex; i++)
+		pcre2_code_free(kbds_regex[i]);
+	free(kbds_regex);
+	kbds_regex = NULL;
+	kbds_nregex = 0;
+	if (kbds_regexmd)
+		pcre2_match_data_free(kbds_regexmd);
+	kbds_regexmd = NULL;
+}
 
-		// check if the matched string is already in the cache
-		if (enable_regex_same_label && wcscmp(regex_kcursor.matched_substring, regex_kcursor_record.array[i].matched_substring) == 0) {
-			is_same_value_regex = 1;
+void
+kbds_compilepatterns(void)
+{
+	PCRE2_UCHAR buffer[256];
+	PCRE2_UCHAR32 *wpattern;
+	PCRE2_SIZE erroffset;
+	wchar_t *pattern;
+	uint32_t ncaptures, maxcaptures = 0;
+	size_t i, len;
+	int n, errorcode;
+	pcre2_code *re;
+
+	kbds_freepatterns();
+
+	for (n = 0; pattern_list[n] != NULL; n++)
+		;
+	kbds_regex = xmalloc(MAX(n, 1) * sizeof(*kbds_regex));
+
+	for (n = 0; pattern_list[n] != NULL; n++) {
+		// convert the pattern into PCRE2_UCHAR32
+		if ((len = mbstowcs(NULL, pattern_list[n], 0)) == (size_t)-1) {
+			fprintf(stderr, "Invalid multibyte sequence in pattern: %s\n", pattern_list[n]);
+			continue;
+		}
+		pattern = xmalloc((len + 1) * sizeof(wchar_t));
+		wpattern = xmalloc((len + 1) * sizeof(PCRE2_UCHAR32));
+		mbstowcs(pattern, pattern_list[n], len + 1);
+		for (i = 0; i <= len; i++)
+			wpattern[i] = (PCRE2_UCHAR32)pattern[i];
+
+		// the screen is matched at once with the lines separated by '\n'
+		re = pcre2_compile(wpattern, len, PCRE2_MULTILINE, &errorcode, &erroffset, NULL);
+		free(pattern);
+		free(wpattern);
+		if (!re) {
+			pcre2_get_error_message(errorcode, buffer, sizeof(buffer));
+			fprintf(stderr, "PCRE2 compilation failed at offset %zu: %ls\n", erroffset, (wchar_t *)buffer);
+			continue;
 		}
-	}
-	if (is_cross_match == 0) { // if new position match, record it
-		insert_regex_kcursor_array(&regex_kcursor_record, regex_kcursor);
-	} else {
-		free(regex_kcursor.matched_substring);
-	}
-
-	if (is_same_value_regex || is_cross_match)
-		return 0;
-	else
-		return 1;
-}
 
-int get_position_from_regex(KCursor c, char *pattern_mb, wchar_t *wstr) {
-	RegexResult result;
-	result.matched_substring = NULL;
-	int new_count = 0;
-	int label_need = 0;
-
-	// check if the pattern contains any subpatterns
-	int num_subpatterns = 0;
-	for (int i = 0; pattern_mb[i] != '\0'; ++i) {
-		if (pattern_mb[i] == '(') {
-			num_subpatterns++;
+		// the first subpattern is the range to be copied
+		pcre2_pattern_info(re, PCRE2_INFO_CAPTURECOUNT, &ncaptures);
+		if (ncaptures == 0) {
+			fprintf(stderr, "No subpatterns found in pattern: %s\n", pattern_list[n]);
+			pcre2_code_free(re);
+			continue;
 		}
-	}
 
-	// if there are no subpatterns, exit with an error
-	if (num_subpatterns == 0) {
-		printf("No subpatterns found in pattern: %s\n", pattern_mb);
-		return 0;
+		// the interpreter is used if JIT is not available
+		pcre2_jit_compile(re, PCRE2_JIT_COMPLETE);
+		maxcaptures = MAX(maxcaptures, ncaptures);
+		kbds_regex[kbds_nregex++] = re;
 	}
 
-	// convert the pattern into wide character string
-	size_t pattern_len = mbstowcs(NULL, pattern_mb, 0) + 1;
-	wchar_t *pattern = xmalloc(pattern_len * sizeof(wchar_t));
-
-	mbstowcs(pattern, pattern_mb, pattern_len);
+	kbds_regexmd = pcre2_match_data_create(maxcaptures + 1, NULL);
+}
 
-	// convert the pattern into PCRE2_UCHAR32
-	PCRE2_UCHAR32 *wpattern = xmalloc(pattern_len * sizeof(PCRE2_UCHAR32));
+int apply_regex_result(RegexResult result) {
+	RegexKCursor regex_kcursor;
+	KSpan span;
 
-	for (size_t i = 0; i < pattern_len; i++) {
-		wpattern[i] = (PCRE2_UCHAR32)pattern[i];
-	}
+	regex_kcursor.c = kbds_matchcursor(result.start);
+	regex_kcursor.len = result.len;
+	regex_kcursor.matched_substring = result.matched_substring;
+	regex_kcursor.label = -1;
 
-	// create the regex object
-	int errorcode;
-	PCRE2_SIZE erroffset;
-	pcre2_code *re = pcre2_compile(wpattern, PCRE2_ZERO_TERMINATED, 0, &errorcode, &erroffset, NULL);
-	free(pattern);
-	free(wpattern);
-	if (!re) {
-		PCRE2_UCHAR buffer[256];
-		pcre2_get_error_message(errorcode, buffer, sizeof(buffer));
-		fprintf(stderr, "PCRE2 compilation failed at offset %zu: %ls\n", erroffset, (wchar_t *)buffer);
+	// a match is dropped if it crosses a match on the same row
+	span.x1 = regex_kcursor.c.x;
+	span.x2 = regex_kcursor.c.x + MAX(regex_kcursor.len, 1) - 1;
+	if (regex_kcursor.c.y >= 0 && regex_kcursor.c.y < term.row &&
+	    !insert_span_array(&regex_row_spans[regex_kcursor.c.y], span)) {
+		free(regex_kcursor.matched_substring);
 		return 0;
 	}
 
-	// convert the text into PCRE2_UCHAR32
-	size_t len = wcslen(wstr);
-	PCRE2_UCHAR32 *wtext = xmalloc((len + 1) * sizeof(PCRE2_UCHAR32));
+	insert_regex_kcursor_array(&regex_kcursor_record, regex_kcursor);
+	return 1;
+}
 
-	for (size_t i = 0; i < len; i++) {
-		wtext[i] = (PCRE2_UCHAR32)wstr[i];
-	}
-	wtext[len] = 0;
+int get_position_from_regex(pcre2_code *re, PCRE2_UCHAR32 *text, size_t len, int base) {
+	RegexResult result;
+	PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(kbds_regexmd);
+	PCRE2_SIZE start_offset = 0, end;
+	int count = 0;
+	int ret;
+	size_t i;
 
-	pcre2_match_data *match_data = pcre2_match_data_create_from_pattern(re, NULL);
-	PCRE2_SIZE start_offset = 0;
 	while (start_offset < len) {
-		int ret = pcre2_match(re, wtext, len, start_offset, 0, match_data, NULL);
-		if (ret >= 0) {
-			PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(match_data);
-			result.start = ovector[2];
-			result.len = ovector[3] - ovector[2];
-
-			// get the matched string
-			wchar_t *match_str = xmalloc((result.len + 1) * sizeof(wchar_t));
-
-			wcsncpy(match_str, wstr + result.start, result.len);
-			match_str[result.len] = L'\0';
-			result.matched_substring = match_str;
-			new_count = apply_regex_result(c, result);
-			label_need = label_need + new_count;
-			start_offset = ovector[1];
-		} else if (ret == PCRE2_ERROR_NOMATCH) {
-			break;
-		} else {
+		ret = pcre2_match(re, text, len, start_offset, 0, kbds_regexmd, NULL);
+		if (ret < 0)
 			break;
+
+		// a match must not cross a line, retry within the line where it starts
+		for (end = ovector[0]; end < ovector[1] && text[end] != '\n'; end++)
+			;
+		if (end < ovector[1]) {
+			ret = pcre2_match(re, text, end, ovector[0], 0, kbds_regexmd, NULL);
+			if (ret < 0) {
+				start_offset = end + 1;
+				continue;
+			}
 		}
+		start_offset = MAX(ovector[1], ovector[0] + 1);
+
+		// the first subpattern might not have participated in the match
+		if (ovector[2] == PCRE2_UNSET)
+			continue;
+		result.start = base + ovector[2];
+		result.len = ovector[3] - ovector[2];
+
+		// get the matched string
+		result.matched_substring = xmalloc((result.len + 1) * sizeof(wchar_t));
+		for (i = 0; i < result.len; i++)
+			result.matched_substring[i] = (wchar_t)text[ovector[2] + i];
+		result.matched_substring[result.len] = L'\0';
+		count += apply_regex_result(result);
 	}
 
-	// free the regex object and the converted string
-	pcre2_match_data_free(match_data);
-	pcre2_code_free(re);
-	free(wtext);
-	return label_need;
+	return count;
 }
 
 int
-kbds_ismatch_regex(unsigned int begin, unsigned int end, unsigned int len)
+kbds_ismatch_regex(void)
 {
-	wchar_t *target_str;
-	unsigned int i,j;
-	char *pattern;
-	unsigned h = 0;
-	KCursor c,begin_c;
+	static PCRE2_UCHAR32 *text;
+	static int size;
+	int i, begin, end, len;
+	int count = 0;
 
-	if (len == 0)
-		return 0;
+	if (!kbds_regex)
+		kbds_compilepatterns();
 
-	target_str = xmalloc((len + 1) * sizeof(wchar_t));
-	begin_c.y = begin;
-	begin_c.line = TLINE(begin);
-	begin_c.len = tlinelen(begin_c.line);
-	begin_c.x = 0;
-	int label_need = 0;
-	int new_count = 0;
+	// the visible part of the search index, with '\n' between the lines
+	kbds_buildindex();
+	for (begin = 0; begin < kbds_index.len && kbds_index.pos[begin].y + term.scr < 0; begin++)
+		;
+	for (end = begin; end < kbds_index.len && kbds_index.pos[end].y + term.scr < term.row; end++)
+		;
+	if ((len = end - begin) == 0)
+		return 0;
 
-	for (c.y = begin; c.y <= end; c.y++) {
-		c.line = TLINE(c.y);
-		c.len = tlinelen(c.line);
-		for (j = 0; j < c.len; j++) {
-			if (!(c.line[j].mode & ATTR_WDUMMY) ) {
-				target_str[h] = (wchar_t)c.line[j].u;
-				h++;
-			}
-		}
-		target_str[h] = L'\0';
+	if (len > size) {
+		size = len;
+		text = xrealloc(text, size * sizeof(PCRE2_UCHAR32));
 	}
+	for (i = 0; i < len; i++)
+		text[i] = kbds_index.text[begin + i] ? kbds_index.text[begin + i] : '\n';
 
-	for (i=0; pattern_list[i] != NULL; i++) {
-		pattern = pattern_list[i];
-		new_count = get_position_from_regex(begin_c,pattern, target_str);
-		label_need = label_need + new_count;
-	}
-	free(target_str);
-	return label_need;
+	for (i = 0; i < kbds_nregex; i++)
+		count += get_position_from_regex(kbds_regex[i], text, len, begin);
+
+	return count;
 }
 
 int
 kbds_search_regex(void)
 {
-	KCursor c;
-	unsigned int i,j;
-	unsigned int is_exists_str;
-	unsigned int is_exists_str_index = 0;
-	unsigned int count = 0;
-	unsigned int begin_y = 0;
-	unsigned int str_len = 0;
-	int label_need = 0;
-	int new_count = 0;
+	RegexKCursor *r;
+	KCursor temp_c;
+	unsigned int i;
 
-	init_char_array(&flash_used_label, 1);
-	init_char_array(&flash_used_double_label, 1);
+	kbds_resetlabels();
 	init_regex_kcursor_array(&regex_kcursor_record, 1);
+	regex_row_spans = xmalloc(term.row * sizeof(KSpanArray));
+	memset(regex_row_spans, 0, term.row * sizeof(KSpanArray));
 
-	// read a full line to match regex
-	for (c.y = 0; c.y <= term.row - 1; c.y++) {
-		c.line = TLINE(c.y);
-		c.len = tlinelen(c.line);
-		str_len = str_len + c.len;
-		if (!kbds_iswrapped(&c) || c.y == term.row - 1) {
-			new_count = kbds_ismatch_regex(begin_y,c.y,str_len);
-			label_need = label_need + new_count;
-			begin_y = c.y + 1;
-			str_len = 0;
-		}
-	}
-
-	Glyph *label_pos1, *label_pos2, *same_value_pos1,*same_value_pos2;
-	char label1, label2;
+	// match the whole screen at once
+	kbds_ismatch_regex();
 
-	// assign label to the matched string
-	for ( i = 0; i < regex_kcursor_record.used; i++) {
-		// Check whether the label is used up
-		if (label_need > LEN(flash_key_label) - 1 && count >= LEN(flash_double_key_label)) {
-			break;
-		} else if(label_need <= LEN(flash_key_label) - 1 && count >= LEN(flash_double_key_label)) {
-			break;
-		}
+	for (i = 0; i < term.row; i++)
+		free(regex_row_spans[i].array);
+	free(regex_row_spans);
+	regex_row_spans = NULL;
 
-		is_exists_str = 0;
-
-		label_pos1 = &regex_kcursor_record.array[i].c.line[regex_kcursor_record.array[i].c.x];
-		label_pos2 = &regex_kcursor_record.array[i].c.line[regex_kcursor_record.array[i].c.x + 1];
-		label1 = flash_double_key_label[count][0];
-		label2 = flash_double_key_label[count][1];
-
-		if (i == 0) { // first match
-			if (label_need > LEN(flash_key_label) - 1) { // double label
-				label_pos1->mode |= ATTR_FLASH_LABEL;
-				label_pos1->ubk = label_pos1->u;
-				label_pos1->u = label1;
-				label_pos2->mode |= ATTR_FLASH_LABEL;
-				label_pos2->ubk = label_pos2->u;
-				label_pos2->u = label2;
-				insert_char_array(&flash_used_label, label1);
-				insert_char_array(&flash_used_double_label, label2);
-				count++;
-				continue;
-			} else { // single label
-				label_pos1->mode |= ATTR_FLASH_LABEL;
-				label_pos1->ubk = label_pos1->u;
-				label_pos1->u = *flash_key_label[count];
-				insert_char_array(&flash_used_label, *flash_key_label[count]);
-				count++;
-				continue;
-			}
-		}
-
-		for (int j = 0; j < i; j++) { // check if the matched string is already in the cache
-			if (enable_regex_same_label == 0)
-				break;
-			if(wcscmp(regex_kcursor_record.array[i].matched_substring,regex_kcursor_record.array[j].matched_substring) == 0) {
-				is_exists_str = 1;
-				is_exists_str_index = j;
-				break;
-			}
-		}
-
-		// record the first hit pos of the same url
-		same_value_pos1 = &regex_kcursor_record.array[is_exists_str_index].c.line[regex_kcursor_record.array[is_exists_str_index].c.x];
-		same_value_pos2 = &regex_kcursor_record.array[is_exists_str_index].c.line[regex_kcursor_record.array[is_exists_str_index].c.x+1];
-
-
-		if(label_need > LEN(flash_key_label) - 1) {  // double label
-			label_pos1->mode |= ATTR_FLASH_LABEL;
-			label_pos1->ubk = label_pos1->u;
-			label_pos2->mode |= ATTR_FLASH_LABEL;
-			label_pos2->ubk = label_pos2->u;
-
-			if (is_exists_str == 0) { // new value match, use new label
-				label_pos1->u = label1;
-				label_pos2->u = label2;
-				insert_char_array(&flash_used_label, label1);
-				insert_char_array(&flash_used_double_label, label2);
-				count++;
-			} else { // same value match, use same label of the first hit
-				label_pos1->u = same_value_pos1->u;
-				label_pos2->u = same_value_pos2->u;
-			}
-		} else {  // single label
-			label_pos1->mode |= ATTR_FLASH_LABEL;
-			label_pos1->ubk = label_pos1->u;
-			label_pos1->u = *flash_key_label[count];
-			if (is_exists_str == 0) { // new value match, use new label
-				label_pos1->u = *flash_key_label[count];
-				insert_char_array(&flash_used_label, *flash_key_label[count]);
-				count++;
-			} else { // same value match, use same label of the first hit
-				label_pos1->u = same_value_pos1->u;
-			}
-		}
+	// assign labels, the same string gets the label of its first match
+	for (i = 0; i < regex_kcursor_record.used; i++) {
+		r = &regex_kcursor_record.array[i];
+		r->label = enable_regex_same_label
+			? kbds_labelof(r->matched_substring, wcslen(r->matched_substring) * sizeof(wchar_t))
+			: kbds_nlabels++;
 	}
+	kbds_makelabels(kbds_nlabels);
+	for (i = 0; i < regex_kcursor_record.used; i++)
+		kbds_drawlabel(regex_kcursor_record.array[i].c, regex_kcursor_record.array[i].label);
 
 	// highlight the matched string
-	KCursor temp_c;
 	for ( i = 0; i < regex_kcursor_record.used;i++) {
 		temp_c.y = regex_kcursor_record.array[i].c.y;
 		temp_c.line = TLINE(temp_c.y);
 		temp_c.len = tlinelen(temp_c.line);
 		temp_c.x = regex_kcursor_record.array[i].c.x;
-		for ( j = 0; j < regex_kcursor_record.array[i].len; j++) {
-			temp_c.line[temp_c.x].mode |= ATTR_HIGHLIGHT;
-			kbds_moveforward(&temp_c, 1, KBDS_WRAP_LINE);
-		}
+		kbds_addhighlight(temp_c, regex_kcursor_record.array[i].len, KBDS_WRAP_LINE);
 	}
 
-	hit_input_first = 0; // begin hit first label
 	tfulldirt();
 
-	return count;
+	return kbds_nlabels;
 }
 
 void copy_regex_result(wchar_t *wstr) {
@@ -1091,233 +1619,98 @@ void copy_regex_result(wchar_t *wstr) {
 int
 kbds_search_url(void)
 {
-	KCursor c, m;
+	KCursor m;
 	UrlKCursor url_kcursor;
-	unsigned int h, i;
-	unsigned int count = 0;
-	char *url;
-	int is_exists_url = 0;
-	int repeat_exists_url_index = 0;
-	int head = 0;
-	int head_hit = 0;
-	int bottom_hit = 0;
-	int hit_url_y;
-	unsigned int label_need = 0;
+	UrlSpan *spans, *prev;
+	int i, n;
 
-	init_char_array(&flash_used_label, 1);
-	init_char_array(&flash_used_double_label, 1);
+	kbds_resetlabels();
 	init_url_kcursor_array(&url_kcursor_record, 1);
 
-	for (c.y = 0; c.y <= term.row - 1; c.y++) {
-		c.line = TLINE(c.y);
-		c.len = tlinelen(c.line);
+	n = findurls(0, term.row - 1, &spans);
+	for (i = 0, prev = NULL; i < n; prev = &spans[i++]) {
+		// a url that is detected right after the previous one belongs to the same match
+		if (prev && spans[i].s == prev->h + 1)
+			continue;
+		m.x = spans[i].x1;
+		m.y = spans[i].y1 + term.scr;
+		if (m.y >= term.row || spans[i].y2 + term.scr < 0)
+			continue;
+		if (m.y < 0)
+			m.x = m.y = 0;
+
+		// record the position of the url
+		m.line = TLINE(m.y);
+		m.len = tlinelen(m.line);
+		url_kcursor.c = m;
+		url_kcursor.url = strdup(spans[i].url);
+		url_kcursor.label = enable_url_same_label
+			? kbds_labelof(url_kcursor.url, strlen(url_kcursor.url))
+			: kbds_nlabels++;
+		insert_url_kcursor_array(&url_kcursor_record, url_kcursor);
+	}
 
-		for (c.x = 0; c.x < c.len; c.x++) {
-			url = detecturl(c.x,c.y,0);
-			if (!url && !head_hit) {
-				continue;
-			} else if (!head_hit) { // find the first char which is belong to a url
-				head = c.x;
-				head_hit = 1;
-				hit_url_y = c.y;
-			}
+	kbds_makelabels(kbds_nlabels);
+	for (i = 0; i < url_kcursor_record.used; i++)
+		kbds_drawlabel(url_kcursor_record.array[i].c, url_kcursor_record.array[i].label);
 
-			// find the last char which is belong to the url
-			if (head_hit && (!url || ((!kbds_iswrapped(&c) || c.y == term.row-1) && c.x == c.len - 1))) {
-				bottom_hit = 1;
-			}
+	tfulldirt();
 
-			// complete one url match
-			if (head_hit && bottom_hit) {
-				url = detecturl(head,hit_url_y,0);
-				if (url) {
-					is_exists_url = 0;
-					// check if the url is already in the cache
-					for (h = 0; h < url_kcursor_record.used; h++) {
-						if (enable_url_same_label == 0) // if disable same label
-							break;
-						if (strcmp(url_kcursor_record.array[h].url, url) == 0) {
-							is_exists_url = 1;
-							repeat_exists_url_index = h;
-							break;
-						}
-					}
-					// calculate the number of labels needed
-					if (!is_exists_url) {
-						label_need ++;
-					}
-					// record the position of the url
-					m.x = head;
-					m.y = hit_url_y;
-					m.line = TLINE(hit_url_y);
-					m.len = tlinelen(m.line);
-					url_kcursor.c = m;
-					url_kcursor.url = strdup(url);
-					insert_url_kcursor_array(&url_kcursor_record, url_kcursor);
-				}
-				// reset to match the next url
-				head = 0;
-				head_hit = 0;
-				bottom_hit = 0;
-			}
-		}
-	}
+	return kbds_nlabels;
+}
+
+/* Returns 0 if no label begins with the typed keys, 1 if they are the
+ * beginning of a label and 2 if the label was completed and acted on. */
+int
+kbds_hitlabel(Rune u)
+{
+	int i, label;
 
-	Glyph *label_pos1, *label_pos2, *same_value_pos1,*same_value_pos2;
-	char label1, label2;
+	if (u >= 128 || kbds_labelinputlen >= kbds_labelwidth)
+		return 0;
 
-	// assign label to the matched url
-	for ( i = 0; i < url_kcursor_record.used; i++) {
-		// Check whether the label is used up
-		if (label_need > LEN(flash_key_label) - 1 && count >= LEN(flash_double_key_label)) {
+	kbds_labelinput[kbds_labelinputlen] = u;
+	for (label = 0; label < kbds_nlabels; label++) {
+		if (!strncmp(kbds_label(label), kbds_labelinput, kbds_labelinputlen + 1))
 			break;
-		} else if(label_need <= LEN(flash_key_label) - 1 && count >= LEN(flash_double_key_label)) {
-			break;
-		}
+	}
+	if (label == kbds_nlabels)
+		return 0;
 
-		is_exists_url = 0;
-		label_pos1 = &url_kcursor_record.array[i].c.line[url_kcursor_record.array[i].c.x];
-		label_pos2 = &url_kcursor_record.array[i].c.line[url_kcursor_record.array[i].c.x + 1];
-		label1 = flash_double_key_label[count][0];
-		label2 = flash_double_key_label[count][1];
-
-		if (i == 0) { // first match
-			if (label_need > LEN(flash_key_label) - 1) { // double label
-				label_pos1->mode |= ATTR_FLASH_LABEL;
-				label_pos1->ubk = label_pos1->u;
-				label_pos1->u = label1;
-				label_pos2->mode |= ATTR_FLASH_LABEL;
-				label_pos2->ubk = label_pos2->u;
-				label_pos2->u = label2;
-				insert_char_array(&flash_used_label, label1);
-				insert_char_array(&flash_used_double_label, label2);
-				count++;
-				continue;
-			} else { // single label
-				label_pos1->mode |= ATTR_FLASH_LABEL;
-				label_pos1->ubk = label_pos1->u;
-				label_pos1->u = *flash_key_label[count];
-				insert_char_array(&flash_used_label, *flash_key_label[count]);
-				count++;
-				continue;
-			}
-		}
+	if (++kbds_labelinputlen < kbds_labelwidth) {
+		kbds_showlabels();
+		return 1;
+	}
 
-		// check if the url is already in the cache
-		for (h = 0; h < i; h++) {
-			if (enable_url_same_label == 0)
-				break;
-			if (strcmp(url_kcursor_record.array[h].url, url_kcursor_record.array[i].url) == 0) {
-				is_exists_url = 1;
-				repeat_exists_url_index = h; // record the index of the first hit
+	kbds_labelinputlen = 0;
+	kbds_clearhighlights();
+	if (kbds_isurlmode()) {
+		for (i = 0; i < url_kcursor_record.used; i++) {
+			if (url_kcursor_record.array[i].label == label) {
+				openUrlOnClick(url_kcursor_record.array[i].c.x, url_kcursor_record.array[i].c.y, url_opener);
 				break;
 			}
 		}
-
-		// record the first hit pos of the same url
-		same_value_pos1 = &url_kcursor_record.array[repeat_exists_url_index].c.line[url_kcursor_record.array[repeat_exists_url_index].c.x];
-		same_value_pos2 = &url_kcursor_record.array[repeat_exists_url_index].c.line[url_kcursor_record.array[repeat_exists_url_index].c.x+1];
-
-		if(label_need > LEN(flash_key_label) - 1) {  // double label
-			label_pos1->mode |= ATTR_FLASH_LABEL;
-			label_pos1->ubk = label_pos1->u;
-			label_pos2->mode |= ATTR_FLASH_LABEL;
-			label_pos2->ubk = label_pos2->u;
-
-			if (is_exists_url == 0) { // new value match, use new label
-				label_pos1->u = label1;
-				label_pos2->u = label2;
-				insert_char_array(&flash_used_label, label1);
-				insert_char_array(&flash_used_double_label, label2);
-				count++;
-			} else { // same value match, use same label of the first hit
-				label_pos1->u = same_value_pos1->u;
-				label_pos2->u = same_value_pos2->u;
-			}
-		} else {  // single label
-			label_pos1->mode |= ATTR_FLASH_LABEL;
-			label_pos1->ubk = label_pos1->u;
-			label_pos1->u = *flash_key_label[count];
-			if (is_exists_url == 0) { // new value match, use new label
-				label_pos1->u = *flash_key_label[count];
-				insert_char_array(&flash_used_label, *flash_key_label[count]);
-				count++;
-			} else { // same value match, use same label of the first hit
-				label_pos1->u = same_value_pos1->u;
+	} else if (kbds_isregexmode()) {
+		for (i = 0; i < regex_kcursor_record.used; i++) {
+			if (regex_kcursor_record.array[i].label == label) {
+				copy_regex_result(regex_kcursor_record.array[i].matched_substring);
+				break;
 			}
 		}
 	}
-
-	hit_input_first = 0; // begin hit first label
-	tfulldirt();
-
-	return count;
+	return 2;
 }
 
 void
 jump_to_label(Rune label) {
 	int i;
 
-	// double label hit
-	if (kbds_isurlmode() && flash_used_double_label.used > 0) {
-		for ( i = 0; i < url_kcursor_record.used; i++) {
-			// hit first label
-			if (hit_input_first == 0 && label == url_kcursor_record.array[i].c.line[url_kcursor_record.array[i].c.x].u) {
-				hit_input_first = 1;
-				hit_input_first_label = label;
-				return;
-			}
-			// hit second label
-			if (hit_input_first == 1 && hit_input_first_label == url_kcursor_record.array[i].c.line[url_kcursor_record.array[i].c.x].ubk && label == url_kcursor_record.array[i].c.line[url_kcursor_record.array[i].c.x + 1].u) {
-				hit_input_first = 0;
-				kbds_clearhighlights();
-				openUrlOnClick(url_kcursor_record.array[i].c.x, url_kcursor_record.array[i].c.y, url_opener);
-				return;
-			}
-		}
-	} else if (kbds_isurlmode()) { // single label hit
-		for ( i = 0; i < url_kcursor_record.used; i++) {
-			if (label == url_kcursor_record.array[i].c.line[url_kcursor_record.array[i].c.x].u) {
-				kbds_clearhighlights();
-				hit_input_first = 0;
-				openUrlOnClick(url_kcursor_record.array[i].c.x, url_kcursor_record.array[i].c.y, url_opener);
-				return;
-			}
-		}
-	}
-
-	// double label hit
-	if (kbds_isregexmode() && flash_used_double_label.used > 0) {
-		for ( i = 0; i < regex_kcursor_record.used; i++) {
-			// hit first label
-			if (hit_input_first == 0 && label == regex_kcursor_record.array[i].c.line[regex_kcursor_record.array[i].c.x].u) {
-				hit_input_first = 1;
-				hit_input_first_label = label;
-				return;
-			}
-			// hit second label
-			if (hit_input_first == 1 && hit_input_first_label == regex_kcursor_record.array[i].c.line[regex_kcursor_record.array[i].c.x].ubk && label == regex_kcursor_record.array[i].c.line[regex_kcursor_record.array[i].c.x + 1].u) {
-				hit_input_first = 0;
-				kbds_clearhighlights();
-				copy_regex_result(regex_kcursor_record.array[i].matched_substring);
-				return;
-			}
-		}
-	} else if (kbds_isregexmode()) { // single label hit
-		for ( i = 0; i < regex_kcursor_record.used; i++) {
-			if (label == regex_kcursor_record.array[i].c.line[regex_kcursor_record.array[i].c.x].u) {
-				kbds_clearhighlights();
-				hit_input_first = 0;
-				copy_regex_result(regex_kcursor_record.array[i].matched_substring);
-				return;
-			}
-		}
-	}
-
-	for ( i = 0; i < flash_kcursor_record.used; i++) {
-		if (label == flash_kcursor_record.array[i].line[flash_kcursor_record.array[i].x].u) {
+	for ( i = 0; i < flash_used_label.used; i++) {
+		if (label == flash_used_label.array[i]) {
 			kbds_clearhighlights();
 			kbds_moveto(flash_kcursor_match.array[i].x, flash_kcursor_match.array[i].y);
+			break;
 		}
 	}
 }
@@ -1332,56 +1725,163 @@ clear_flash_cache() {
 
 void
 clear_regex_cache() {
-	hit_input_first = 0;
+	kbds_resetlabels();
 	reset_regex_kcursor_array(&regex_kcursor_record);
-	reset_char_array(&flash_used_label);
-	reset_char_array(&flash_used_double_label);
 }
 
 void
 clear_url_cache() {
-	hit_input_first = 0;
+	kbds_resetlabels();
 	reset_url_kcursor_array(&url_kcursor_record);
-	reset_char_array(&flash_used_label);
-	reset_char_array(&flash_used_double_label);
+}
+
+/* Moves to the match the pending find-next asks for. Returns 0 if the
+ * matches that decide it are not scanned yet. */
+int
+kbds_jumptomatch(void)
+{
+	KPos cur;
+	int lo, hi, mid, i, k, n = kbds_index.match.used, dir = kbds_pending.dir;
+	int *match = kbds_index.match.array;
+
+	/* first match after (or last match before) the cursor */
+	for (lo = 0, hi = n; lo < hi;) {
+		mid = (lo + hi) / 2;
+		if (match[mid] < kbds_pending.off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (kbds_index.scanned < kbds_index.to) {
+		/* the matches are scanned forward, so there is no wrapping yet */
+		if (dir < 0 && kbds_index.scanned < kbds_pending.off)
+			return 0;
+		for (k = kbds_pending.quant, i = (dir > 0) ? lo : lo - 1; i >= 0 && i < n; i += dir) {
+			if (kbds_iswordmatch(match[i]) && --k == 0)
+				break;
+		}
+		if (k > 0)
+			return 0;
+	} else if (kbds_index.nvalid == 0) {
+		kbds_pending.active = 0;
+		kbds_moveto(kbds_c.x, kbds_c.y);
+		return 1;
+	} else {
+		i = (dir > 0) ? lo % n : (lo + n - 1) % n;
+		for (k = (kbds_pending.quant - 1) % kbds_index.nvalid + 1;; i = (i + dir + n) % n) {
+			if (kbds_iswordmatch(match[i]) && --k == 0)
+				break;
+		}
+	}
+	kbds_pending.active = 0;
+
+	for (kbds_index.current = 0, k = 0; k <= i; k++)
+		kbds_index.current += kbds_iswordmatch(match[k]);
+
+	kbds_markmatch(kbds_matchcursor(match[i]));
+	cur = kbds_index.pos[match[i]];
+	kbds_moveto(cur.x, cur.y + term.scr);
+	return 1;
 }
 
 void
 kbds_searchnext(int dir)
 {
-	KCursor c = kbds_c, n = kbds_c;
-	int wrapped = 0;
+	KPos cur;
+	int lo, hi, mid;
 
 	if (!kbds_searchobj.len) {
 		kbds_quant = 0;
 		return;
 	}
 
-	if (dir < 0 && c.x > c.len)
-		c.x = c.len;
+	kbds_findmatches(0);
 
-	for (kbds_quant = MAX(kbds_quant, 1); kbds_quant > 0;) {
-		if (!kbds_moveforward(&c, dir, KBDS_WRAP_LINE)) {
-			c.y += dir;
-			if (c.y < kbds_top())
-				c.y = kbds_bot(), wrapped++;
-			else if (c.y > kbds_bot())
-				c.y = kbds_top(), wrapped++;
-			if (wrapped > 1)
-				break;;
-			c.line = TLINE(c.y);
-			c.len = tlinelen(c.line);
-			c.x = (dir < 0 && c.len > 0) ? c.len-1 : 0;
-			c.x -= (c.x > 0 && (c.line[c.x].mode & ATTR_WDUMMY)) ? 1 : 0;
+	/* offset of the first character at or after the cursor */
+	cur.x = kbds_c.x;
+	cur.y = kbds_c.y - term.scr;
+	for (lo = 0, hi = kbds_index.len; lo < hi;) {
+		mid = (lo + hi) / 2;
+		if (kbds_index.pos[mid].y < cur.y ||
+		    (kbds_index.pos[mid].y == cur.y && kbds_index.pos[mid].x < cur.x))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (dir > 0 && lo < kbds_index.len &&
+	    kbds_index.pos[lo].y == cur.y && kbds_index.pos[lo].x == cur.x)
+		lo++;
+
+	kbds_pending.off = lo;
+	kbds_pending.dir = dir;
+	kbds_pending.quant = MAX(kbds_quant, 1);
+	kbds_pending.active = 1;
+	kbds_quant = 0;
+	kbds_jumptomatch();
+}
+
+/* Takes over the matches the worker has published. Returns the time until
+ * the next poll, or -1 if no search is running. */
+int
+kbds_searchpoll(void)
+{
+	int i, n, done, pending, dir, quant;
+
+	if (!kbds_worker.running)
+		return -1;
+
+	n = kbds_index.match.used;
+	if (kbds_index.gen != term.textgen) {
+		/* the offsets refer to text that has changed since, search
+		 * again on the current text */
+		pending = kbds_pending.active;
+		dir = kbds_pending.dir;
+		quant = kbds_pending.quant;
+		kbds_stopsearch();
+		if (kbds_index.highlight) {
+			kbds_clearoverlay(ATTR_HIGHLIGHT);
+			tfulldirt();
 		}
-		if (kbds_ismatch(c)) {
-			n = c;
-			kbds_quant--;
+		if (pending) {
+			kbds_quant = quant;
+			kbds_searchnext(dir);
+			if (!kbds_pending.active)
+				kbds_selecttext();
+		} else {
+			kbds_findmatches(kbds_isflashmode());
 		}
+		n = 0;
 	}
 
-	kbds_moveto(n.x, n.y);
-	kbds_quant = 0;
+	done = 1;
+	if (kbds_worker.running) {
+		pthread_mutex_lock(&kbds_worker.lock);
+		for (i = 0; i < kbds_worker.found.used; i++)
+			insert_match_array(&kbds_index.match, kbds_worker.found.array[i]);
+		kbds_worker.found.used = 0;
+		kbds_index.scanned = kbds_worker.scanned;
+		done = kbds_worker.done;
+		pthread_mutex_unlock(&kbds_worker.lock);
+
+		if (done) {
+			pthread_join(kbds_worker.thread, NULL);
+			kbds_worker.running = 0;
+		}
+	}
+
+	kbds_countmatches(n);
+	if (kbds_index.highlight && n < kbds_index.match.used) {
+		for (i = n; i < kbds_index.match.used; i++) {
+			if (kbds_iswordmatch(kbds_index.match.array[i]))
+				kbds_markmatch(kbds_matchcursor(kbds_index.match.array[i]));
+		}
+		tfulldirt();
+	}
+	if (kbds_pending.active && kbds_jumptomatch())
+		kbds_selecttext();
+
+	return done ? -1 : KBDS_SEARCHPOLL;
 }
 
 void
@@ -1410,7 +1910,7 @@ kbds_searchwordorselection(int dir)
 
 	kbds_searchobj.maxlen = term.col;
 	for (kbds_c = c; kbds_searchobj.len < kbds_searchobj.maxlen;) {
-		if (!kbds_insertchar(c.line[c.x].u) ||
+		if (!kbds_insertchar(GLYPHRUNE(c.line[c.x].u)) ||
 		    !kbds_moveforward(&c, 1, KBDS_WRAP_LINE) ||
 		    (kbds_isselectmode() && ((c.x > sel.ne.x && c.y == ney) || c.y > ney)) ||
 		    (!kbds_isselectmode() && kbds_isdelim(c, 0, kbds_sdelim)))
@@ -1448,7 +1948,7 @@ kbds_findnext(int dir, int repeat)
 		prev = c;
 		if (!kbds_moveforward(&c, dir, KBDS_WRAP_LINE))
 			break;
-		if (c.line[c.x].u == kbds_findchar) {
+		if (GLYPHRUNE(c.line[c.x].u) == kbds_findchar) {
 			if (skipfirst && prev.x == kbds_c.x && prev.y == kbds_c.y) {
 				skipfirst = 0;
 				continue;
@@ -1504,7 +2004,7 @@ kbds_drawcursor(void)
 	    (kbds_c.y != term.row-1 || !kbds_issearchmode()) &&
 	    !(kbds_searchobj.directsearch && kbds_isurlmode()) &&
 	    !(kbds_searchobj.directsearch && kbds_isregexmode())) {
-		xdrawcursor(kbds_c.x, kbds_c.y, TLINE(kbds_c.y)[kbds_c.x],
+		xdrawcursor(kbds_c.x, kbds_c.y, kbds_overlayline(TLINE(kbds_c.y), kbds_c.y)[kbds_c.x],
 		            kbds_oc.x, kbds_oc.y, TLINE(kbds_oc.y));
 		kbds_oc = kbds_c;
 	}
@@ -1546,16 +2046,12 @@ kbds_keyboardhandler(KeySym ksym, char *buf, int len, int forcequit)
 		default:
 			if (len > 0) {
 				utf8decode(buf, &u, len);
-				if ((is_in_flash_used_label(u) == 1 && hit_input_first == 0) || (is_in_flash_used_double_label(u) == 1 && hit_input_first == 1)) {
-					jump_to_label(u);
-					if (hit_input_first == 1) {
-						kbds_clearhighlights();
-						return 0;
-					}
+				if (kbds_hitlabel(u) == 2) {
 					kbds_searchobj.len = 0;
 					kbds_setmode(kbds_mode & ~KBDS_MODE_URL);
 					clear_url_cache();
 					if (kbds_searchobj.directsearch) {
+						kbds_stopsearch();
 						kbds_in_use = kbds_quant = 0;
 						free(kbds_searchobj.str);
 						return MODE_KBDSELECT;
@@ -1582,16 +2078,12 @@ kbds_keyboardhandler(KeySym ksym, char *buf, int len, int forcequit)
 		default:
 			if (len > 0) {
 				utf8decode(buf, &u, len);
-				if ((is_in_flash_used_label(u) == 1 && hit_input_first == 0) || (is_in_flash_used_double_label(u) == 1 && hit_input_first == 1)) {
-					jump_to_label(u);
-					if (hit_input_first == 1) {
-						kbds_clearhighlights();
-						return 0;
-					}
+				if (kbds_hitlabel(u) == 2) {
 					kbds_searchobj.len = 0;
 					kbds_setmode(kbds_mode & ~KBDS_MODE_REGEX);
 					clear_regex_cache();
 					if (kbds_searchobj.directsearch) {
+						kbds_stopsearch();
 						kbds_in_use = kbds_quant = 0;
 						free(kbds_searchobj.str);
 						return MODE_KBDSELECT;
@@ -1879,6 +2371,7 @@ kbds_keyboardhandler(KeySym ksym, char *buf, int len, int forcequit)
 	case XK_Return:
 		if (kbds_isselectmode())
 			kbds_copytoclipboard();
+		kbds_stopsearch();
 		kbds_in_use = kbds_quant = 0;
 		free(kbds_searchobj.str);
 		kbds_clearhighlights();
@@ -2021,12 +2514,10 @@ kbds_keyboardhandler(KeySym ksym, char *buf, int len, int forcequit)
 		if (ksym >= XK_0 && ksym <= XK_9) {                 /* 0-9 keyboard */
 			q = (kbds_quant * 10) + (ksym ^ XK_0);
 			kbds_quant = q <= 99999999 ? q : kbds_quant;
-			term.dirty[0] = 1;
 			return 0;
 		} else if (ksym >= XK_KP_0 && ksym <= XK_KP_9) {    /* 0-9 numpad */
 			q = (kbds_quant * 10) + (ksym ^ XK_KP_0);
 			kbds_quant = q <= 99999999 ? q : kbds_quant;
-			term.dirty[0] = 1;
 			return 0;
 		} else if (ksym == XK_k || ksym == XK_h)
 			i = ksym & 1;
@@ -2052,6 +2543,5 @@ kbds_keyboardhandler(KeySym ksym, char *buf, int len, int forcequit)
 	}
 	kbds_selecttext();
 	kbds_quant = 0;
-	term.dirty[0] = 1;
 	return 0;
 }
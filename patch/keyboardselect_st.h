@@ -6,7 +6,7 @@
 #define XK_REGEX     -5
 #define XK_URL       -6
 
-void kbds_drawstatusbar(int);
+void kbds_compilepatterns(void);
 void kbds_pasteintosearch(const char *, int, int);
 int kbds_isselectmode(void);
 int kbds_issearchmode(void);
@@ -16,3 +16,6 @@ int kbds_isurlmode(void);
 int kbds_drawcursor(void);
 int kbds_getcursor(int *, int *);
 int kbds_keyboardhandler(KeySym, char *, int, int);
+int kbds_searchpoll(void);
+void kbds_updatestatus(void);
+Line kbds_overlayline(Line, int);
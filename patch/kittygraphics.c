@@ -0,0 +1,618 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+typedef struct {
+	char action;           /* a: t, T, p, d, q */
+	char medium;           /* t: d, f, t, s */
+	char delete;           /* d */
+	char compression;      /* o */
+	int format;            /* f: 24, 32, 100 */
+	int quiet;             /* q */
+	int more;              /* m */
+	int nocursor;          /* C */
+	uint32_t id;           /* i */
+	uint32_t placementid;  /* p */
+	int width, height;     /* s, v */
+	int x, y, w, h;        /* source rectangle, or the cell for deletion */
+	int cols, rows;        /* c, r */
+	size_t size, offset;   /* S, O */
+} KGPCommand;
+
+typedef struct _KGPImage {
+	struct _KGPImage *next;
+	uint32_t id;
+	int width;
+	int height;
+	uint32_t *pixels;
+} KGPImage;
+
+static struct {
+	KGPImage *images;      /* transmitted images, the oldest first */
+	size_t storage;        /* size of the transmitted image data */
+	KGPCommand load;       /* chunked transmission in progress */
+	char *data;
+	size_t len, siz;
+	int loading, overflow;
+} kgp;
+
+static int
+kgpparse(KGPCommand *cmd, char **str)
+{
+	char *p = *str, *v, key;
+	unsigned long n;
+
+	while (*p && *p != ';') {
+		key = *p++;
+		if (*p++ != '=')
+			return -1;
+		for (v = p; *p && *p != ',' && *p != ';'; p++)
+			;
+		n = strtoul(v, NULL, 10);
+		switch (key) {
+		case 'a': cmd->action = *v; break;
+		case 't': cmd->medium = *v; break;
+		case 'd': cmd->delete = *v; break;
+		case 'o': cmd->compression = *v; break;
+		case 'f': cmd->format = MIN(n, INT_MAX); break;
+		case 'q': cmd->quiet = MIN(n, INT_MAX); break;
+		case 'm': cmd->more = MIN(n, INT_MAX); break;
+		case 'C': cmd->nocursor = MIN(n, INT_MAX); break;
+		case 'i': cmd->id = n; break;
+		case 'p': cmd->placementid = n; break;
+		case 's': cmd->width = MIN(n, INT_MAX); break;
+		case 'v': cmd->height = MIN(n, INT_MAX); break;
+		case 'x': cmd->x = MIN(n, INT_MAX); break;
+		case 'y': cmd->y = MIN(n, INT_MAX); break;
+		case 'w': cmd->w = MIN(n, INT_MAX); break;
+		case 'h': cmd->h = MIN(n, INT_MAX); break;
+		case 'c': cmd->cols = MIN(n, INT_MAX); break;
+		case 'r': cmd->rows = MIN(n, INT_MAX); break;
+		case 'S': cmd->size = n; break;
+		case 'O': cmd->offset = n; break;
+		default: break; /* unsupported keys are ignored */
+		}
+		if (*p == ',')
+			p++;
+	}
+	*str = *p ? p + 1 : p;
+	return 0;
+}
+
+static void
+kgpresponse(const KGPCommand *cmd, const char *msg)
+{
+	char buf[256];
+	int n, error = strcmp(msg, "OK") != 0;
+
+	/* the client only gets a response if it has given an image id */
+	if (!cmd->id || cmd->quiet >= (error ? 2 : 1))
+		return;
+
+	if (cmd->placementid)
+		n = snprintf(buf, sizeof(buf), "\033_Gi=%u,p=%u;%s\033\\",
+		             cmd->id, cmd->placementid, msg);
+	else
+		n = snprintf(buf, sizeof(buf), "\033_Gi=%u;%s\033\\", cmd->id, msg);
+	ttywrite(buf, MIN(n, sizeof(buf) - 1), 0);
+}
+
+static void
+kgpappend(const char *payload)
+{
+	size_t n = strlen(payload) / 4 * 3 + 3;
+
+	if (kgp.overflow || kgp.len + n > KGP_MAX_DATA) {
+		kgp.overflow = 1;
+		return;
+	}
+	if (kgp.len + n + 1 > kgp.siz) {
+		kgp.siz = MAX(kgp.siz * 2, kgp.len + n + 1);
+		kgp.data = xrealloc(kgp.data, kgp.siz);
+	}
+	kgp.len += base64decode(kgp.data + kgp.len, payload);
+	kgp.data[kgp.len] = '\0';
+}
+
+static void
+kgpfreeimage(KGPImage *img)
+{
+	if (img) {
+		free(img->pixels);
+		free(img);
+	}
+}
+
+static KGPImage *
+kgpfind(uint32_t id)
+{
+	KGPImage *img;
+
+	for (img = kgp.images; img && img->id != id; img = img->next)
+		;
+	return img;
+}
+
+static void
+kgpunlink(KGPImage *img)
+{
+	KGPImage **pp;
+
+	for (pp = &kgp.images; *pp && *pp != img; pp = &(*pp)->next)
+		;
+	if (*pp) {
+		*pp = img->next;
+		kgp.storage -= (size_t)img->width * img->height * 4;
+	}
+}
+
+static void
+kgpstore(KGPImage *img)
+{
+	KGPImage *old, **pp;
+
+	if ((old = kgpfind(img->id))) {
+		kgpunlink(old);
+		kgpfreeimage(old);
+	}
+	for (pp = &kgp.images; *pp; pp = &(*pp)->next)
+		;
+	*pp = img;
+	img->next = NULL;
+	kgp.storage += (size_t)img->width * img->height * 4;
+
+	/* evict the oldest images if the storage quota is exceeded */
+	while (kgp.storage > KGP_MAX_STORAGE && (old = kgp.images) != img) {
+		kgpunlink(old);
+		kgpfreeimage(old);
+	}
+}
+
+/* The terminal deletes a temporary file, so it has to be named like one and
+ * sit directly in one of the temporary directories. Its real path is written
+ * to resolved, which is left empty if it is not one. */
+static int
+kgpistempfile(const char *path, char *resolved)
+{
+	const char *dirs[] = { "/tmp", "/dev/shm", getenv("TMPDIR") };
+	char dir[PATH_MAX];
+	const char *p;
+	struct stat st;
+	size_t i, len;
+
+	for (p = path; (p = strstr(p, "..")); p += 2) {
+		if ((p == path || p[-1] == '/') && (p[2] == '/' || p[2] == '\0'))
+			goto notemp;
+	}
+	if (lstat(path, &st) < 0 || !S_ISREG(st.st_mode) || !realpath(path, resolved))
+		goto notemp;
+	p = strrchr(resolved, '/');
+	if (!strstr(p, "tty-graphics-protocol"))
+		goto notemp;
+	for (len = p - resolved, i = 0; i < LEN(dirs); i++) {
+		if (dirs[i] && *dirs[i] && realpath(dirs[i], dir) &&
+		    strlen(dir) == len && !strncmp(dir, resolved, len))
+			return 1;
+	}
+notemp:
+	*resolved = '\0';
+	return 0;
+}
+
+static const char *
+kgpreadfile(const KGPCommand *cmd, const char *path, char *resolved,
+            unsigned char **buf, size_t *len)
+{
+	struct stat st, lst;
+	size_t size, n;
+	ssize_t r;
+	int fd;
+
+	if (cmd->medium == 't' && !kgpistempfile(path, resolved))
+		return "EINVAL:not a temporary file";
+	/* opening a fifo without a writer would block */
+	if ((fd = open(cmd->medium == 't' ? resolved : path, O_RDONLY | O_NONBLOCK)) < 0)
+		return "ENOENT:cannot open the file";
+	/* O_NOFOLLOW is not in XPG6, the opened file has to be the one that
+	 * was checked and not a symlink put in its place */
+	if (cmd->medium == 't' && (fstat(fd, &st) < 0 || lstat(resolved, &lst) < 0 ||
+	    S_ISLNK(lst.st_mode) || st.st_dev != lst.st_dev || st.st_ino != lst.st_ino)) {
+		close(fd);
+		return "EINVAL:not a temporary file";
+	}
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || cmd->offset > st.st_size) {
+		close(fd);
+		return "EINVAL:not a regular file";
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	size = st.st_size - cmd->offset;
+	if (cmd->size)
+		size = MIN(size, cmd->size);
+	if (size > KGP_MAX_DATA) {
+		close(fd);
+		return "EFBIG:the file is too big";
+	}
+
+	*buf = xmalloc(MAX(size, 1));
+	for (n = 0; n < size; n += r) {
+		if ((r = pread(fd, *buf + n, size - n, cmd->offset + n)) <= 0) {
+			if (r < 0 && errno == EINTR) {
+				r = 0;
+				continue;
+			}
+			break;
+		}
+	}
+	close(fd);
+	*len = n;
+	return NULL;
+}
+
+static const char *
+kgpreadshm(const KGPCommand *cmd, const char *name, unsigned char **buf, size_t *len)
+{
+	struct stat st;
+	unsigned char *p;
+	size_t size;
+	int fd;
+
+	if ((fd = shm_open(name, O_RDONLY, 0)) < 0)
+		return "ENOENT:cannot open the shared memory object";
+	if (fstat(fd, &st) < 0 || cmd->offset > st.st_size) {
+		close(fd);
+		return "EINVAL:invalid shared memory object";
+	}
+	size = st.st_size - cmd->offset;
+	if (cmd->size)
+		size = MIN(size, cmd->size);
+	if (size > KGP_MAX_DATA) {
+		close(fd);
+		shm_unlink(name);
+		return "EFBIG:the shared memory object is too big";
+	}
+	p = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+	close(fd);
+	if (p == MAP_FAILED)
+		return "EIO:cannot map the shared memory object";
+
+	*buf = xmalloc(MAX(size, 1));
+	if (size)
+		memcpy(*buf, p + cmd->offset, size);
+	*len = size;
+	if (p)
+		munmap(p, st.st_size);
+
+	/* the terminal is responsible for removing the object */
+	shm_unlink(name);
+	return NULL;
+}
+
+static inline uint32_t
+kgppixel(int r, int g, int b, int a)
+{
+	/* X11 pixmaps have no alpha blending, so the alpha channel is
+	 * converted to a clip mask like the sixel transparency */
+	return (a < 128) ? 0 : (0xffu << 24) | (r << 16) | (g << 8) | b;
+}
+
+static const char *
+kgpdecode(const KGPCommand *cmd, const unsigned char *raw, size_t len, KGPImage **out)
+{
+	KGPImage *img;
+	gdImagePtr png = NULL;
+	uint32_t *dst;
+	int x, y, c, bpp, w = cmd->width, h = cmd->height;
+
+	if (cmd->format == 100) {
+		if (len > INT_MAX || !(png = gdImageCreateFromPngPtr(len, (void *)raw)))
+			return "EBADPNG:cannot decode the png image";
+		w = gdImageSX(png);
+		h = gdImageSY(png);
+	} else if (cmd->format != 24 && cmd->format != 32) {
+		return "EINVAL:unsupported format";
+	}
+	if (w <= 0 || h <= 0 || w > KGP_MAX_WIDTH || h > KGP_MAX_HEIGHT) {
+		if (png)
+			gdImageDestroy(png);
+		return "EINVAL:invalid image dimensions";
+	}
+	bpp = cmd->format / 8;
+	if (!png && len < (size_t)w * h * bpp)
+		return "ENODATA:insufficient image data";
+
+	img = xmalloc(sizeof(KGPImage));
+	img->next = NULL;
+	img->id = cmd->id;
+	img->width = w;
+	img->height = h;
+	img->pixels = dst = xmalloc((size_t)w * h * 4);
+	for (y = 0; y < h; y++) {
+		for (x = 0; x < w; x++) {
+			if (png) {
+				c = gdImageGetPixel(png, x, y);
+				*dst++ = kgppixel(gdImageRed(png, c), gdImageGreen(png, c),
+				    gdImageBlue(png, c), (127 - gdImageAlpha(png, c)) * 255 / 127);
+			} else {
+				*dst++ = kgppixel(raw[0], raw[1], raw[2], bpp == 4 ? raw[3] : 255);
+				raw += bpp;
+			}
+		}
+	}
+	if (png)
+		gdImageDestroy(png);
+
+	*out = img;
+	return NULL;
+}
+
+static const char *
+kgpload(const KGPCommand *cmd, char *data, size_t len, KGPImage **img)
+{
+	unsigned char *raw = NULL;
+	const char *err = NULL;
+	char tmpfile[PATH_MAX] = "";
+
+	if (kgp.overflow)
+		return "EFBIG:too much image data";
+	if (cmd->compression)
+		return "EINVAL:compression is not supported";
+
+	switch (cmd->medium) {
+	case 'd':
+		raw = (unsigned char *)data;
+		break;
+	case 'f':
+	case 't':
+		err = kgpreadfile(cmd, data, tmpfile, &raw, &len);
+		break;
+	case 's':
+		err = kgpreadshm(cmd, data, &raw, &len);
+		break;
+	default:
+		return "EINVAL:unsupported transmission medium";
+	}
+	if (!err)
+		err = kgpdecode(cmd, raw, len, img);
+	/* the terminal owns a temporary file once it is accepted as one, even
+	 * if its data turns out to be unusable */
+	if (cmd->medium == 't' && *tmpfile)
+		unlink(tmpfile);
+	if (raw != (unsigned char *)data)
+		free(raw);
+	return err;
+}
+
+static const char *
+kgpplace(const KGPCommand *cmd, const KGPImage *img)
+{
+	ImageList *im, *next, *newimages = NULL, *tail = NULL;
+	uint32_t *dst;
+	int sx, sy, sw, sh, tw, th, x, y, i, j, cols, numimages;
+	int cw = win.cw, ch = win.ch;
+	/* the size is clamped anyway, this keeps the products below in range */
+	int ncols = MIN(cmd->cols, KGP_MAX_WIDTH / cw + 1);
+	int nrows = MIN(cmd->rows, KGP_MAX_HEIGHT / ch + 1);
+
+	/* source rectangle */
+	sx = MIN(cmd->x, img->width - 1);
+	sy = MIN(cmd->y, img->height - 1);
+	sw = cmd->w ? MIN(cmd->w, img->width - sx) : img->width - sx;
+	sh = cmd->h ? MIN(cmd->h, img->height - sy) : img->height - sy;
+
+	/* size on the screen, the aspect ratio is kept if only the number of
+	 * columns or rows is given */
+	if (ncols && nrows) {
+		tw = ncols * cw;
+		th = nrows * ch;
+	} else if (ncols) {
+		tw = ncols * cw;
+		th = MIN((long long)sh * tw / sw, KGP_MAX_HEIGHT);
+	} else if (nrows) {
+		th = nrows * ch;
+		tw = MIN((long long)sw * th / sh, KGP_MAX_WIDTH);
+	} else {
+		tw = sw;
+		th = sh;
+	}
+	tw = MIN(MAX(tw, 1), KGP_MAX_WIDTH);
+	th = MIN(MAX(th, 1), KGP_MAX_HEIGHT);
+	cols = (tw + cw-1) / cw;
+	numimages = (th + ch-1) / ch;
+
+	/* a placement with the same id replaces the old one */
+	if (cmd->id && cmd->placementid) {
+		for (im = term.images; im; im = next) {
+			next = im->next;
+			if (im->kitty && im->id == cmd->id && im->placementid == cmd->placementid)
+				delete_image(im);
+		}
+	}
+
+	/* split the image into rows of cells like the sixels */
+	for (i = 0; i < numimages; i++) {
+		im = xmalloc(sizeof(ImageList));
+		im->prev = tail;
+		im->next = NULL;
+		if (tail)
+			tail->next = im;
+		else
+			newimages = im;
+		tail = im;
+		im->x = term.c.x;
+		im->y = term.c.y + i;
+		im->cols = cols;
+		im->width = tw;
+		im->height = MIN(th - ch * i, ch);
+		im->pixels = xmalloc((size_t)im->width * im->height * 4);
+		im->pixmap = NULL;
+		im->clipmask = NULL;
+		im->cw = cw;
+		im->ch = ch;
+		im->transparent = 0;
+		im->kitty = 1;
+		im->id = cmd->id;
+		im->placementid = cmd->placementid;
+		dst = (uint32_t *)im->pixels;
+		for (j = 0; j < im->height; j++) {
+			y = sy + (long long)(ch * i + j) * sh / th;
+			for (x = 0; x < tw; x++) {
+				*dst = img->pixels[y * img->width + sx + (long long)x * sw / tw];
+				im->transparent |= (*dst++ == 0);
+			}
+		}
+	}
+
+	tputimages(newimages, numimages, !cmd->nocursor);
+	if (!cmd->nocursor)
+		term.c.x = MIN(term.c.x + cols, term.col-1);
+	return NULL;
+}
+
+static void
+kgpdelete(const KGPCommand *cmd)
+{
+	ImageList *im, *next;
+	KGPImage *img, *nimg;
+	int y, del, deleted = 0;
+	int x1 = cmd->x - 1, y1 = cmd->y - 1;
+	char d = cmd->delete;
+
+	for (im = term.images; im; im = next) {
+		next = im->next;
+		if (!im->kitty)
+			continue;
+		y = IMGROW(im);
+		switch (d | 0x20) {
+		case 'a':
+			del = (y >= 0 && y < term.row);
+			break;
+		case 'i':
+			del = (im->id == cmd->id && (!cmd->placementid ||
+			       im->placementid == cmd->placementid));
+			break;
+		case 'c':
+			del = (y == term.c.y && BETWEEN(term.c.x, im->x, im->x + im->cols - 1));
+			break;
+		case 'p':
+			del = (y == y1 && BETWEEN(x1, im->x, im->x + im->cols - 1));
+			break;
+		case 'x':
+			del = BETWEEN(x1, im->x, im->x + im->cols - 1);
+			break;
+		case 'y':
+			del = (y == y1);
+			break;
+		default:
+			del = 0; /* unsupported delete command */
+			break;
+		}
+		if (del) {
+			delete_image(im);
+			deleted = 1;
+		}
+	}
+
+	/* the upper case letters also free the image data if there are no
+	 * placements left on either screen */
+	if (d >= 'A' && d <= 'Z') {
+		for (img = kgp.images; img; img = nimg) {
+			nimg = img->next;
+			if (d == 'I' && img->id != cmd->id)
+				continue;
+			for (im = term.images; im && !(im->kitty && im->id == img->id); im = im->next)
+				;
+			if (!im)
+				for (im = term.images_alt; im && !(im->kitty && im->id == img->id); im = im->next)
+					;
+			if (!im) {
+				kgpunlink(img);
+				kgpfreeimage(img);
+			}
+		}
+	}
+
+	if (deleted)
+		tfulldirt();
+}
+
+static void
+kgpexec(const KGPCommand *cmd, char *data, size_t len)
+{
+	KGPImage *img = NULL;
+	const char *err = NULL;
+
+	switch (cmd->action) {
+	case 'd':
+		kgpdelete(cmd);
+		return;
+	case 'p':
+		if (!(img = kgpfind(cmd->id)) || !cmd->id) {
+			kgpresponse(cmd, "ENOENT:image not found");
+			return;
+		}
+		kgpresponse(cmd, (err = kgpplace(cmd, img)) ? err : "OK");
+		return;
+	case 'q':
+	case 't':
+	case 'T':
+		if ((err = kgpload(cmd, data, len, &img))) {
+			kgpresponse(cmd, err);
+			return;
+		}
+		break;
+	default:
+		kgpresponse(cmd, "EINVAL:unsupported action");
+		return;
+	}
+
+	if (cmd->action == 'T')
+		err = kgpplace(cmd, img);
+	if (cmd->action != 'q' && cmd->id)
+		kgpstore(img);
+	else
+		kgpfreeimage(img);
+	kgpresponse(cmd, err ? err : "OK");
+}
+
+void
+kgphandle(char *buf)
+{
+	KGPCommand cmd = {
+		.action = 't', .medium = 'd', .delete = 'a', .format = 32
+	};
+	char *payload = buf + 1; /* skip 'G' */
+
+	if (kgpparse(&cmd, &payload) < 0) {
+		fprintf(stderr, "erresc: invalid kitty graphics command\n");
+		return;
+	}
+
+	/* the continuation chunks only have the m and q keys */
+	if (!kgp.loading) {
+		kgp.load = cmd;
+		kgp.len = 0;
+		kgp.overflow = 0;
+	}
+	if (kgp.load.action != 'd')
+		kgpappend(payload);
+	if ((kgp.loading = cmd.more))
+		return;
+
+	kgpexec(&kgp.load, kgp.data ? kgp.data : "", kgp.len);
+
+	free(kgp.data);
+	kgp.data = NULL;
+	kgp.len = kgp.siz = 0;
+}
+
+void
+kgpreset(void)
+{
+	KGPImage *img, *next;
+
+	for (img = kgp.images; img; img = next) {
+		next = img->next;
+		kgpfreeimage(img);
+	}
+	free(kgp.data);
+	memset(&kgp, 0, sizeof(kgp));
+}
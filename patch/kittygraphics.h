@@ -0,0 +1,7 @@
+#define KGP_MAX_WIDTH    8192
+#define KGP_MAX_HEIGHT   8192
+#define KGP_MAX_DATA     ((size_t)KGP_MAX_WIDTH * KGP_MAX_HEIGHT * 4)
+#define KGP_MAX_STORAGE  ((size_t)256 * 1024 * 1024) /* transmitted image data kept for reuse */
+
+static void kgphandle(char *);
+static void kgpreset(void);
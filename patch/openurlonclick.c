@@ -1,5 +1,3 @@
-#include <wchar.h>
-
 struct {
 	int x1, y1;
 	int x2, y2;
@@ -9,14 +7,44 @@ struct {
 	int hinty;
 	int mousey;
 	int cursory;
-} activeurl = { .y2 = -1, .hlink = -1 };
+	int sx, sy; /* first cell of the active url span, sy relative to term.scr = 0 */
+	uint gen;   /* text generation and scroll position of the active url */
+	int scr;
+} activeurl = { .y2 = -1, .hlink = -1, .sx = -1 };
 
 struct {
 	char *protocols;
 	int count;
 	int offset;
+	char first[128]; /* characters a protocol can start with */
 } urlprefixes;
 
+typedef struct {
+	char u;    /* valid url character or 0 */
+	int hlink; /* hyperlink index or -1 */
+	int x, y;
+} UrlChar;
+
+/* The url spans of whole logical lines. They are found in a single pass and
+ * kept until the text of one of their rows changes or a hyperlink id that
+ * they may refer to is evicted. */
+static struct {
+	int valid;
+	int top, bot;
+	int col;
+	Line *lines;      /* the rows top..bot and their generations */
+	uint *gens;
+	int rowsize;
+	Hyperlinks *links;
+	uint liveid;      /* oldest live hyperlink id */
+	UrlChar *chars;
+	int len, size;
+	UrlSpan *spans;
+	int count, spansize;
+	char *buf;
+	int buflen, bufsize;
+} urlcache;
+
 static char validurlchars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
 	"abcdefghijklmnopqrstuvwxyz"
 	"0123456789-._~:/?#@!$&'*+,;=%()[]";
@@ -64,6 +92,8 @@ parseurlprotocols(void)
 	urlprefixes.protocols = NULL;
 	urlprefixes.count = 0;
 	urlprefixes.offset = 0;
+	memset(urlprefixes.first, 0, sizeof(urlprefixes.first));
+	urlcache.valid = 0;
 
 	end = url_protocols + strlen(url_protocols);
 	for (n = 0, prot = url_protocols; prot < end; prot = next+1, n++) {
@@ -83,6 +113,8 @@ parseurlprotocols(void)
 		for (; *prot == ' ' || *prot == '\t'; prot++);
 		for (tail = next-1; tail > prot && (*tail == ' ' || *tail == '\t'); tail--);
 		if (prot <= tail) {
+			if (*prot > 0)
+				urlprefixes.first[(int)*prot] = 1;
 			dst = urlprefixes.protocols + n * urlprefixes.offset;
 			while (prot <= tail)
 				*dst++ = *prot++;
@@ -106,6 +138,27 @@ clearurl(int clearhyperlinkhint)
 	}
 
 	activeurl.y2 = -1;
+	activeurl.sx = -1;
+}
+
+/* the active url is underlined until the text or the scroll position
+ * changes, hovering it again does not redraw its rows */
+static int
+isurlcurrent(void)
+{
+	return activeurl.draw && activeurl.gen == term.textgen && activeurl.scr == term.scr;
+}
+
+static void
+setactiveurl(int y1, int y2)
+{
+	activeurl.y1 = y1;
+	activeurl.y2 = y2;
+	activeurl.gen = term.textgen;
+	activeurl.scr = term.scr;
+	activeurl.draw = 1;
+	for (; y1 <= y2; y1++)
+		term.dirty[y1] = 1;
 }
 
 char *
@@ -113,13 +166,16 @@ detecthyperlink(int col, int row, int draw)
 {
 	Line line;
 	int i, x, y, y1 = row, y2 = row;
-	Hyperlinks *links = term.hyperlinks;
 	int hlink = TLINE(row)[col].hlink;
-	char *url = (hlink < links->capacity) ? links->urls[hlink] : NULL;
+	char *url = hyperlinkurl(hlink);
 
 	if (!draw || !url)
 		return url;
 
+	if (isurlcurrent() && activeurl.hlink == hlink && activeurl.mousey == row)
+		return url;
+	clearurl(1);
+
 	/* If the url spans more than one line, find the first and last lines.
 	 * For performance reasons, only consecutive lines are checked. But if
 	 * this becomes an issue, then the algorithm needs to be changed so
@@ -138,119 +194,278 @@ detecthyperlink(int col, int row, int draw)
 				y1 = y;
 			else
 				y2 = y;
-			term.dirty[y] = 1;
 		}
 	}
-	term.dirty[row] = 1;
 
-	activeurl.y1 = y1;
-	activeurl.y2 = y2;
 	activeurl.hlink = hlink;
 	activeurl.hinty = -1;
 	activeurl.mousey = row;
 	activeurl.cursory = -1;
-	activeurl.draw = 1;
+	setactiveurl(y1, y2);
 	return url;
 }
 
-char *
-detecturl(int col, int row, int draw)
+static void
+addurlspan(int s, int e, int h, const char *url)
 {
-	static char url[2048];
-	Line line;
-	int b, e, x1, y1, x2, y2;
-	int i = sizeof(url)/2+1, j = sizeof(url)/2;
-	int row_start = row, col_start = col;
-	int parentheses = 0, brackets = 0;
-	int minrow = tisaltscr() ? 0 : term.scr - term.histf;
-	int maxrow = tisaltscr() ? term.row - 1 : term.scr + term.row - 1;
+	UrlSpan *span;
+	int len = strlen(url);
 
-	/* clear previously underlined url */
-	if (draw)
-		clearurl(1);
+	if (urlcache.count == urlcache.spansize) {
+		urlcache.spansize = MAX(urlcache.spansize * 2, 16);
+		urlcache.spans = xrealloc(urlcache.spans, urlcache.spansize * sizeof(UrlSpan));
+	}
+	if (urlcache.buflen + len + 1 > urlcache.bufsize) {
+		urlcache.bufsize = MAX(urlcache.bufsize * 2, urlcache.buflen + len + 1);
+		urlcache.buf = xrealloc(urlcache.buf, urlcache.bufsize);
+	}
 
-	line = TLINE(row);
+	span = &urlcache.spans[urlcache.count++];
+	span->x1 = urlcache.chars[s].x;
+	span->y1 = urlcache.chars[s].y;
+	span->x2 = urlcache.chars[e].x;
+	span->y2 = urlcache.chars[e].y;
+	span->s = s;
+	span->h = h;
+	/* the buffer can still move, the pointers are set after the scan */
+	span->url = (char *)(intptr_t)urlcache.buflen;
+	memcpy(urlcache.buf + urlcache.buflen, url, len + 1);
+	urlcache.buflen += len + 1;
+}
 
-	if ((line[col].mode & ATTR_HYPERLINK) ||
-	    (line[col].mode & ATTR_WDUMMY && col > 0 && line[col-1].mode & ATTR_HYPERLINK))
-		return detecthyperlink((line[col].mode & ATTR_WDUMMY) ? col-1 : col, row, draw);
+/* find the urls in a run of valid url characters */
+static void
+scanurlrun(int rs, int re)
+{
+	static char *run;
+	static int runsize;
+	int b, e, p, parentheses, brackets;
+	char c;
+
+	if (re - rs + 1 > runsize) {
+		runsize = re - rs + 1;
+		run = xrealloc(run, runsize);
+	}
+	for (p = rs; p < re; p++)
+		run[p - rs] = urlcache.chars[p].u;
+	run[re - rs] = '\0';
+
+	/* each protocol starts a url, which is detected until the next one */
+	for (b = -1, p = rs; p <= re; p++) {
+		if (p < re && !(urlprefixes.first[(int)run[p - rs]] &&
+		                isprotocolsupported(&run[p - rs])))
+			continue;
+		if (b >= 0) {
+			/* if the url contains extra closing parentheses or
+			 * brackets, we can assume that they do not belong in
+			 * the url */
+			for (parentheses = brackets = 0, e = b + 1; e < re; e++) {
+				c = run[e - rs];
+				if (c == '(') {
+					parentheses++;
+				} else if (c == '[') {
+					brackets++;
+				} else if ((c == ')' && --parentheses < 0) ||
+				           (c == ']' && --brackets < 0)) {
+					break;
+				}
+			}
 
-	if (!ISVALIDURLCHAR(line[col].u))
-		return NULL;
+			/* Ignore some trailing characters to improve detection.
+			 * (Alacritty and many other terminals also ignore these) */
+			while (e > b && strchr(",.;:?!'([", (int)run[e - 1 - rs]) != NULL)
+				e--;
 
-	/* find the first character of a possible url */
-	do {
-		x1 = col_start, y1 = row_start;
-		url[--i] = line[col_start].u;
-		if (--col_start < 0) {
-			if (--row_start < minrow || (col_start = findeowl(TLINE(row_start))) < 0)
-				break;
-			line = TLINE(row_start);
+			if (e > b) {
+				c = run[e - rs];
+				run[e - rs] = '\0';
+				addurlspan(b, e - 1, MIN(e, p) - 1, &run[b - rs]);
+				run[e - rs] = c;
+			}
 		}
-	} while (ISVALIDURLCHAR(line[col_start].u) && i > 0);
+		b = p;
+	}
+}
 
-	/* find the last character of a possible url */
-	line = TLINE(row);
-	do {
-		url[j++] = line[col].u;
-		if (line[col++].mode & ATTR_WRAP) {
-			if (++row > maxrow)
-				break;
-			col = 0;
-			line = TLINE(row);
-		}
-	} while (col < term.col && ISVALIDURLCHAR(line[col].u) && j < sizeof(url)-1);
+/* the ids are not reused, so the cells only stop being hyperlinks when the
+ * oldest live id changes */
+static uint
+liveid(Hyperlinks *links)
+{
+	return links ? links->next - links->count : 0;
+}
+
+static int
+isurlcachevalid(int top, int bot)
+{
+	int y;
+
+	if (!urlcache.valid || urlcache.col != term.col ||
+	    top < urlcache.top || bot > urlcache.bot ||
+	    urlcache.links != term.hyperlinks ||
+	    urlcache.liveid != liveid(term.hyperlinks))
+		return 0;
+	for (y = urlcache.top; y <= urlcache.bot; y++) {
+		if (urlcache.lines[y - urlcache.top] != TLINEABS(y) ||
+		    urlcache.gens[y - urlcache.top] != LINEHDR(TLINEABS(y))->gen)
+			return 0;
+	}
+	return 1;
+}
 
-	url[j] = 0;
+static void
+scanurls(int top, int bot)
+{
+	UrlChar *c;
+	Line line;
+	int i, j, n, x, y, eowl;
+	int minrow = tisaltscr() ? 0 : -term.histf;
 
-	/* find the protocol and confirm this is the url */
-	for (b = sizeof(url)/2; b >= i; b--) {
-		if (isprotocolsupported(&url[b]))
-			break;
+	/* always scan whole wrapped lines */
+	for (; top > minrow && findeowl(TLINEABS(top - 1)) >= 0; top--)
+		;
+	for (; bot < term.row - 1 && findeowl(TLINEABS(bot)) >= 0; bot++)
+		;
+
+	if (isurlcachevalid(top, bot))
+		return;
+
+	if (bot - top + 1 > urlcache.rowsize) {
+		urlcache.rowsize = bot - top + 1;
+		urlcache.lines = xrealloc(urlcache.lines, urlcache.rowsize * sizeof(Line));
+		urlcache.gens = xrealloc(urlcache.gens, urlcache.rowsize * sizeof(uint));
+	}
+	for (y = top; y <= bot; y++) {
+		urlcache.lines[y - top] = TLINEABS(y);
+		urlcache.gens[y - top] = LINEHDR(TLINEABS(y))->gen;
 	}
-	if (b < i)
-		return NULL;
 
-	/* if the url contains extra closing parentheses or brackets,
-	 * we can assume that they do not belong in the url */
-	for (e = b + 1; e < j; e++) {
-		if (url[e] == '(') {
-			parentheses++;
-		} else if (url[e] == '[') {
-			brackets++;
-		} else if ((url[e] == ')' && --parentheses < 0) ||
-		           (url[e] == ']' && --brackets < 0)) {
-			url[e] = 0;
-			break;
+	n = (bot - top + 1) * (term.col + 1);
+	if (n > urlcache.size) {
+		urlcache.size = n;
+		urlcache.chars = xrealloc(urlcache.chars, n * sizeof(UrlChar));
+	}
+
+	/* flatten the lines, a 0 character ends each logical line */
+	for (n = 0, y = top; y <= bot; y++) {
+		line = TLINEABS(y);
+		eowl = findeowl(line);
+		for (x = 0; x < (eowl < 0 ? term.col : eowl + 1); x++) {
+			if (line[x].mode & ATTR_WDUMMY)
+				continue;
+			c = &urlcache.chars[n++];
+			c->u = ISVALIDURLCHAR(line[x].u) ? line[x].u : 0;
+			c->hlink = ishyperlink(&line[x]) ? line[x].hlink : -1;
+			c->x = x;
+			c->y = y;
+		}
+		if (eowl < 0 || y == bot) {
+			c = &urlcache.chars[n++];
+			c->u = 0;
+			c->hlink = -1;
+			c->x = term.col;
+			c->y = y;
+		}
+	}
+
+	urlcache.len = n;
+	urlcache.count = urlcache.buflen = 0;
+	for (i = 0; i < n; i = j) {
+		if (urlcache.chars[i].hlink >= 0) {
+			for (j = i + 1; j < n && urlcache.chars[j].hlink == urlcache.chars[i].hlink; j++)
+				;
+			addurlspan(i, j - 1, j - 1, hyperlinkurl(urlcache.chars[i].hlink));
+		} else if (urlcache.chars[i].u) {
+			for (j = i + 1; j < n && urlcache.chars[j].u && urlcache.chars[j].hlink < 0; j++)
+				;
+			scanurlrun(i, j);
+		} else {
+			j = i + 1;
 		}
 	}
+	for (i = 0; i < urlcache.count; i++)
+		urlcache.spans[i].url = urlcache.buf + (intptr_t)urlcache.spans[i].url;
+
+	urlcache.top = top;
+	urlcache.bot = bot;
+	urlcache.col = term.col;
+	urlcache.links = term.hyperlinks;
+	urlcache.liveid = liveid(term.hyperlinks);
+	urlcache.valid = 1;
+}
 
-	/* Ignore some trailing characters to improve detection.
-	 * (Alacritty and many other terminals also ignore these) */
-	while (strchr(",.;:?!'([", (int)(url[e-1])) != NULL)
-		url[--e] = 0;
+/* returns the url spans of the logical lines that intersect the rows */
+int
+findurls(int top, int bot, UrlSpan **spans)
+{
+	scanurls(top - term.scr, bot - term.scr);
+	*spans = urlcache.spans;
+	return urlcache.count;
+}
 
-	if (e <= sizeof(url)/2)
+static UrlSpan *
+urlspanat(int col, int y)
+{
+	UrlChar *c;
+	int lo, hi, mid;
+
+	/* find the character */
+	for (lo = 0, hi = urlcache.len; lo < hi;) {
+		mid = (lo + hi) / 2;
+		c = &urlcache.chars[mid];
+		if (c->y < y || (c->y == y && c->x < col))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == urlcache.len || urlcache.chars[lo].y != y || urlcache.chars[lo].x != col)
 		return NULL;
 
-	if (draw) {
-		x1 += b - i;
-		y1 += x1 / term.col;
-		x1 %= term.col;
-		x2 = x1 + e - b - 1;
-		y2 = y1 + x2 / term.col;
-		x2 %= term.col;
-		activeurl.x1 = (y1 >= 0) ? x1 : 0;
-		activeurl.x2 = (y2 < term.row) ? x2 : term.col-1;
-		activeurl.y1 = MAX(y1, 0);
-		activeurl.y2 = MIN(y2, term.row-1);
-		activeurl.hlink = -1;
-		activeurl.draw = 1;
-		for (y1 = activeurl.y1; y1 <= activeurl.y2; y1++)
-			term.dirty[y1] = 1;
+	/* find the last url that starts at or before it */
+	for (mid = lo, lo = 0, hi = urlcache.count; lo < hi;) {
+		if (urlcache.spans[(lo + hi) / 2].s <= mid)
+			lo = (lo + hi) / 2 + 1;
+		else
+			hi = (lo + hi) / 2;
 	}
+	return (lo > 0 && mid <= urlcache.spans[lo-1].h) ? &urlcache.spans[lo-1] : NULL;
+}
+
+char *
+detecturl(int col, int row, int draw)
+{
+	Line line = TLINE(row);
+	UrlSpan *span = NULL;
+
+	if (line[col].mode & ATTR_WDUMMY && col > 0 && ishyperlink(&line[col-1]))
+		col--;
+	if (ishyperlink(&line[col]))
+		return detecthyperlink(col, row, draw);
+
+	/* only the logical line under the pointer is scanned, and only again
+	 * when one of its rows has changed */
+	if (ISVALIDURLCHAR(line[col].u)) {
+		scanurls(row - term.scr, row - term.scr);
+		span = urlspanat(col, row - term.scr);
+	}
+
+	if (!draw)
+		return span ? span->url : NULL;
+	if (span && isurlcurrent() && activeurl.sx == span->x1 && activeurl.sy == span->y1)
+		return span->url;
+
+	/* clear previously underlined url */
+	clearurl(1);
+	if (!span)
+		return NULL;
 
-	return &url[b];
+	activeurl.x1 = (span->y1 + term.scr >= 0) ? span->x1 : 0;
+	activeurl.x2 = (span->y2 + term.scr < term.row) ? span->x2 : term.col-1;
+	activeurl.hlink = -1;
+	activeurl.sx = span->x1;
+	activeurl.sy = span->y1;
+	setactiveurl(MAX(span->y1 + term.scr, 0), MIN(span->y2 + term.scr, term.row-1));
+	return span->url;
 }
 
 void
@@ -304,12 +519,15 @@ drawhyperlinkhint(void)
 	int i, x, y, w, ulen;
 	int bot = term.row - 1;
 
-	if (!showhyperlinkhint || !activeurl.draw || activeurl.hlink < 0 ||
-	    !(url = term.hyperlinks->urls[activeurl.hlink]))
+	if (!showhyperlinkhint || !isurlcurrent() || activeurl.hlink < 0 ||
+	    !(url = hyperlinkurl(activeurl.hlink)))
 		return;
 
 	y = (activeurl.mousey == bot || activeurl.cursory == bot) ? bot - 1 : bot;
 	y = (activeurl.mousey == y || activeurl.cursory == y) ? y - 1 : y;
+	/* the hint moved away from the cursor */
+	if (activeurl.hinty >= 0 && activeurl.hinty != y && activeurl.hinty < term.row)
+		term.dirty[activeurl.hinty] = 1;
 	if ((activeurl.hinty = y) < 0)
 		return;
 
@@ -322,7 +540,7 @@ drawhyperlinkhint(void)
 		charsize = utf8decode(url + i, &g.u, ulen - i);
 		if (charsize == 0)
 			break;
-		w = wcwidth(g.u);
+		w = runewidth(g.u);
 		MODBIT(g.mode, (w > 1), ATTR_WIDE);
 		xdrawglyph(g, x, y);
 	}
@@ -1,9 +1,18 @@
 #include <spawn.h>
 
+/* rows are relative to term.scr = 0, so they stay valid while scrolling */
+typedef struct {
+	int x1, y1;   /* first cell of the url */
+	int x2, y2;   /* last cell of the url */
+	int s, h;     /* first and last character the url is detected at */
+	char *url;
+} UrlSpan;
+
 void parseurlprotocols(void);
 void clearurl(int clearhyperlinkhint);
 void drawhyperlinkhint(void);
 char *detecturl(int col, int row, int draw);
+int findurls(int top, int bot, UrlSpan **spans);
 void openUrlOnClick(int col, int row, char* url_opener);
 void copyUrlOnClick(int col, int row);
 
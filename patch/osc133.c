@@ -0,0 +1,444 @@
+/* The OSC 133 marks of the main screen are indexed by their absolute row, so
+ * jumping to a prompt or finding the output of a command is a search in the
+ * index instead of a scan of the history. A command starts with its first
+ * mark and later marks are added to it until it gets the end mark. */
+
+typedef struct {
+	int y, x;
+	int i, m; /* index of the prompt and the mark */
+	int newy, newx;
+} ReflowMark;
+
+static struct {
+	ReflowMark *marks;
+	int n, cur;
+} reflowprompts;
+
+static Prompt *
+promptat(int i)
+{
+	return &term.prompts.list[(term.prompts.head + i) % term.prompts.size];
+}
+
+/* returns the first mark of the prompt */
+static int
+promptfirst(const Prompt *p)
+{
+	int m;
+
+	for (m = 0; m < PROMPT_NMARKS - 1 && !(p->marks & (1 << m)); m++)
+		;
+	return m;
+}
+
+/* returns the row of the first mark of the prompt */
+static int
+promptrow(const Prompt *p)
+{
+	return PROMPTROW(p, promptfirst(p));
+}
+
+static Prompt *
+newprompt(int row)
+{
+	Prompts *pr = &term.prompts;
+	Prompt *p;
+	int i;
+
+	/* the prompts from the row on have been overwritten */
+	while (pr->n > 0 && promptrow(promptat(pr->n - 1)) >= row - pr->off)
+		pr->n--;
+
+	if (pr->n == pr->size) {
+		p = xmalloc((pr->size ? pr->size * 2 : 16) * sizeof(Prompt));
+		for (i = 0; i < pr->n; i++)
+			p[i] = *promptat(i);
+		free(pr->list);
+		pr->list = p;
+		pr->head = 0;
+		pr->size = pr->size ? pr->size * 2 : 16;
+	}
+	p = promptat(pr->n++);
+	p->marks = 0;
+	p->status = -1;
+	return p;
+}
+
+void
+markprompt(int mark, int x, int y, int status)
+{
+	Prompts *pr = &term.prompts;
+	Prompt *p = pr->n > 0 ? promptat(pr->n - 1) : NULL;
+	int row = y + pr->off;
+
+	if (IS_SET(MODE_ALTSCREEN))
+		return;
+
+	if (mark == PROMPT_START) {
+		/* the prompt is redrawn on the same row */
+		if (!p || !(p->marks & (1 << PROMPT_START)) ||
+		    (p->marks >> PROMPT_OUTPUT) || p->y[PROMPT_START] != row)
+			p = newprompt(row);
+		p->marks = 0;
+	} else if (!p || (p->marks >> mark)) {
+		/* the end of a command that was never started is of no use */
+		if (mark == PROMPT_END)
+			return;
+		p = newprompt(row);
+	}
+	p->y[mark] = row;
+	p->x[mark] = x;
+	p->marks |= 1 << mark;
+	if (mark == PROMPT_OUTPUT) {
+		clock_gettime(CLOCK_MONOTONIC, &p->start);
+	} else if (mark == PROMPT_END) {
+		clock_gettime(CLOCK_MONOTONIC, &p->end);
+		p->status = status;
+	}
+}
+
+/* drops the marks in the rows top to bot of the prompts from i on, or moves
+ * them n rows and drops the ones that leave the rows. A prompt that loses
+ * its first mark is removed. */
+static void
+filterprompts(int i, int top, int bot, int n)
+{
+	Prompts *pr = &term.prompts;
+	Prompt *p;
+	int j, m, row;
+
+	for (j = i; i < pr->n; i++) {
+		p = promptat(i);
+		for (m = 0; m < PROMPT_NMARKS; m++) {
+			if (!(p->marks & (1 << m)) ||
+			    !BETWEEN(row = PROMPTROW(p, m), top, bot))
+				continue;
+			if (n && BETWEEN(row + n, top, bot)) {
+				p->y[m] += n;
+			} else if (m == promptfirst(p)) {
+				p->marks = 0;
+				break;
+			} else {
+				p->marks &= ~(1 << m);
+			}
+		}
+		if (p->marks)
+			*promptat(j++) = *p;
+	}
+	pr->n = j;
+}
+
+void
+clearprompts(int top, int bot)
+{
+	filterprompts(0, top, bot, 0);
+}
+
+/* moves the marks in the rows top to bot n rows and drops the ones that
+ * leave them */
+void
+moveprompts(int top, int bot, int n)
+{
+	Prompt *p;
+	int i, m;
+
+	/* the marks are in the order of the rows, so only the newest prompts
+	 * can be in the region */
+	for (i = term.prompts.n; i > 0; i--) {
+		p = promptat(i - 1);
+		for (m = PROMPT_NMARKS - 1; !(p->marks & (1 << m)); m--)
+			;
+		if (PROMPTROW(p, m) < top)
+			break;
+	}
+	filterprompts(i, top, bot, n);
+}
+
+void
+scrollprompts(int n)
+{
+	Prompts *pr = &term.prompts;
+	Prompt *p;
+	int i, m;
+
+	pr->off -= n;
+	while (pr->n > 0 && promptrow(promptat(0)) < -HISTSIZE) {
+		pr->head = (pr->head + 1) % pr->size;
+		pr->n--;
+	}
+
+	/* rebase the rows before the offset can overflow */
+	if (pr->n == 0) {
+		pr->off = 0;
+	} else if (pr->off > INT_MAX / 2 || pr->off < INT_MIN / 2) {
+		for (i = 0; i < pr->n; i++) {
+			p = promptat(i);
+			for (m = 0; m < PROMPT_NMARKS; m++)
+				p->y[m] -= pr->off;
+		}
+		pr->off = 0;
+	}
+}
+
+void
+freeprompts(void)
+{
+	free(term.prompts.list);
+	memset(&term.prompts, 0, sizeof(term.prompts));
+}
+
+/* returns the row of the closest prompt above (dy < 0) or below (dy > 0) the
+ * row y that is still on the screen or in the history, INT_MIN if none */
+int
+findprompt(int y, int dy)
+{
+	Prompts *pr = &term.prompts;
+	Prompt *p;
+	int lo = 0, hi = pr->n, mid, row;
+
+	/* the first prompt that starts below the row */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (promptrow(promptat(mid)) > y)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	if (dy < 0) {
+		/* skip the prompt that starts in the row */
+		if (lo > 0 && promptrow(promptat(lo - 1)) == y)
+			lo--;
+		lo--;
+	}
+
+	/* prompts that were erased are skipped */
+	for (; lo >= 0 && lo < pr->n; lo += dy < 0 ? -1 : 1) {
+		p = promptat(lo);
+		if (!(p->marks & (1 << PROMPT_START)))
+			continue;
+		row = PROMPTROW(p, PROMPT_START);
+		if (row < -term.histf || row >= term.row)
+			continue;
+		if (LINEHDR(TLINEABS(row))->prompt >= 0)
+			return row;
+	}
+	return INT_MIN;
+}
+
+/* writes the text from the cell x1 of the row y1 to the cell before x2 of
+ * the row y2 to buf, or only measures it if buf is NULL */
+static size_t
+promptcopy(char *buf, int y1, int x1, int y2, int x2)
+{
+	char tmp[UTF_SIZ];
+	const Rune *runes;
+	const Glyph *gp, *lgp;
+	size_t n = 0;
+	int k, y, lastx;
+	Line line;
+
+	for (y = y1; y <= y2 && (y < y2 || x2 > 0); y++) {
+		line = TLINEABS(y);
+		lastx = MIN(y == y2 ? x2 - 1 : term.col - 1, tlinelen(line) - 1);
+		gp = &line[y == y1 ? x1 : 0];
+		lgp = &line[MAX(lastx, 0)];
+		if (lastx < 0 || gp > lgp) {
+			/* nothing to copy */
+		} else if (buf) {
+			n = tgetglyphs(buf + n, gp, lgp) - buf;
+		} else {
+			for (; gp <= lgp; gp++) {
+				if (gp->mode & ATTR_WDUMMY)
+					continue;
+				for (k = glyphrunes(&gp->u, &runes); k > 0; k--, runes++)
+					n += (*runes < 0x80) ? 1 : utf8encode(*runes, tmp);
+			}
+		}
+		if (y < y2 && !tiswrapped(line)) {
+			if (buf)
+				buf[n] = '\n';
+			n++;
+		}
+	}
+	return n;
+}
+
+/* returns the text between the marks m1 and m2 of the prompt, the cursor is
+ * taken for a missing m2 */
+static char *
+promptgettext(const Prompt *p, int m1, int m2, size_t *len)
+{
+	int y1 = PROMPTROW(p, m1), x1 = p->x[m1];
+	int y2 = term.c.y, x2 = term.c.x;
+	char *str;
+
+	if (p->marks & (1 << m2))
+		y2 = PROMPTROW(p, m2), x2 = p->x[m2];
+	/* the start of the text may have left the history */
+	if (y1 < -term.histf)
+		y1 = -term.histf, x1 = 0;
+	*len = (y1 <= y2) ? promptcopy(NULL, y1, x1, y2, x2) : 0;
+	str = xmalloc(*len + 1);
+	if (*len > 0)
+		promptcopy(str, y1, x1, y2, x2);
+	str[*len] = '\0';
+	return str;
+}
+
+static char *
+jsonstring(char *buf, const char *s, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned char c;
+
+	*buf++ = '"';
+	for (; len > 0; len--, s++) {
+		c = *s;
+		if (c == '"' || c == '\\') {
+			*buf++ = '\\';
+			*buf++ = c;
+		} else if (c == '\n') {
+			*buf++ = '\\';
+			*buf++ = 'n';
+		} else if (c < 0x20 || c == 0x7f) {
+			buf += sprintf(buf, "\\u00%c%c", hex[c >> 4], hex[c & 15]);
+		} else {
+			*buf++ = c;
+		}
+	}
+	*buf++ = '"';
+	return buf;
+}
+
+/* writes the output of the nth last command that has one to the output file,
+ * as plain text or as a JSON object with the command and its timing */
+void
+tdumpoutput(int n, int json)
+{
+	Prompt *p = NULL;
+	struct timespec now;
+	char *cmd = NULL, *out, *str, *ptr;
+	size_t cmdlen = 0, outlen;
+	int i;
+
+	/* the prompt rows refer to the main screen, which cannot be read
+	 * while the alternate screen is shown */
+	if (!tprinteropen() || IS_SET(MODE_ALTSCREEN))
+		return;
+	for (i = term.prompts.n - 1; i >= 0; i--) {
+		p = promptat(i);
+		if ((p->marks & (1 << PROMPT_OUTPUT)) && n-- == 0)
+			break;
+	}
+	if (i < 0)
+		return;
+
+	out = promptgettext(p, PROMPT_OUTPUT, PROMPT_END, &outlen);
+	if (!json) {
+		tprinter(out, outlen);
+		free(out);
+		return;
+	}
+
+	if (p->marks & (1 << PROMPT_COMMAND))
+		cmd = promptgettext(p, PROMPT_COMMAND, PROMPT_OUTPUT, &cmdlen);
+	if (!(p->marks & (1 << PROMPT_END)))
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	str = xmalloc(128 + 6 * (cmdlen + outlen));
+	ptr = str + sprintf(str, "{\"status\":%d,\"running\":%s,\"duration_ms\":%ld,\"command\":",
+	                    p->status, (p->marks & (1 << PROMPT_END)) ? "false" : "true",
+	                    (long)TIMEDIFF(((p->marks & (1 << PROMPT_END)) ? p->end : now), p->start));
+	ptr = jsonstring(ptr, cmd ? cmd : "", cmdlen);
+	ptr += sprintf(ptr, ",\"output\":");
+	ptr = jsonstring(ptr, out, outlen);
+	ptr += sprintf(ptr, "}\n");
+	tprinter(str, ptr - str);
+	free(str);
+	free(cmd);
+	free(out);
+}
+
+static int
+reflowmarkcmp(const void *a, const void *b)
+{
+	const ReflowMark *ma = a, *mb = b;
+
+	if (ma->y != mb->y)
+		return ma->y < mb->y ? -1 : 1;
+	return ma->x - mb->x;
+}
+
+/* collects the marks of the prompts in the order of their position */
+void
+treflow_saveprompts(void)
+{
+	Prompt *p;
+	ReflowMark *rm;
+	int i, m;
+
+	reflowprompts.n = reflowprompts.cur = 0;
+	if (term.prompts.n == 0)
+		return;
+	rm = reflowprompts.marks = xrealloc(reflowprompts.marks,
+		term.prompts.n * PROMPT_NMARKS * sizeof(ReflowMark));
+	for (i = 0; i < term.prompts.n; i++) {
+		p = promptat(i);
+		for (m = 0; m < PROMPT_NMARKS; m++) {
+			if (!(p->marks & (1 << m)))
+				continue;
+			*rm++ = (ReflowMark){
+				.y = PROMPTROW(p, m), .x = p->x[m], .i = i, .m = m,
+				.newy = INT_MIN
+			};
+		}
+	}
+	reflowprompts.n = rm - reflowprompts.marks;
+	qsort(reflowprompts.marks, reflowprompts.n, sizeof(ReflowMark),
+	      reflowmarkcmp);
+}
+
+/* the n cells from ox on of the row oldy are moved to nx of the new row newy.
+ * The marks after the last cell of a row are kept on its last new row. */
+void
+treflow_moveprompts(int oldy, int ox, int n, int last, int newy, int nx,
+                    int col)
+{
+	ReflowMark *rm;
+
+	/* the rows are visited in ascending order */
+	for (; reflowprompts.cur < reflowprompts.n; reflowprompts.cur++) {
+		rm = &reflowprompts.marks[reflowprompts.cur];
+		if (rm->y > oldy || (rm->y == oldy && !last && rm->x >= ox + n))
+			break;
+		if (rm->y == oldy) {
+			rm->newy = newy;
+			rm->newx = MIN(nx + MAX(rm->x - ox, 0), col - 1);
+		}
+	}
+}
+
+/* moves the marks to the rows given by treflow_moveprompts(), the new rows
+ * are offset by off */
+void
+treflow_restoreprompts(int off, int row)
+{
+	ReflowMark *rm = reflowprompts.marks;
+	Prompt *p;
+	int i, y;
+
+	if (reflowprompts.n == 0)
+		return;
+	term.prompts.off = 0;
+	for (i = 0; i < reflowprompts.n; i++, rm++) {
+		p = promptat(rm->i);
+		if (rm->newy == INT_MIN || (y = rm->newy - off) < -term.histf ||
+		    y >= row) {
+			/* dropped with the first mark by filterprompts() */
+			p->y[rm->m] = INT_MIN / 2;
+		} else {
+			p->y[rm->m] = y;
+			p->x[rm->m] = rm->newx;
+		}
+	}
+	filterprompts(0, INT_MIN / 2, INT_MIN / 2, 0);
+}
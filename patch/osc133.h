@@ -0,0 +1,10 @@
+void markprompt(int mark, int x, int y, int status);
+void clearprompts(int top, int bot);
+void moveprompts(int top, int bot, int n);
+void scrollprompts(int n);
+void freeprompts(void);
+int findprompt(int y, int dy);
+void tdumpoutput(int n, int json);
+void treflow_saveprompts(void);
+void treflow_moveprompts(int oldy, int ox, int n, int last, int newy, int nx, int col);
+void treflow_restoreprompts(int off, int row);
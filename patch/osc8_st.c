@@ -1,48 +1,173 @@
+/* Hyperlink ids are given out in sequence and are not reused, so a cell
+ * keeps pointing to its link for as long as the link is alive and an
+ * evicted id is detected when its url is looked up. The keys of the live
+ * ids are kept in the order of the ids in a circular arena, so evicting the
+ * oldest links when the memory budget is used up only moves the tail. Links
+ * with the same url and OSC 8 id share the newest id of the key while it is
+ * not about to be evicted. */
+
+static uint
+hyperlinkhash(const char *url, int ulen, const char *id, int idlen)
+{
+	uint h = 2166136261u;
+	int i;
+
+	for (i = 0; i <= ulen; i++)
+		h = (h ^ (unsigned char)url[i]) * 16777619u;
+	for (i = 0; i < idlen; i++)
+		h = (h ^ (unsigned char)id[i]) * 16777619u;
+	return h;
+}
+
+/* returns the slot of the key in the table or the empty slot for it */
+static uint
+findhyperlinkkey(Hyperlinks *links, const char *url, int ulen, const char *id,
+                 int idlen, uint hash)
+{
+	HyperlinkEntry *e;
+	uint i, mask = links->tablesize - 1;
+
+	for (i = hash & mask; links->table[i] != HLINK_NONE; i = (i + 1) & mask) {
+		e = &links->ids[links->table[i] % links->idsize];
+		if (e->hash == hash && e->len == ulen + 1 + idlen &&
+		    !memcmp(links->arena + e->off, url, ulen + 1) &&
+		    !memcmp(links->arena + e->off + ulen + 1, id, idlen))
+			break;
+	}
+	return i;
+}
+
 static void
-deleteoldhyperlinks(int percent)
+removehyperlinkkey(Hyperlinks *links, uint i)
 {
-	Line line;
-	int i, j, i1, i2, i3, i4, n, x, y;
-	Hyperlinks *links = term.hyperlinks;
+	uint j, k, mask = links->tablesize - 1;
 
-	if (!links || links->count <= 0 || percent <= 0)
-		return;
+	/* move the following keys back unless it moves them before their
+	 * home slot */
+	links->table[i] = HLINK_NONE;
+	for (j = (i + 1) & mask; links->table[j] != HLINK_NONE; j = (j + 1) & mask) {
+		k = links->ids[links->table[j] % links->idsize].hash & mask;
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		links->table[i] = links->table[j];
+		links->table[j] = HLINK_NONE;
+		i = j;
+	}
+	links->nkeys--;
+}
+
+static void
+growhyperlinktable(Hyperlinks *links)
+{
+	uint i, j, id, mask, *old = links->table, oldsize = links->tablesize;
 
-	/* calculate how many old hyperlinks need to be deleted */
-	n = MAX(links->count * MIN(percent, 100) / 100, 1);
+	links->tablesize *= 2;
+	links->table = xmalloc(links->tablesize * sizeof(*links->table));
+	memset(links->table, 0xff, links->tablesize * sizeof(*links->table));
 
-	/* calculate the hyperlink indexes that will be deleted */
-	i1 = i3 = (links->head - links->count + 1 + links->capacity) % links->capacity;
-	i2 = i4 = i1 + n - 1;
-	if (i2 >= links->capacity) {
-		i2 = links->capacity - 1;
-		i3 = 0;
-		i4 -= links->capacity;
+	mask = links->tablesize - 1;
+	for (i = 0; i < oldsize; i++) {
+		if ((id = old[i]) == HLINK_NONE)
+			continue;
+		for (j = links->ids[id % links->idsize].hash & mask;
+		     links->table[j] != HLINK_NONE; j = (j + 1) & mask)
+			;
+		links->table[j] = id;
 	}
+	free(old);
+}
 
-	/* delete the hyperlink urls */
-	for (i = i1; i < i1 + n; i++) {
-		j = i % links->capacity;
-		if (links->urls[j]) {
-			free(links->urls[j]);
-			links->urls[j] = NULL;
-		}
+static void
+growhyperlinkids(Hyperlinks *links)
+{
+	HyperlinkEntry *old = links->ids;
+	uint i, id, oldsize = links->idsize;
+
+	links->idsize = MAX(oldsize * 2, 64);
+	links->ids = xmalloc(links->idsize * sizeof(*links->ids));
+	for (i = 0; i < links->count; i++) {
+		id = (links->next - links->count + i) & HLINK_MASK;
+		links->ids[id % links->idsize] = old[id % oldsize];
 	}
+	free(old);
+}
 
-	/* remove the hyperlinks from the screen buffer and the scrollback */
-	for (y = (IS_SET(MODE_ALTSCREEN) ? 0 : -term.histf); y < term.row; y++) {
-		line = TLINEABS(y);
-		for (x = 0; x < term.col; x++) {
-			if (line[x].mode & ATTR_HYPERLINK) {
-				i = line[x].hlink;
-				if ((i >= i1 && i <= i2) || (i >= i3 && i <= i4))
-					line[x].mode &= ~ATTR_HYPERLINK;
-			}
-		}
+static HyperlinkEntry *
+hyperlinkat(Hyperlinks *links, uint hlink)
+{
+	uint d = (links->next - hlink) & HLINK_MASK;
+
+	if (d == 0 || d > links->count)
+		return NULL;
+	return &links->ids[hlink % links->idsize];
+}
+
+static void
+evicthyperlink(Hyperlinks *links)
+{
+	uint i, id = (links->next - links->count) & HLINK_MASK;
+	HyperlinkEntry *e = &links->ids[id % links->idsize];
+	const char *key = links->arena + e->off;
+	int ulen = strlen(key);
+
+	/* the key stays if a newer id shares it */
+	i = findhyperlinkkey(links, key, ulen, key + ulen + 1, e->len - ulen - 1, e->hash);
+	if (links->table[i] == id)
+		removehyperlinkkey(links, i);
+
+	links->count--;
+	links->used -= e->len + sizeof(HyperlinkEntry);
+	links->tail = links->count ? links->ids[(id + 1) % links->idsize].off : links->head;
+	links->evicted++;
+	links->evictedbytes += e->len;
+}
+
+/* returns the arena offset for a key of n bytes or -1 if there is no room */
+static long
+hyperlinkalloc(Hyperlinks *links, uint n)
+{
+	if (links->count == 0)
+		links->head = links->tail = 0;
+
+	if (links->count == 0 || links->head > links->tail) {
+		if (links->budget - links->head >= n)
+			return links->head;
+		if (links->tail >= n)
+			return 0;
+		return -1;
 	}
+	return (links->tail - links->head >= n) ? links->head : -1;
+}
 
-	tfulldirt();
-	links->count -= n;
+/* the url is valid until the next hyperlink is parsed */
+char *
+hyperlinkurl(uint hlink)
+{
+	HyperlinkEntry *e = hyperlinkat(term.hyperlinks, hlink);
+
+	return e ? term.hyperlinks->arena + e->off : NULL;
+}
+
+int
+ishyperlink(const Glyph *g)
+{
+	return (g->mode & ATTR_HYPERLINK) && hyperlinkurl(g->hlink);
+}
+
+void
+hyperlinkstats(void)
+{
+	Hyperlinks *links;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		links = (i == IS_SET(MODE_ALTSCREEN)) ? term.hyperlinks : term.hyperlinks_alt;
+		fprintf(stderr, "hyperlinks (%s): %u live, %zu of %zu bytes, "
+		        "%u created, %u reused, %u evicted (%zu bytes)\n",
+		        i ? "alternate" : "primary", links->count, links->used,
+		        links->budget, links->created, links->reused,
+		        links->evicted, links->evictedbytes);
+	}
 }
 
 void
@@ -50,10 +175,16 @@ deletehyperlinks(int checkscreen)
 {
 	int x, y;
 	Line line;
+	Hyperlinks *links = term.hyperlinks;
+
+	if (!links || links->count == 0)
+		return;
 
 	if (checkscreen) {
 		for (y = (IS_SET(MODE_ALTSCREEN) ? 0 : -term.histf); y < term.row; y++) {
 			line = TLINEABS(y);
+			if (!(LINEHDR(line)->flags & LINE_HYPERLINK))
+				continue;
 			for (x = 0; x < term.col; x++) {
 				if (line[x].mode & ATTR_HYPERLINK)
 					return;
@@ -61,15 +192,24 @@ deletehyperlinks(int checkscreen)
 		}
 	}
 
-	deleteoldhyperlinks(100);
+	/* the ids are not reused, so the cells that still refer to them
+	 * are no longer hyperlinks */
+	memset(links->table, 0xff, links->tablesize * sizeof(*links->table));
+	links->nkeys = links->count = links->head = links->tail = 0;
+	links->used = 0;
+	term.textgen++;
+	tfulldirt();
 }
 
 void
 parsehyperlink(int narg, char *param, char *url)
 {
 	char *id;
-	int i, plen;
+	int i, plen, ulen, idlen;
 	int max_url_len = 2048;
+	uint hash, len, hlink;
+	long off;
+	HyperlinkEntry *e;
 	Hyperlinks *links = term.hyperlinks;
 
 	/* close the current hyperlink */
@@ -79,14 +219,14 @@ parsehyperlink(int narg, char *param, char *url)
 	if (narg < 2 || url[0] == '\0')
 		return;
 
-	if (strlen(url) > max_url_len) {
+	if ((ulen = strlen(url)) > max_url_len) {
 		fprintf(stderr, "erresc (OSC 8): url is too long\n");
 		return;
 	}
 
 	/* parse id */
 	plen = strlen(param);
-	for (id = NULL, i = 0; i < plen;) {
+	for (id = "", i = 0; i < plen;) {
 		if (strncmp(&param[i], "id=", 3) == 0)
 			id = &param[i + 3];
 		for (; i < plen && param[i] != ':'; i++)
@@ -94,25 +234,63 @@ parsehyperlink(int narg, char *param, char *url)
 		param[i++] = '\0';
 	}
 
-	/* keep using the current hyperlink if the id and url match */
-	if (id && id[0] && links->lastid[0] && links->count > 0) {
-		if (!strcmp(id, links->lastid) && links->urls[links->head] &&
-		    !strcmp(url, links->urls[links->head])) {
+	idlen = strlen(id);
+	len = ulen + 1 + idlen;
+	if (len + sizeof(HyperlinkEntry) > links->budget) {
+		fprintf(stderr, "erresc (OSC 8): hyperlink memory is too small\n");
+		return;
+	}
+	if (!links->arena)
+		links->arena = xmalloc(links->budget);
+	hash = hyperlinkhash(url, ulen, id, idlen);
+
+	/* keep using the newest id of the key unless it is about to be evicted */
+	if (links->count > 0) {
+		i = findhyperlinkkey(links, url, ulen, id, idlen, hash);
+		hlink = links->table[i];
+		if (hlink != HLINK_NONE && ((links->next - hlink) & HLINK_MASK) <= links->count / 2) {
+			links->reused++;
 			term.c.attr.mode |= ATTR_HYPERLINK;
-			term.c.attr.hlink = links->head;
+			term.c.attr.hlink = hlink;
 			return;
 		}
 	}
 
-	/* If the hyperlink buffer is full, delete 10 percent of old links */
-	if (links->count >= links->capacity)
-		deleteoldhyperlinks(10);
+	/* evict the oldest links until the key fits */
+	for (;;) {
+		off = (links->used + len + sizeof(HyperlinkEntry) <= links->budget)
+			? hyperlinkalloc(links, len) : -1;
+		if (off >= 0 || links->count == 0)
+			break;
+		evicthyperlink(links);
+	}
+	if (off < 0)
+		return;
+
+	if (links->count == links->idsize)
+		growhyperlinkids(links);
+	if ((links->nkeys + 1) * 2 > links->tablesize)
+		growhyperlinktable(links);
 
+	hlink = links->next;
+	links->next = (links->next + 1) & HLINK_MASK;
+	e = &links->ids[hlink % links->idsize];
+	e->off = off;
+	e->len = len;
+	e->hash = hash;
+	memcpy(links->arena + off, url, ulen + 1);
+	memcpy(links->arena + off + ulen + 1, id, idlen);
+	links->head = off + len;
 	links->count++;
-	links->head = (links->head + 1) % links->capacity;
-	links->urls[links->head] = xstrdup(url);
-	snprintf(links->lastid, sizeof(links->lastid), "%s", id ? id : "\0");
+	links->used += len + sizeof(HyperlinkEntry);
+	links->created++;
+
+	/* an older id of the key is replaced by the new one */
+	i = findhyperlinkkey(links, url, ulen, id, idlen, hash);
+	if (links->table[i] == HLINK_NONE)
+		links->nkeys++;
+	links->table[i] = hlink;
 
 	term.c.attr.mode |= ATTR_HYPERLINK;
-	term.c.attr.hlink = links->head;
+	term.c.attr.hlink = hlink;
 }
@@ -1,2 +1,5 @@
 void deletehyperlinks(int checkscreen);
 void parsehyperlink(int narg, char *param, char *url);
+char *hyperlinkurl(uint hlink);
+int ishyperlink(const Glyph *g);
+void hyperlinkstats(void);
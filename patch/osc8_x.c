@@ -1,19 +1,19 @@
 void
 inithyperlinks(void)
 {
-	int i, cap;
+	int i;
 	Hyperlinks *tmp;
 
 	for (i = 0; i < 2; i++) {
 		term.hyperlinks = xmalloc(sizeof(Hyperlinks));
 		memset(term.hyperlinks, 0, sizeof(Hyperlinks));
 
-		term.hyperlinks->capacity = (i == 0) ? hyperlinkcache_pri : hyperlinkcache_alt;
-		term.hyperlinks->capacity = LIMIT(term.hyperlinks->capacity, 0, 65536);
-
-		cap = MAX(term.hyperlinks->capacity, 1);
-		term.hyperlinks->urls = xmalloc(cap * sizeof(*term.hyperlinks->urls));
-		memset(term.hyperlinks->urls, 0, cap * sizeof(*term.hyperlinks->urls));
+		/* the arena is allocated when the first hyperlink is parsed,
+		 * the id ring and the table grow with the number of links */
+		term.hyperlinks->budget = (i == 0) ? hyperlinkmemory_pri : hyperlinkmemory_alt;
+		term.hyperlinks->tablesize = 64;
+		term.hyperlinks->table = xmalloc(term.hyperlinks->tablesize * sizeof(*term.hyperlinks->table));
+		memset(term.hyperlinks->table, 0xff, term.hyperlinks->tablesize * sizeof(*term.hyperlinks->table));
 
 		tmp = term.hyperlinks;
 		term.hyperlinks = term.hyperlinks_alt;
@@ -20,8 +20,6 @@ kscrolldown(const Arg* a)
 		selmove(-n); /* negate change in term.scr */
 	tfulldirt();
 
-	scroll_images(-1*n);
-
 	if (n > 0)
 		restoremousecursor();
 }
@@ -48,8 +46,6 @@ kscrollup(const Arg* a)
 		selmove(n); /* negate change in term.scr */
 	tfulldirt();
 
-	scroll_images(n);
-
 	if (n > 0)
 		restoremousecursor();
 }
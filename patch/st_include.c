@@ -1,7 +1,10 @@
 /* Patches */
 #include "casefold.c"
+#include "grapheme.c"
 #include "keyboardselect_st.c"
+#include "kittygraphics.c"
 #include "newterm.c"
+#include "osc133.c"
 #include "osc7.c"
 #include "osc8_st.c"
 #include "scrollback.c"
@@ -1,8 +1,11 @@
 /* Patches */
 #include "casefold.h"
+#include "grapheme.h"
 #include "keyboardselect_st.h"
+#include "kittygraphics.h"
 #include "newterm.h"
 #include "openurlonclick.h"
+#include "osc133.h"
 #include "osc7.h"
 #include "osc8_st.h"
 #include "scrollback.h"
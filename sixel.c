@@ -2,8 +2,11 @@
 // originally written by kmiya@cluti (https://github.com/saitoha/sixel/blob/master/fromsixel.c)
 // Licensed under the terms of the GNU General Public License v3 or later.
 
+#include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>  /* memcpy */
+#include <unistd.h>
 
 #include "st.h"
 #include "win.h"
@@ -14,6 +17,27 @@
 #define SIXEL_PALVAL(n,a,m) (((n) * (a) + ((m) / 2)) / (m))
 #define SIXEL_XRGB(r,g,b) SIXEL_RGB(SIXEL_PALVAL(r, 255, 100), SIXEL_PALVAL(g, 255, 100), SIXEL_PALVAL(b, 255, 100))
 
+typedef struct sixel_band {
+	const unsigned char *start;  /* data between two DECGNLs */
+	const unsigned char *end;
+	int pos_y;
+	int color_index;
+	int repeat_count;
+	int max_x;
+	int max_y;
+} sixel_band_t;
+
+typedef struct sixel_worker {
+	pthread_t thread;
+	int started;
+	sixel_image_t *image;
+	sixel_band_t *bands;
+	int first;
+	int last;
+} sixel_worker_t;
+
+static int sixel_parser_decode(sixel_state_t *st, size_t len);
+
 static sixel_color_t const sixel_default_color_table[] = {
 	SIXEL_XRGB( 0,  0,  0),  /*  0 Black    */
 	SIXEL_XRGB(20, 20, 80),  /*  1 Blue     */
@@ -35,19 +59,23 @@ static sixel_color_t const sixel_default_color_table[] = {
 
 void
 scroll_images(int n) {
-	ImageList *im, *next;
-	int top = tisaltscr() ? 0 : term.scr - HISTSIZE;
-
-	for (im = term.images; im; im = next) {
-		next = im->next;
-		im->y += n;
-
-		/* check if the current sixel has exceeded the maximum
-		 * draw distance, and should therefore be deleted */
-		if (im->y < top) {
-			//fprintf(stderr, "im@0x%08x exceeded maximum distance\n");
-			delete_image(im);
-		}
+	ImageList *im;
+	int top = tisaltscr() ? 0 : -HISTSIZE;
+
+	/* the list is sorted by row, so moving all the images only requires
+	 * changing the offset and deleting the ones at the head of the list
+	 * that have exceeded the maximum draw distance */
+	term.imgoff -= n;
+	while ((im = term.images) && IMGROW(im) < top)
+		delete_image(im);
+
+	/* rebase the rows before the offset can overflow */
+	if (!term.images) {
+		term.imgoff = 0;
+	} else if (term.imgoff > INT_MAX / 2 || term.imgoff < INT_MIN / 2) {
+		for (im = term.images; im; im = im->next)
+			im->y -= term.imgoff;
+		term.imgoff = 0;
 	}
 }
 
@@ -60,6 +88,8 @@ delete_image(ImageList *im)
 		term.images = im->next;
 	if (im->next)
 		im->next->prev = im->prev;
+	else
+		term.imagestail = im->prev;
 	if (im->pixmap)
 		XFreePixmap(xw.dpy, (Drawable)im->pixmap);
 	if (im->clipmask)
@@ -68,6 +98,30 @@ delete_image(ImageList *im)
 	free(im);
 }
 
+void
+insert_image(ImageList *im)
+{
+	ImageList *prev;
+
+	/* keep the list sorted by row. New images are usually placed at the
+	 * bottom, so search from the tail. Images on the same row keep their
+	 * insertion order, so the newer ones are drawn on top. */
+	for (prev = term.imagestail; prev && prev->y > im->y; prev = prev->prev)
+		;
+	im->prev = prev;
+	if (prev) {
+		im->next = prev->next;
+		prev->next = im;
+	} else {
+		im->next = term.images;
+		term.images = im;
+	}
+	if (im->next)
+		im->next->prev = im;
+	else
+		term.imagestail = im;
+}
+
 static int
 set_default_color(sixel_image_t *image)
 {
@@ -237,6 +291,7 @@ sixel_parser_init(sixel_state_t *st,
 	st->nparams = 0;
 	st->param = 0;
 	st->use_private_palette = use_private_palette;
+	st->payload_len = st->payload_bands = 0;
 
 	/* buffer initialization */
 	status = sixel_image_init(&st->image, 1, 1, transparent ? 0 : bgcolor,
@@ -270,7 +325,7 @@ sixel_parser_finalize(sixel_state_t *st, ImageList **newimages, int cx, int cy,
 	char trans;
 	ImageList *im, *next, *tail;
 
-	if (!image->data)
+	if (!image->data || sixel_parser_decode(st, st->payload_len) < 0)
 		return -1;
 
 	if (++st->max_x < st->attributed_ph)
@@ -314,6 +369,8 @@ sixel_parser_finalize(sixel_state_t *st, ImageList **newimages, int cx, int cy,
 			im->clipmask = NULL;
 			im->cw = cw;
 			im->ch = ch;
+			im->kitty = 0;
+			im->id = im->placementid = 0;
 		}
 		if (!im || !im->pixels) {
 			for (im = *newimages; im; im = next) {
@@ -340,53 +397,102 @@ sixel_parser_finalize(sixel_state_t *st, ImageList **newimages, int cx, int cy,
 	return numimages;
 }
 
-/* convert sixel data into indexed pixel bytes and palette data */
+/* buffer the sixel data, so that the bands can be decoded in parallel. Once
+ * enough complete bands are buffered they are decoded, the rest of the data
+ * is decoded in sixel_parser_finalize(). */
 int
 sixel_parser_parse(sixel_state_t *st, const unsigned char *p, size_t len)
 {
-	int n = 0;
-	int i;
-	int x;
-	int y;
-	int bits;
-	int sx;
-	int sy;
-	int c;
-	int pos;
-	int width;
-	const unsigned char *p0 = p, *p2 = p + len;
-	sixel_image_t *image = &st->image;
-	sixel_color_no_t *data, color_index;
+	const unsigned char *esc;
+	unsigned char *payload;
+	size_t i, n, size;
 
-	if (!image->data)
+	if (!st->image.data)
 		st->state = PS_ERROR;
 
-	while (p < p2) {
-		switch (st->state) {
-		case PS_ESC:
-			goto end;
+	n = (esc = memchr(p, '\x1b', len)) ? (size_t)(esc - p) : len;
+
+	if (st->state != PS_ERROR && n > 0) {
+		if (st->payload_len + n > st->payload_size) {
+			if (st->payload_len + n > SIXEL_PAYLOAD_MAX) {
+				fprintf(stderr, "sixel_parser_parse() failed: "
+				        "more than %d bytes without DECGNL\n",
+				        SIXEL_PAYLOAD_MAX);
+				goto error;
+			}
+			size = MIN(MAX(MAX(st->payload_size * 2, st->payload_len + n), 4096),
+			           SIXEL_PAYLOAD_MAX);
+			if (!(payload = realloc(st->payload, size))) {
+				perror("sixel_parser_parse() failed");
+				goto error;
+			}
+			st->payload = payload;
+			st->payload_size = size;
+		}
+		memcpy(st->payload + st->payload_len, p, n);
+		for (i = n; i > 0 && p[i - 1] != '-'; i--)
+			;
+		if (i > 0)
+			st->payload_bands = st->payload_len + i;
+		st->payload_len += n;
+
+		if (st->payload_bands >= SIXEL_DECODE_MIN &&
+		    sixel_parser_decode(st, st->payload_bands) < 0)
+			goto error;
+	}
+	goto end;
+
+error:
+	sixel_image_deinit(&st->image);
+	st->state = PS_ERROR;
+
+end:
+	if (esc)
+		st->state = PS_ESC;
+	return n;
+}
+
+/* Split the buffered data into bands at DECGNL and run the part of the parser
+ * that depends on the previous bands: the palette definitions, the raster
+ * attributes, the color selection and the size of the image. */
+static int
+sixel_scan_bands(sixel_state_t *st, size_t len, sixel_band_t **bandsp)
+{
+	const unsigned char *p = st->payload, *p2 = st->payload + len;
+	sixel_image_t *image = &st->image;
+	sixel_band_t *bands, *band;
+	int nbands = 0, maxbands = 64;
+	int state = PS_DECSIXEL, width = 0, height = 0, sx, sy;
+
+	if (!(bands = malloc(maxbands * sizeof(sixel_band_t))))
+		return -1;
+
+	band = &bands[nbands++];
+	band->start = p;
+	band->pos_y = st->pos_y;
+	band->color_index = st->color_index;
+	band->repeat_count = st->repeat_count;
 
+	while (p < p2) {
+		switch (state) {
 		case PS_DECSIXEL:
 			switch (*p) {
-			case '\x1b':
-				st->state = PS_ESC;
-				break;
 			case '"':
 				st->param = 0;
 				st->nparams = 0;
-				st->state = PS_DECGRA;
+				state = PS_DECGRA;
 				p++;
 				break;
 			case '!':
 				st->param = 0;
 				st->nparams = 0;
-				st->state = PS_DECGRI;
+				state = PS_DECGRI;
 				p++;
 				break;
 			case '#':
 				st->param = 0;
 				st->nparams = 0;
-				st->state = PS_DECGCI;
+				state = PS_DECGCI;
 				p++;
 				break;
 			case '$':
@@ -401,81 +507,30 @@ sixel_parser_parse(sixel_state_t *st, const unsigned char *p, size_t len)
 					st->pos_y += 6;
 				else
 					st->pos_y = DECSIXEL_HEIGHT_MAX + 1;
-				p++;
+				band->end = p++;
+				if (nbands == maxbands) {
+					maxbands *= 2;
+					if (!(band = realloc(bands, maxbands * sizeof(sixel_band_t)))) {
+						free(bands);
+						return -1;
+					}
+					bands = band;
+				}
+				band = &bands[nbands++];
+				band->start = p;
+				band->pos_y = st->pos_y;
+				band->color_index = st->color_index;
+				band->repeat_count = st->repeat_count;
 				break;
 			default:
 				if (*p >= '?' && *p <= '~') {  /* sixel characters */
-					if ((image->width < (st->pos_x + st->repeat_count) || image->height < (st->pos_y + 6))
-					        && image->width < DECSIXEL_WIDTH_MAX && image->height < DECSIXEL_HEIGHT_MAX) {
-						sx = image->width * 2;
-						sy = image->height * 2;
-						while (sx < (st->pos_x + st->repeat_count) || sy < (st->pos_y + 6)) {
-							sx *= 2;
-							sy *= 2;
-						}
-
-						sx = MIN(sx, DECSIXEL_WIDTH_MAX);
-						sy = MIN(sy, DECSIXEL_HEIGHT_MAX);
-
-						if (image_buffer_resize(image, sx, sy) < 0) {
-							perror("sixel_parser_parse() failed");
-							st->state = PS_ERROR;
-							p++;
-							break;
-						}
+					if (st->pos_y + 6 <= DECSIXEL_HEIGHT_MAX) {
+						width = MAX(width, MIN(st->pos_x + st->repeat_count, DECSIXEL_WIDTH_MAX));
+						height = MAX(height, st->pos_y + 6);
 					}
-
 					if (st->color_index > image->ncolors)
 						image->ncolors = st->color_index;
-
-					if (st->pos_x + st->repeat_count > image->width)
-						st->repeat_count = image->width - st->pos_x;
-
-					if (st->repeat_count > 0 && st->pos_y + 5 < image->height) {
-						bits = *p - '?';
-						if (bits != 0) {
-							data = image->data + image->width * st->pos_y + st->pos_x;
-							width = image->width;
-							color_index = st->color_index;
-							if (st->repeat_count <= 1) {
-								if (bits & 0x01)
-									*data = color_index, n = 0;
-								data += width;
-								if (bits & 0x02)
-									*data = color_index, n = 1;
-								data += width;
-								if (bits & 0x04)
-									*data = color_index, n = 2;
-								data += width;
-								if (bits & 0x08)
-									*data = color_index, n = 3;
-								data += width;
-								if (bits & 0x10)
-									*data = color_index, n = 4;
-								if (bits & 0x20)
-									data[width] = color_index, n = 5;
-								if (st->max_x < st->pos_x)
-									st->max_x = st->pos_x;
-							} else {
-								/* st->repeat_count > 1 */
-								for (i = 0; bits; bits >>= 1, i++, data += width) {
-									if (bits & 1) {
-										data[0] = color_index;
-										data[1] = color_index;
-										for (x = 2; x < st->repeat_count; x++)
-											data[x] = color_index;
-										n = i;
-									}
-								}
-								if (st->max_x < (st->pos_x + st->repeat_count - 1))
-									st->max_x = st->pos_x + st->repeat_count - 1;
-							}
-							if (st->max_y < (st->pos_y + n))
-								st->max_y = st->pos_y + n;
-						}
-					}
-					if (st->repeat_count > 0)
-						st->pos_x += st->repeat_count;
+					st->pos_x = MIN(st->pos_x + st->repeat_count, DECSIXEL_WIDTH_MAX);
 					st->repeat_count = 1;
 				}
 				p++;
@@ -486,19 +541,8 @@ sixel_parser_parse(sixel_state_t *st, const unsigned char *p, size_t len)
 		case PS_DECGRA:
 			/* DECGRA Set Raster Attributes " Pan; Pad; Ph; Pv */
 			switch (*p) {
-			case '\x1b':
-				st->state = PS_ESC;
-				break;
-			case '0':
-			case '1':
-			case '2':
-			case '3':
-			case '4':
-			case '5':
-			case '6':
-			case '7':
-			case '8':
-			case '9':
+			case '0': case '1': case '2': case '3': case '4':
+			case '5': case '6': case '7': case '8': case '9':
 				st->param = st->param * 10 + *p - '0';
 				st->param = MIN(st->param, DECSIXEL_PARAMVALUE_MAX);
 				p++;
@@ -526,26 +570,12 @@ sixel_parser_parse(sixel_state_t *st, const unsigned char *p, size_t len)
 				if (st->attributed_pad <= 0)
 					st->attributed_pad = 1;
 
-				if (image->width < st->attributed_ph ||
-				        image->height < st->attributed_pv) {
-					sx = MAX(image->width, st->attributed_ph);
-					sy = MAX(image->height, st->attributed_pv);
-
-					/* the height of the image buffer must be divisible by 6
-					 * to avoid unnecessary resizing of the image buffer when
-					 * parsing the last sixel line */
-					sy = (sy + 5) / 6 * 6;
-
-					sx = MIN(sx, DECSIXEL_WIDTH_MAX);
-					sy = MIN(sy, DECSIXEL_HEIGHT_MAX);
+				/* the height of the image buffer must be divisible by 6
+				 * to avoid clipping the last sixel line */
+				width = MAX(width, MIN(st->attributed_ph, DECSIXEL_WIDTH_MAX));
+				height = MAX(height, MIN((st->attributed_pv + 5) / 6 * 6, DECSIXEL_HEIGHT_MAX));
 
-					if (image_buffer_resize(image, sx, sy) < 0) {
-						perror("sixel_parser_parse() failed");
-						st->state = PS_ERROR;
-						break;
-					}
-				}
-				st->state = PS_DECSIXEL;
+				state = PS_DECSIXEL;
 				st->param = 0;
 				st->nparams = 0;
 			}
@@ -554,26 +584,15 @@ sixel_parser_parse(sixel_state_t *st, const unsigned char *p, size_t len)
 		case PS_DECGRI:
 			/* DECGRI Graphics Repeat Introducer ! Pn Ch */
 			switch (*p) {
-			case '\x1b':
-				st->state = PS_ESC;
-				break;
-			case '0':
-			case '1':
-			case '2':
-			case '3':
-			case '4':
-			case '5':
-			case '6':
-			case '7':
-			case '8':
-			case '9':
+			case '0': case '1': case '2': case '3': case '4':
+			case '5': case '6': case '7': case '8': case '9':
 				st->param = st->param * 10 + *p - '0';
 				st->param = MIN(st->param, DECSIXEL_PARAMVALUE_MAX);
 				p++;
 				break;
 			default:
 				st->repeat_count = MAX(st->param, 1);
-				st->state = PS_DECSIXEL;
+				state = PS_DECSIXEL;
 				st->param = 0;
 				st->nparams = 0;
 				break;
@@ -583,19 +602,8 @@ sixel_parser_parse(sixel_state_t *st, const unsigned char *p, size_t len)
 		case PS_DECGCI:
 			/* DECGCI Graphics Color Introducer # Pc; Pu; Px; Py; Pz */
 			switch (*p) {
-			case '\x1b':
-				st->state = PS_ESC;
-				break;
-			case '0':
-			case '1':
-			case '2':
-			case '3':
-			case '4':
-			case '5':
-			case '6':
-			case '7':
-			case '8':
-			case '9':
+			case '0': case '1': case '2': case '3': case '4':
+			case '5': case '6': case '7': case '8': case '9':
 				st->param = st->param * 10 + *p - '0';
 				st->param = MIN(st->param, DECSIXEL_PARAMVALUE_MAX);
 				p++;
@@ -607,7 +615,7 @@ sixel_parser_parse(sixel_state_t *st, const unsigned char *p, size_t len)
 				p++;
 				break;
 			default:
-				st->state = PS_DECSIXEL;
+				state = PS_DECSIXEL;
 				if (st->nparams < DECSIXEL_PARAMS_MAX)
 					st->params[st->nparams++] = st->param;
 				st->param = 0;
@@ -641,28 +649,200 @@ sixel_parser_parse(sixel_state_t *st, const unsigned char *p, size_t len)
 				break;
 			}
 			break;
+		}
+	}
+	band->end = p2;
+
+	/* allocate the image buffer only once */
+	if (image->width < width || image->height < height) {
+		sx = MAX(image->width, width);
+		sy = MAX(image->height, height);
+		if (image_buffer_resize(image, sx, sy) < 0) {
+			free(bands);
+			return -1;
+		}
+	}
 
-		case PS_ERROR:
-			if (*p == '\x1b') {
-				st->state = PS_ESC;
-				goto end;
-			}
+	*bandsp = bands;
+	return nbands;
+}
+
+/* Draw the sixels of a band. The palette definitions and the raster
+ * attributes have already been handled by sixel_scan_bands(), so only the
+ * color selection needs to be parsed here. */
+static void
+sixel_decode_band(sixel_image_t *image, sixel_band_t *band)
+{
+	const unsigned char *p = band->start, *p2 = band->end;
+	int pos_x = 0, pos_y = band->pos_y;
+	int repeat_count = band->repeat_count, param;
+	int i, x, n = 0, bits, width = image->width;
+	sixel_color_no_t *data, color_index = band->color_index;
+
+	band->max_x = band->max_y = 0;
+
+	while (p < p2) {
+		switch (*p) {
+		case '"':
+			/* DECGRA Set Raster Attributes */
+			for (p++; p < p2 && ((*p >= '0' && *p <= '9') || *p == ';'); p++)
+				;
+			break;
+		case '!':
+			/* DECGRI Graphics Repeat Introducer */
+			for (param = 0, p++; p < p2 && *p >= '0' && *p <= '9'; p++)
+				param = MIN(param * 10 + *p - '0', DECSIXEL_PARAMVALUE_MAX);
+			repeat_count = MAX(param, 1);
+			break;
+		case '#':
+			/* DECGCI Graphics Color Introducer */
+			for (param = 0, p++; p < p2 && *p >= '0' && *p <= '9'; p++)
+				param = MIN(param * 10 + *p - '0', DECSIXEL_PARAMVALUE_MAX);
+			for (; p < p2 && ((*p >= '0' && *p <= '9') || *p == ';'); p++)
+				;
+			color_index = MIN(1 + param, DECSIXEL_PALETTE_MAX - 1);
+			break;
+		case '$':
+			/* DECGCR Graphics Carriage Return */
+			pos_x = 0;
 			p++;
 			break;
 		default:
+			if (*p >= '?' && *p <= '~') {  /* sixel characters */
+				if (pos_x + repeat_count > width)
+					repeat_count = width - pos_x;
+
+				if (repeat_count > 0 && pos_y + 5 < image->height) {
+					bits = *p - '?';
+					if (bits != 0) {
+						data = image->data + width * pos_y + pos_x;
+						if (repeat_count <= 1) {
+							if (bits & 0x01)
+								*data = color_index, n = 0;
+							data += width;
+							if (bits & 0x02)
+								*data = color_index, n = 1;
+							data += width;
+							if (bits & 0x04)
+								*data = color_index, n = 2;
+							data += width;
+							if (bits & 0x08)
+								*data = color_index, n = 3;
+							data += width;
+							if (bits & 0x10)
+								*data = color_index, n = 4;
+							if (bits & 0x20)
+								data[width] = color_index, n = 5;
+							if (band->max_x < pos_x)
+								band->max_x = pos_x;
+						} else {
+							/* repeat_count > 1 */
+							for (i = 0; bits; bits >>= 1, i++, data += width) {
+								if (bits & 1) {
+									data[0] = color_index;
+									data[1] = color_index;
+									for (x = 2; x < repeat_count; x++)
+										data[x] = color_index;
+									n = i;
+								}
+							}
+							if (band->max_x < (pos_x + repeat_count - 1))
+								band->max_x = pos_x + repeat_count - 1;
+						}
+						if (band->max_y < (pos_y + n))
+							band->max_y = pos_y + n;
+					}
+				}
+				if (repeat_count > 0)
+					pos_x += repeat_count;
+				repeat_count = 1;
+			}
+			p++;
 			break;
 		}
 	}
+}
 
-end:
-	return p - p0;
+static void *
+sixel_decode_worker(void *arg)
+{
+	sixel_worker_t *w = arg;
+	int i;
+
+	for (i = w->first; i < w->last; i++)
+		sixel_decode_band(w->image, &w->bands[i]);
+	return NULL;
+}
+
+/* convert the first len bytes of the buffered sixel data into indexed pixel
+ * bytes and palette data and remove them from the buffer. The data has to
+ * end with a complete band or the sequence. The threads only shorten the
+ * decoding, the main thread waits for them, so input and drawing are still
+ * held up until the bands are done. */
+static int
+sixel_parser_decode(sixel_state_t *st, size_t len)
+{
+	sixel_band_t *bands;
+	sixel_worker_t workers[SIXEL_THREADS_MAX];
+	size_t total, sum;
+	long ncpus;
+	int i, j, nbands, nthreads = 1;
+
+	if ((nbands = sixel_scan_bands(st, len, &bands)) < 0) {
+		perror("sixel_parser_decode() failed");
+		return -1;
+	}
+
+	/* decode the bands of large images in parallel. The bands are split
+	 * into contiguous groups that have about the same amount of data. */
+	if (len >= SIXEL_PARALLEL_MIN && nbands > 1 &&
+	    (ncpus = sysconf(_SC_NPROCESSORS_ONLN)) > 1)
+		nthreads = MIN(MIN(ncpus, SIXEL_THREADS_MAX), nbands);
+
+	total = len;
+	for (i = 0, j = 0, sum = 0; i < nthreads; i++) {
+		workers[i].image = &st->image;
+		workers[i].bands = bands;
+		workers[i].first = j;
+		for (; j < nbands && (i == nthreads - 1 || sum < total / nthreads * (i + 1)); j++)
+			sum += bands[j].end - bands[j].start;
+		workers[i].last = j;
+		workers[i].started = i > 0 && workers[i].first < workers[i].last &&
+		    pthread_create(&workers[i].thread, NULL, sixel_decode_worker, &workers[i]) == 0;
+	}
+
+	/* the main thread decodes the first group and the groups that could
+	 * not be given to a thread */
+	for (i = 0; i < nthreads; i++) {
+		if (!workers[i].started)
+			sixel_decode_worker(&workers[i]);
+	}
+	for (i = 0; i < nthreads; i++) {
+		if (workers[i].started)
+			pthread_join(workers[i].thread, NULL);
+	}
+
+	for (i = 0; i < nbands; i++) {
+		st->max_x = MAX(st->max_x, bands[i].max_x);
+		st->max_y = MAX(st->max_y, bands[i].max_y);
+	}
+	free(bands);
+
+	memmove(st->payload, st->payload + len, st->payload_len - len);
+	st->payload_len -= len;
+	st->payload_bands = 0;
+	return 0;
 }
 
 void
 sixel_parser_deinit(sixel_state_t *st)
 {
-	if (st)
+	if (st) {
 		sixel_image_deinit(&st->image);
+		free(st->payload);
+		st->payload = NULL;
+		st->payload_len = st->payload_size = 0;
+	}
 }
 
 Pixmap
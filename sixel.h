@@ -6,6 +6,10 @@
 #define DECSIXEL_PARAMVALUE_MAX 65535
 #define DECSIXEL_WIDTH_MAX 4096
 #define DECSIXEL_HEIGHT_MAX 4096
+#define SIXEL_PAYLOAD_MAX   (32 * 1024 * 1024) /* data of the bands not decoded yet */
+#define SIXEL_PARALLEL_MIN  (256 * 1024) /* data size to decode in parallel */
+#define SIXEL_DECODE_MIN    (16 * SIXEL_PARALLEL_MIN) /* complete bands decoded early */
+#define SIXEL_THREADS_MAX   8
 
 typedef unsigned short sixel_color_no_t;
 typedef unsigned int sixel_color_t;
@@ -52,10 +56,15 @@ typedef struct parser_context {
 	sixel_color_t shared_palette[DECSIXEL_PALETTE_MAX];
 	sixel_color_t private_palette[DECSIXEL_PALETTE_MAX];
 	sixel_image_t image;
+	unsigned char *payload;  /* buffered sixel data */
+	size_t payload_len;
+	size_t payload_size;
+	size_t payload_bands;    /* the data up to here ends with a DECGNL */
 } sixel_state_t;
 
 void scroll_images(int n);
 void delete_image(ImageList *im);
+void insert_image(ImageList *im);
 int sixel_parser_init(sixel_state_t *st, int transparent, sixel_color_t bgcolor, unsigned char use_private_palette, int cell_width, int cell_height);
 int sixel_parser_parse(sixel_state_t *st, const unsigned char *p, size_t len);
 int sixel_parser_set_default_color(sixel_state_t *st, int private_palette);
@@ -3,6 +3,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -23,6 +24,7 @@
 #include "st.h"
 #include "win.h"
 #include "sixel.h"
+#include "width.h"
 
 #if   defined(__linux)
  #include <pty.h>
@@ -38,10 +40,13 @@
 #define ESC_BUF_SIZ   (128*UTF_SIZ)
 #define ESC_ARG_SIZ   16
 #define SUB_ARG_SIZ   5
+#define CSI_CACHE_LEN 16
+#define CSI_CACHE_SIZ 256
 #define STR_BUF_SIZ   ESC_BUF_SIZ
 #define STR_ARG_SIZ   ESC_ARG_SIZ
 #define STR_TERM_ST   "\033\\"
 #define STR_TERM_BEL  "\007"
+#define PRINT_DRAIN_SEC 1 /* time the output file gets to drain on exit */
 
 /* macros */
 #define IS_SET(flag)    ((term.mode & (flag)) != 0)
@@ -125,18 +130,63 @@ typedef struct {
 	int value[SUB_ARG_SIZ];
 } Subarg;
 
+enum csi_state {
+	CSI_PARAM,      /* private marker and arguments */
+	CSI_INTER,      /* intermediate byte */
+	CSI_DONE,       /* final byte */
+	CSI_IGNORE      /* malformed, ignored up to the final byte */
+};
+
+enum csi_table {
+	CSI_NOPRIV      = 0,
+	CSI_PRIVDEC     = 1,    /* '?' */
+	CSI_NPRIV,
+	CSI_NOINTER     = 0,
+	CSI_INTERSPACE  = 1,    /* ' ' */
+	CSI_INTERDOLLAR = 2,    /* '$' */
+	CSI_NINTER
+};
+
 /* CSI Escape sequence structs */
-/* ESC '[' [[ [<priv>] <arg> [;]] <mode> [<mode>]] */
+/* ESC '[' [<priv>] [<arg>[:<subarg>]...] [;<arg>...] [<inter>] <final> */
 typedef struct {
-	char buf[ESC_BUF_SIZ];      /* raw string */
-	size_t len;                 /* raw string length */
 	int arg[ESC_ARG_SIZ];
 	int narg;                   /* nb of args */
 	Subarg subarg[ESC_ARG_SIZ]; /* colon-separated subarguments */
-	char mode[2];
-	char priv;
+	int sub;                    /* subargument being read, -1 for the argument */
+	char priv;                  /* private marker */
+	char inter;                 /* intermediate byte */
+	char final;
+	int state;
+	char raw[CSI_CACHE_LEN];    /* bytes of a short sequence, not parsed yet */
+	int rawlen;                 /* -1 once the sequence is parsed as it arrives */
+	uint hash;
 } CSIEscape;
 
+/* changes that SGR arguments make to the cursor attributes */
+typedef struct {
+	Mode modemask, mode;
+	uint32_t extramask, extra;
+	int32_t fg, bg;             /* -1 keeps the color */
+} AttrDelta;
+
+enum csiop_type {
+	CSIOP_NONE,
+	CSIOP_CALL,                 /* handler that uses the first two args */
+	CSIOP_SGR
+};
+
+/* decoded short CSI sequence, looked up by its bytes */
+typedef struct {
+	char raw[CSI_CACHE_LEN];
+	int len;
+	int type;
+	void (*handler)(void);
+	int arg[2];
+	int narg;
+	AttrDelta attr;
+} CSIOp;
+
 /* STR Escape sequence structs */
 /* ESC type [[ [<priv>] <arg> [;]] <mode>] ESC '\' */
 typedef struct {
@@ -154,13 +204,53 @@ static void stty(char **);
 static void sigchld(int);
 static void ttywriteraw(const char *, size_t);
 
+static void csicachestats(void);
 static void csidump(void);
 static void csihandle(void);
+static int csiput(Rune);
+static int csifeed(Rune);
+static int csicacheable(void (*)(void));
+static void csirunop(const CSIOp *);
+static void csiunknown(void);
+static void csiich(void);
+static void csicuu(void);
+static void csicud(void);
+static void csimc(void);
+static void csida(void);
+static void csirep(void);
+static void csicuf(void);
+static void csicub(void);
+static void csicnl(void);
+static void csicpl(void);
+static void csitbc(void);
+static void csicha(void);
+static void csicup(void);
+static void csicht(void);
+static void csied(void);
+static void csiel(void);
+static void csixtsmgraphics(void);
+static void csisu(void);
+static void csisd(void);
+static void csiil(void);
+static void csirm(void);
+static void csidl(void);
+static void csiech(void);
+static void csidch(void);
+static void csicbt(void);
+static void csivpa(void);
+static void csism(void);
+static void csisgr(void);
+static void csidsr(void);
+static void csidecrqm(void);
+static void csidecstbm(void);
+static void csisc(void);
+static void csixtwinops(void);
+static void csirc(void);
+static void csidecscusr(void);
 static void dcshandle(void);
 static void initsixel(void);
 static void createsixel(void);
-static inline void readsubargs(char **, int);
-static void csiparse(void);
+static void tputimages(ImageList *, int, int);
 static inline void csireset(void);
 static void osc_color_response(int, int, int);
 static int eschandle(uchar);
@@ -169,13 +259,27 @@ static void strhandle(void);
 static void strparse(void);
 static void strreset(void);
 
+static void printerstats(void);
 static void tprinter(char *, size_t);
+static int tprinteropen(void);
+static int tprinterstart(void);
+static void tprinterstop(void);
+static void *tprinterthread(void *);
 static void tdumpsel(void);
 static void tdumpline(int);
 static void tdump(void);
 static void tclearregion(int, int, int, int, int);
 static void tcursor(int);
 static inline void tclearglyph(Glyph *, int);
+static void tclearglyphs(Glyph *, int, int);
+static Line tallocline(int);
+static Line treallocline(Line, int);
+static void tfreeline(Line);
+static inline void tlinetouch(Line, int);
+static inline void tlineput(Line, int, int);
+static int tlineprompt(Line, int);
+static void tlineshift(Line);
+static void tclearline(Line, int, int);
 static void tresetcursor(void);
 static void tdeletechar(int);
 static void tdeleteimages(void);
@@ -195,9 +299,15 @@ static void treset(void);
 static void tscrollup(int, int, int, int);
 static void tscrolldown(int, int);
 static void treflow(int, int);
+static void treflow_copy(Line, int, Line, int, int);
 static void rscrolldown(int);
 static void tresizedef(int, int);
 static void tresizealt(int, int);
+static void tattrmode(AttrDelta *, Mode, Mode);
+static void tattrextra(AttrDelta *, uint32_t, uint32_t);
+static int tattrfast(AttrDelta *, const int *, int, int);
+static int tattrdelta(AttrDelta *, const int *, int);
+static void tapplyattr(const AttrDelta *);
 static void tsetattr(const int *, int);
 static void tsetchar(Rune, const Glyph *, int, int);
 static void tsetdirt(int, int);
@@ -219,11 +329,13 @@ static void selscroll(int, int, int);
 static void selmove(int);
 static void selremove(void);
 static inline int regionselected(int, int, int, int);
+static int rowselection(const Selection *, int, int *, int *);
 static void selsnap(int *, int *, int);
 
 static inline char utf8encodebyte(Rune, size_t);
 static inline size_t utf8validate(Rune *, size_t);
 
+static size_t base64decode(char *, const char *);
 static char *base64dec(const char *);
 static char base64dec_getc(const char **);
 
@@ -232,10 +344,36 @@ static ssize_t xwrite(int, const char *, size_t);
 /* Globals */
 static Selection sel;
 static CSIEscape csiescseq;
+static CSIOp csicache[CSI_CACHE_SIZ];
+static struct {
+	Glyph *row;
+	int len;
+	uint32_t fg, bg;
+} blankrow[2]; /* blank cells with the default and the cursor colors */
+static struct {
+	uint hits, misses, uncached;
+} csicachestat;
+/* The printer and dump output is queued and written to iofd by a thread, so
+ * a slow output file never blocks the parser. What does not fit into the
+ * queue is dropped. */
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char *buf;          /* circular, len bytes from head are pending */
+	size_t size, head, len;
+	int running;
+	int quit;
+	int done;           /* the thread has written everything it could */
+	int warned;         /* the first dropped output has been reported */
+	unsigned long long written, dropped;
+} printq = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
 static STREscape strescseq;
 static int iofd = 1;
 static int cmdfd;
 static pid_t pid;
+static volatile sig_atomic_t childexited, childstat;
+static int childpipe[2] = { -1, -1 }; /* wakes up the main loop on SIGCHLD */
 sixel_state_t sixel_st;
 
 static const uchar utfbyte[UTF_SIZ + 1] = {0x80,    0, 0xC0, 0xE0, 0xF0};
@@ -398,11 +536,10 @@ base64dec_getc(const char **src)
 	return **src ? *((*src)++) : '=';  /* emulate padding if string ends */
 }
 
-char *
-base64dec(const char *src)
+size_t
+base64decode(char *dst, const char *src)
 {
-	size_t in_len = strlen(src);
-	char *result, *dst;
+	char *start = dst;
 	static const char base64_digits[256] = {
 		[43] = 62, 0, 0, 0, 63, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61,
 		0, 0, 0, -1, 0, 0, 0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12,
@@ -411,9 +548,6 @@ base64dec(const char *src)
 		40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51
 	};
 
-	if (in_len % 4)
-		in_len += 4 - (in_len % 4);
-	result = dst = xmalloc(in_len / 4 * 3 + 1);
 	while (*src) {
 		int a = base64_digits[(unsigned char) base64dec_getc(&src)];
 		int b = base64_digits[(unsigned char) base64dec_getc(&src)];
@@ -432,7 +566,19 @@ base64dec(const char *src)
 			break;
 		*dst++ = ((c & 0x03) << 6) | d;
 	}
-	*dst = '\0';
+	return dst - start;
+}
+
+char *
+base64dec(const char *src)
+{
+	size_t in_len = strlen(src);
+	char *result;
+
+	if (in_len % 4)
+		in_len += 4 - (in_len % 4);
+	result = xmalloc(in_len / 4 * 3 + 1);
+	result[base64decode(result, src)] = '\0';
 	return result;
 }
 
@@ -447,19 +593,24 @@ selinit(void)
 int
 tlinelen(Line line)
 {
-	int i = term.col - 1;
+	LineHeader *h = LINEHDR(line);
+	int alt = IS_SET(MODE_ALTSCREEN);
+	int i = MIN(h->len, term.col) - 1;
+
+	if (h->used[alt] >= 0)
+		return MIN(h->used[alt], term.col);
 
 	/* We are using a different algorithm on the alt screen because an
 	 * application might use spaces to clear the screen and in that case it is
 	 * impossible to find the end of the line when every cell has the ATTR_SET
 	 * attribute. The second algorithm is more accurate on the main screen and
 	 * and we can use it there. */
-	if (IS_SET(MODE_ALTSCREEN))
+	if (alt)
 		for (; i >= 0 && !(line[i].mode & ATTR_WRAP) && line[i].u == ' '; i--);
 	else
 		for (; i >= 0 && !(line[i].mode & (ATTR_SET | ATTR_WRAP)); i--);
 
-	return i + 1;
+	return h->used[alt] = i + 1;
 }
 
 int
@@ -473,15 +624,31 @@ tiswrapped(Line line)
 char *
 tgetglyphs(char *buf, const Glyph *gp, const Glyph *lgp)
 {
-	while (gp <= lgp)
-		if (gp->mode & ATTR_WDUMMY) {
-			gp++;
-		} else {
-			buf += utf8encode((gp++)->u, buf);
-		}
+	const Rune *runes;
+	int n;
+
+	for (; gp <= lgp; gp++) {
+		if (gp->mode & ATTR_WDUMMY)
+			continue;
+		for (n = glyphrunes(&gp->u, &runes); n > 0; n--)
+			buf += utf8encode(*runes++, buf);
+	}
 	return buf;
 }
 
+/* returns the width and classes of a rune from the generated tables */
+static inline int
+runeinfo(Rune u)
+{
+	return (u < 0x110000) ? runeblocks[runeindex[u / RUNEBLOCK]][u % RUNEBLOCK] : 1;
+}
+
+int
+runewidth(Rune u)
+{
+	return runeinfo(u) & RUNE_WIDTH;
+}
+
 size_t
 tgetline(char *buf, const Glyph *fgp)
 {
@@ -516,7 +683,8 @@ selstart(int col, int row, int snap)
 void
 selextend(int col, int row, int type, int done)
 {
-	int oldey, oldex, oldsby, oldsey, oldtype;
+	Selection old = sel;
+	int y, o, n, ox1, ox2, nx1, nx2;
 
 	if (sel.mode == SEL_IDLE)
 		return;
@@ -525,22 +693,20 @@ selextend(int col, int row, int type, int done)
 		return;
 	}
 
-	oldey = sel.oe.y;
-	oldex = sel.oe.x;
-	oldsby = sel.nb.y;
-	oldsey = sel.ne.y;
-	oldtype = sel.type;
-
 	sel.oe.x = col;
 	sel.oe.y = row;
 	sel.type = type;
 	selnormalize();
-
-	if (oldey != sel.oe.y || oldex != sel.oe.x ||
-	    oldtype != sel.type || sel.mode == SEL_EMPTY)
-		tsetdirt(MIN(sel.nb.y, oldsby), MAX(sel.ne.y, oldsey));
-
 	sel.mode = done ? SEL_IDLE : SEL_READY;
+
+	/* only redraw the rows whose selected columns changed */
+	for (y = MAX(MIN(sel.nb.y, old.nb.y), 0);
+	     y <= MIN(MAX(sel.ne.y, old.ne.y), term.row-1); y++) {
+		o = rowselection(&old, y, &ox1, &ox2);
+		n = rowselection(&sel, y, &nx1, &nx2);
+		if (o != n || (n && (ox1 != nx1 || ox2 != nx2)))
+			term.dirty[y] = 1;
+	}
 }
 
 void
@@ -590,6 +756,30 @@ selected(int x, int y)
 	return regionselected(x, y, x, y);
 }
 
+/* returns whether a row of the screen is selected and its selected columns */
+static int
+rowselection(const Selection *s, int y, int *x1, int *x2)
+{
+	if (s->ob.x == -1 || s->mode == SEL_EMPTY ||
+	    s->alt != IS_SET(MODE_ALTSCREEN) || y < s->nb.y || y > s->ne.y)
+		return 0;
+
+	if (s->type == SEL_RECTANGULAR) {
+		*x1 = s->nb.x;
+		*x2 = s->ne.x;
+	} else {
+		*x1 = (y == s->nb.y) ? s->nb.x : 0;
+		*x2 = (y == s->ne.y) ? s->ne.x : term.col-1;
+	}
+	return *x1 <= *x2;
+}
+
+int
+selrow(int y, int *x1, int *x2)
+{
+	return rowselection(&sel, y, x1, x2);
+}
+
 void
 selsnap(int *x, int *y, int direction)
 {
@@ -662,25 +852,24 @@ selsnap(int *x, int *y, int direction)
 	}
 }
 
-char *
-getsel(void)
+/* writes the selected text to buf, or only measures it if buf is NULL */
+static size_t
+selcopy(char *buf)
 {
-	char *str, *ptr;
-	int y, lastx, linelen;
+	char tmp[UTF_SIZ];
+	const Rune *runes;
+	size_t n = 0;
+	int k, y, lastx, linelen;
 	const Glyph *gp, *lgp;
 
-	if (sel.ob.x == -1 || sel.alt != IS_SET(MODE_ALTSCREEN))
-		return NULL;
-
-	str = xmalloc((term.col + 1) * (sel.ne.y - sel.nb.y + 1) * UTF_SIZ);
-	ptr = str;
-
 	/* append every set & selected glyph to the selection */
 	for (y = sel.nb.y; y <= sel.ne.y; y++) {
 		Line line = TLINE(y);
 
 		if ((linelen = tlinelen(line)) == 0) {
-			*ptr++ = '\n';
+			if (buf)
+				buf[n] = '\n';
+			n++;
 			continue;
 		}
 
@@ -693,7 +882,16 @@ getsel(void)
 		}
 		lgp = &line[MIN(lastx, linelen-1)];
 
-		ptr = tgetglyphs(ptr, gp, lgp);
+		if (buf) {
+			n = tgetglyphs(buf + n, gp, lgp) - buf;
+		} else {
+			for (; gp <= lgp; gp++) {
+				if (gp->mode & ATTR_WDUMMY)
+					continue;
+				for (k = glyphrunes(&gp->u, &runes); k > 0; k--, runes++)
+					n += (*runes < 0x80) ? 1 : utf8encode(*runes, tmp);
+			}
+		}
 		/*
 		 * Copy and pasting of line endings is inconsistent
 		 * in the inconsistent terminal and GUI world.
@@ -704,10 +902,36 @@ getsel(void)
 		 * FIXME: Fix the computer world.
 		 */
 		if ((y < sel.ne.y || lastx >= linelen) &&
-		    (!(lgp->mode & ATTR_WRAP) || sel.type == SEL_RECTANGULAR))
-			*ptr++ = '\n';
+		    (!(lgp->mode & ATTR_WRAP) || sel.type == SEL_RECTANGULAR)) {
+			if (buf)
+				buf[n] = '\n';
+			n++;
+		}
 	}
-	*ptr = '\0';
+	return n;
+}
+
+int
+hassel(void)
+{
+	return sel.ob.x != -1 && sel.alt == IS_SET(MODE_ALTSCREEN);
+}
+
+char *
+getsel(void)
+{
+	char *str;
+	size_t len;
+
+	if (!hassel())
+		return NULL;
+
+	/* the selection can span the whole scrollback, so it is measured
+	 * first instead of allocating room for every selected cell */
+	len = selcopy(NULL);
+	str = xmalloc(len + 1);
+	selcopy(str);
+	str[len] = '\0';
 	return str;
 }
 
@@ -723,6 +947,7 @@ selclear(void)
 void
 selremove(void)
 {
+	xkeepsel();
 	sel.mode = SEL_IDLE;
 	sel.ob.x = -1;
 }
@@ -791,21 +1016,44 @@ execsh(char *cmd, char **args)
 	_exit(1);
 }
 
+/* only records the exit of the shell, st exits from the main loop so that
+ * the exit handlers do not run inside the signal handler */
 void
 sigchld(int a)
 {
-	int stat;
+	int stat, err = errno;
 	pid_t p;
 
 	while ((p = waitpid(-1, &stat, WNOHANG)) > 0) {
 		if (p == pid) {
-			if (WIFEXITED(stat) && WEXITSTATUS(stat))
-				die("child exited with status %d\n", WEXITSTATUS(stat));
-			else if (WIFSIGNALED(stat))
-				die("child terminated due to signal %d\n", WTERMSIG(stat));
-			_exit(0);
+			childstat = stat;
+			childexited = 1;
+			if (write(childpipe[1], "", 1) < 0)
+				; /* the pipe is full, the loop is woken up anyway */
 		}
 	}
+	errno = err;
+}
+
+/* readable once the shell has exited, -1 without a shell */
+int
+ttychildfd(void)
+{
+	return childpipe[0];
+}
+
+void
+ttycheckexit(void)
+{
+	int stat = childstat;
+
+	if (!childexited)
+		return;
+	if (WIFEXITED(stat) && WEXITSTATUS(stat))
+		die("child exited with status %d\n", WEXITSTATUS(stat));
+	else if (WIFSIGNALED(stat))
+		die("child terminated due to signal %d\n", WTERMSIG(stat));
+	exit(0);
 }
 
 void
@@ -890,6 +1138,12 @@ ttynew(const char *line, char *cmd, const char *out, char **args)
 		fcntl(m, F_SETFD, FD_CLOEXEC);
 		close(s);
 		cmdfd = m;
+		if (pipe(childpipe) < 0)
+			die("pipe failed: %s\n", strerror(errno));
+		for (s = 0; s < 2; s++) {
+			fcntl(childpipe[s], F_SETFD, FD_CLOEXEC);
+			fcntl(childpipe[s], F_SETFL, O_NONBLOCK);
+		}
 		memset(&sa, 0, sizeof(sa));
 		sigemptyset(&sa.sa_mask);
 		sa.sa_flags = SA_RESTART;
@@ -916,6 +1170,9 @@ ttyread(void)
 	/* append read bytes to unprocessed bytes */
 	ret = twrite_aborted ? 1 : read(cmdfd, buf+buflen, LEN(buf)-buflen);
 
+	/* the hangup of the pty can be seen before the exit of the shell */
+	if (ret <= 0)
+		ttycheckexit();
 	switch (ret) {
 	case 0:
 		exit(0);
@@ -1047,6 +1304,8 @@ tattrset(int attr)
 
 	for (i = 0; i < term.row; i++) {
 		line = TLINE(i);
+		if (attr == ATTR_BLINK && !(LINEHDR(line)->flags & LINE_BLINK))
+			continue;
 		for (j = 0; j < term.col; j++) {
 			if (line[j].mode & attr)
 				return 1;
@@ -1082,6 +1341,8 @@ tsetdirtattr(int attr)
 
 	for (i = 0; i < term.row; i++) {
 		line = TLINE(i);
+		if (attr == ATTR_BLINK && !(LINEHDR(line)->flags & LINE_BLINK))
+			continue;
 		for (j = 0; j < term.col; j++) {
 			if (line[j].mode & attr) {
 				term.dirty[i] = 1;
@@ -1094,6 +1355,10 @@ tsetdirtattr(int attr)
 void
 tsetsixelattr(Line line, int x1, int x2)
 {
+	if (x1 <= x2) {
+		tlinetouch(line, x2);
+		LINEHDR(line)->flags |= LINE_SIXEL;
+	}
 	for (; x1 <= x2; x1++)
 		line[x1].extra |= EXT_SIXEL;
 }
@@ -1130,7 +1395,7 @@ void
 treset(void)
 {
 	uint i;
-	int x, y;
+	int y;
 
 	tresetcursor();
 
@@ -1149,12 +1414,13 @@ treset(void)
 	for (i = 0; i < 2; i++) {
 		tcursor(CURSOR_SAVE); /* reset saved cursor */
 		for (y = 0; y < term.row; y++)
-			for (x = 0; x < term.col; x++)
-				tclearglyph(&term.line[y][x], 0);
+			tclearline(term.line[y], term.col, 0);
 		tdeleteimages();
 		deletehyperlinks(0);
 		tswapscreen();
 	}
+	freeprompts();
+	kgpreset();
 	tfulldirt();
 
 	MODBIT(term.mode, 1, MODE_SIXEL_PRIVATE_PALETTE);
@@ -1169,7 +1435,7 @@ tnew(int col, int row)
 	for (i = 0; i < 2; i++) {
 		term.line = xmalloc(row * sizeof(Line));
 		for (j = 0; j < row; j++)
-			term.line[j] = xmalloc(col * sizeof(Glyph));
+			term.line[j] = tallocline(col);
 		term.col = col, term.row = row;
 		tswapscreen();
 	}
@@ -1177,7 +1443,7 @@ tnew(int col, int row)
 	term.dirtyimg = xmalloc(row * sizeof(*term.dirtyimg));
 	term.tabs = xmalloc(col * sizeof(*term.tabs));
 	for (i = 0; i < HISTSIZE; i++)
-		term.hist[i] = xmalloc(col * sizeof(Glyph));
+		term.hist[i] = tallocline(col);
 	treset();
 }
 
@@ -1188,17 +1454,25 @@ tswapscreen(void)
 	static int altcol, altrow;
 	Line *tmpline = term.line;
 	int tmpcol = term.col, tmprow = term.row;
-	ImageList *im = term.images;
+	ImageList *im = term.images, *imtail = term.imagestail;
+	int imoff = term.imgoff;
 	Hyperlinks *tmplinks = term.hyperlinks;
 
+	/* the selection can only be read from its own screen */
+	xkeepsel();
 	term.line = altline;
 	term.col = altcol, term.row = altrow;
+	term.textgen++;
 	altline = tmpline;
 	altcol = tmpcol, altrow = tmprow;
 	term.mode ^= MODE_ALTSCREEN;
 
 	term.images = term.images_alt;
 	term.images_alt = im;
+	term.imagestail = term.imagestail_alt;
+	term.imagestail_alt = imtail;
+	term.imgoff = term.imgoff_alt;
+	term.imgoff_alt = imoff;
 
 	term.hyperlinks = term.hyperlinks_alt;
 	term.hyperlinks_alt = tmplinks;
@@ -1255,14 +1529,16 @@ tscrolldown(int top, int n)
 
 	int i, bot = term.bot;
 	int scr = IS_SET(MODE_ALTSCREEN) ? 0 : term.scr;
-	int itop = top + scr, ibot = bot + scr;
 	Line temp;
-	ImageList *im, *next;
+	ImageList *im, *prev;
 
 	if (n <= 0)
 		return;
 	n = MIN(n, bot-top+1);
 
+	if (regionselected(0, top + scr, term.col-1, bot + scr))
+		xkeepsel();
+	term.textgen++;
 	tsetdirt(top + scr, bot + scr);
 	tclearregion(0, bot-n+1, term.col-1, bot, 1);
 
@@ -1272,12 +1548,15 @@ tscrolldown(int top, int n)
 		term.line[i-n] = temp;
 	}
 
+	if (!IS_SET(MODE_ALTSCREEN))
+		moveprompts(top, bot, n);
+
 	/* move images, if they are inside the scrolling region */
-	for (im = term.images; im; im = next) {
-		next = im->next;
-		if (im->y >= itop && im->y <= ibot) {
+	for (im = term.imagestail; im && IMGROW(im) >= top; im = prev) {
+		prev = im->prev;
+		if (IMGROW(im) <= bot) {
 			im->y += n;
-			if (im->y > ibot)
+			if (IMGROW(im) > bot)
 				delete_image(im);
 		}
 	}
@@ -1295,20 +1574,25 @@ tscrollup(int top, int bot, int n, int mode)
 	int alt = IS_SET(MODE_ALTSCREEN);
 	int savehist = !alt && top == 0 && mode != SCROLL_NOSAVEHIST;
 	int scr = alt ? 0 : term.scr;
-	int itop = top + scr, ibot = bot + scr;
 	Line temp;
-	ImageList *im, *next;
+	ImageList *im, *prev;
 
 	if (n <= 0)
 		return;
 	n = MIN(n, bot-top+1);
 
+	/* keep the text of an owned selection that is about to be scrolled
+	 * out of the region or the scrollback */
+	if (savehist ? (sel.ob.x != -1 && !sel.alt &&
+	                sel.nb.y - term.scr - n < -MIN(term.histf + n, HISTSIZE))
+	             : regionselected(0, top + scr, term.col-1, bot + scr))
+		xkeepsel();
+	term.textgen++;
 	if (savehist) {
 		for (i = 0; i < n; i++) {
 			term.histi = (term.histi + 1) % HISTSIZE;
 			temp = term.hist[term.histi];
-			for (j = 0; j < term.col; j++)
-				tclearglyph(&temp[j], 1);
+			tclearline(temp, term.col, 1);
 			term.hist[term.histi] = term.line[i];
 			term.line[i] = temp;
 		}
@@ -1332,33 +1616,31 @@ tscrollup(int top, int bot, int n, int mode)
 		term.line[i+n] = temp;
 	}
 
+	if (savehist) {
+		/* the rows below the region do not move */
+		scrollprompts(-n);
+		if (bot < term.row - 1)
+			moveprompts(bot - n + 1, term.row - 1, n);
+	} else if (!alt) {
+		moveprompts(top, bot, -n);
+	}
+
 	if (alt || !savehist) {
 		/* move images, if they are inside the scrolling region */
-		for (im = term.images; im; im = next) {
-			next = im->next;
-			if (im->y >= itop && im->y <= ibot) {
+		for (im = term.imagestail; im && IMGROW(im) >= top; im = prev) {
+			prev = im->prev;
+			if (IMGROW(im) <= bot) {
 				im->y -= n;
-				if (im->y < itop)
+				if (IMGROW(im) < top)
 					delete_image(im);
 			}
 		}
 	} else {
-		/* move images, if they are inside the scrolling region or scrollback */
-		for (im = term.images; im; im = next) {
-			next = im->next;
-			im->y -= scr;
-			if (im->y < 0) {
-				im->y -= n;
-			} else if (im->y >= top && im->y <= bot) {
-				im->y -= n;
-				if (im->y < top)
-					im->y -= top; // move to scrollback
-			}
-			if (im->y < -HISTSIZE)
-				delete_image(im);
-			else
-				im->y += term.scr;
-		}
+		/* move images inside the scrolling region and scrollback by
+		 * shifting the offset, then move back the ones below it */
+		scroll_images(-n);
+		for (im = term.imagestail; im && IMGROW(im) > bot - n; im = im->prev)
+			im->y += n;
 	}
 
 	if (sel.ob.x != -1 && sel.alt == alt) {
@@ -1407,59 +1689,6 @@ tnewline(int first_col)
 	tmoveto(first_col ? 0 : term.c.x, y);
 }
 
-void
-readsubargs(char **p, int argidx)
-{
-	int i;
-	long int v;
-	char *np;
-
-	for (i = 0; **p == ':'; *p = np) {
-		++*p;
-		np = NULL;
-		v = strtol(*p, &np, 10);
-		if (np == *p)
-			v = 0;
-		if (v == LONG_MAX || v == LONG_MIN)
-			v = -1;
-		if (i < SUB_ARG_SIZ)
-			csiescseq.subarg[argidx].value[i++] = v;
-	}
-	csiescseq.subarg[argidx].count = i;
-}
-
-void
-csiparse(void)
-{
-	char *p = csiescseq.buf, *np;
-	long int v;
-
-	csiescseq.narg = 0;
-	csiescseq.priv = 0;
-	if (*p == '?') {
-		csiescseq.priv = 1;
-		p++;
-	}
-
-	csiescseq.buf[csiescseq.len] = '\0';
-	while (p < csiescseq.buf+csiescseq.len) {
-		np = NULL;
-		v = strtol(p, &np, 10);
-		if (np == p)
-			v = 0;
-		if (v == LONG_MAX || v == LONG_MIN)
-			v = -1;
-		csiescseq.arg[csiescseq.narg++] = v;
-		p = np;
-		readsubargs(&p, csiescseq.narg-1);
-		if (*p != ';' || csiescseq.narg == ESC_ARG_SIZ)
-			break;
-		p++;
-	}
-	csiescseq.mode[0] = *p++;
-	csiescseq.mode[1] = (p < csiescseq.buf+csiescseq.len) ? *p : '\0';
-}
-
 /* for absolute user moves, when decom is set */
 void
 tmoveato(int x, int y)
@@ -1497,6 +1726,7 @@ tsetchar(Rune u, const Glyph *attr, int x, int y)
 		"⎻", "─", "⎼", "⎽", "├", "┤", "┴", "┬", /* p - w */
 		"│", "≤", "≥", "π", "≠", "£", "·", /* x - ~ */
 	};
+	LineHeader *h;
 
 	/*
 	 * The table is proudly stolen from rxvt.
@@ -1509,20 +1739,38 @@ tsetchar(Rune u, const Glyph *attr, int x, int y)
 		if (x+1 < term.col) {
 			term.line[y][x+1].u = ' ';
 			term.line[y][x+1].mode &= ~ATTR_WDUMMY;
+			LINEHDR(term.line[y])->used[1] = -1;
 		}
 	} else if (term.line[y][x].mode & ATTR_WDUMMY) {
 		if (x > 0) {
 			term.line[y][x-1].u = ' ';
 			term.line[y][x-1].mode &= ~ATTR_WIDE;
+			LINEHDR(term.line[y])->used[1] = -1;
 		}
 	}
 
 	term.dirty[y] = 1;
+	term.textgen++;
+	tlinetouch(term.line[y], x);
+	tlineput(term.line[y], x, u == ' ' && !(attr->mode & ATTR_WRAP));
+	h = LINEHDR(term.line[y]);
+	h->gen = term.textgen;
+	if (attr->mode & ATTR_BLINK)
+		h->flags |= LINE_BLINK;
+	if (attr->mode & ATTR_HYPERLINK)
+		h->flags |= LINE_HYPERLINK;
+	if (attr->extra & EXT_FTCS_PROMPT_PS1) {
+		markprompt(PROMPT_START, x, y, -1);
+		if (h->prompt < 0 || x < h->prompt)
+			h->prompt = x;
+	} else if (x == h->prompt) {
+		h->prompt = tlineprompt(term.line[y], x + 1);
+	}
 	term.line[y][x] = *attr;
 	term.line[y][x].u = u;
 	term.line[y][x].mode |= ATTR_SET;
 
-	if (isboxdraw(u))
+	if ((runeinfo(u) & RUNE_BOXDRAW) && isboxdraw(u))
 		term.line[y][x].mode |= ATTR_BOXDRAW;
 }
 
@@ -1541,19 +1789,180 @@ tclearglyph(Glyph *gp, int usecurattr)
 	gp->u = ' ';
 }
 
+/* clears n cells by copying them from a prebuilt blank row */
+void
+tclearglyphs(Glyph *gp, int n, int usecurattr)
+{
+	uint32_t fg = usecurattr ? term.c.attr.fg : defaultfg;
+	uint32_t bg = usecurattr ? term.c.attr.bg : defaultbg;
+	int i;
+
+	if (n <= 0)
+		return;
+
+	if (n > blankrow[usecurattr].len || fg != blankrow[usecurattr].fg ||
+	    bg != blankrow[usecurattr].bg) {
+		if (n > blankrow[usecurattr].len) {
+			blankrow[usecurattr].len = MAX(n, term.col);
+			blankrow[usecurattr].row = xrealloc(blankrow[usecurattr].row,
+				blankrow[usecurattr].len * sizeof(Glyph));
+		}
+		memset(blankrow[usecurattr].row, 0, blankrow[usecurattr].len * sizeof(Glyph));
+		for (i = 0; i < blankrow[usecurattr].len; i++)
+			tclearglyph(&blankrow[usecurattr].row[i], usecurattr);
+		blankrow[usecurattr].fg = fg;
+		blankrow[usecurattr].bg = bg;
+	}
+	memcpy(gp, blankrow[usecurattr].row, n * sizeof(Glyph));
+}
+
+/* the cells of a new line are not initialized, so none of them are blank */
+Line
+tallocline(int col)
+{
+	LineHeader *h = xmalloc(sizeof(LineHeader) + col * sizeof(Glyph));
+
+	h->len = col;
+	h->fg = h->bg = 0;
+	h->used[0] = h->used[1] = -1;
+	h->prompt = -1;
+	h->flags = LINE_ALL;
+	h->gen = ++term.textgen;
+	return (Line)(h + 1);
+}
+
+Line
+treallocline(Line line, int col)
+{
+	LineHeader *h = LINEHDR(line);
+
+	h = xrealloc(h, sizeof(LineHeader) + col * sizeof(Glyph));
+	h->len = col;
+	h->used[0] = h->used[1] = -1;
+	if (h->prompt >= col)
+		h->prompt = -1;
+	h->gen = ++term.textgen;
+	return (Line)(h + 1);
+}
+
+void
+tfreeline(Line line)
+{
+	if (line)
+		free(LINEHDR(line));
+}
+
+/* the cell at x is about to be written */
+void
+tlinetouch(Line line, int x)
+{
+	if (LINEHDR(line)->len <= x)
+		LINEHDR(line)->len = x + 1;
+}
+
+/* keeps the cached line lengths after cell x got a character, blank is
+ * set if it is a space without ATTR_WRAP */
+void
+tlineput(Line line, int x, int blank)
+{
+	LineHeader *h = LINEHDR(line);
+
+	if (h->used[0] >= 0)
+		h->used[0] = MAX(h->used[0], x + 1);
+	if (!blank) {
+		if (h->used[1] >= 0)
+			h->used[1] = MAX(h->used[1], x + 1);
+	} else if (x == h->used[1] - 1) {
+		h->used[1] = -1;
+	}
+}
+
+/* the cells of the line were moved */
+void
+tlineshift(Line line)
+{
+	LineHeader *h = LINEHDR(line);
+
+	h->used[0] = h->used[1] = -1;
+	h->gen = ++term.textgen;
+	if (h->prompt >= 0)
+		h->prompt = tlineprompt(line, 0);
+}
+
+/* returns the first cell from x on that starts a prompt or -1 */
+int
+tlineprompt(Line line, int x)
+{
+	for (; x < term.col; x++) {
+		if (line[x].extra & EXT_FTCS_PROMPT_PS1)
+			return x;
+	}
+	return -1;
+}
+
+/* clears the first col cells, the blank cells at the end are not written
+ * again if they already have the right colors */
+void
+tclearline(Line line, int col, int usecurattr)
+{
+	LineHeader *h = LINEHDR(line);
+	uint32_t fg = usecurattr ? term.c.attr.fg : defaultfg;
+	uint32_t bg = usecurattr ? term.c.attr.bg : defaultbg;
+
+	if (h->fg == fg && h->bg == bg)
+		col = MIN(h->len, col);
+	tclearglyphs(line, col, usecurattr);
+	h->len = 0;
+	h->fg = fg;
+	h->bg = bg;
+	h->used[0] = h->used[1] = 0;
+	h->prompt = -1;
+	h->flags = 0;
+	h->gen = ++term.textgen;
+}
+
 void
 tclearregion(int x1, int y1, int x2, int y2, int usecurattr)
 {
-	int x, y;
+	uint32_t fg = usecurattr ? term.c.attr.fg : defaultfg;
+	uint32_t bg = usecurattr ? term.c.attr.bg : defaultbg;
+	LineHeader *h;
+	int y;
 
 	/* regionselected() takes relative coordinates */
 	if (regionselected(x1+term.scr, y1+term.scr, x2+term.scr, y2+term.scr))
 		selremove();
 
+	term.textgen++;
+	tsetdirt(y1, y2);
 	for (y = y1; y <= y2; y++) {
-		term.dirty[y] = 1;
-		for (x = x1; x <= x2; x++)
-			tclearglyph(&term.line[y][x], usecurattr);
+		if (x1 == 0 && x2 == term.col - 1) {
+			tclearline(term.line[y], term.col, usecurattr);
+			continue;
+		}
+		h = LINEHDR(term.line[y]);
+		h->gen = term.textgen;
+		if (x2 + 1 >= h->used[0])
+			h->used[0] = -1;
+		if (x2 + 1 >= h->used[1])
+			h->used[1] = -1;
+		if (BETWEEN(h->prompt, x1, x2))
+			h->prompt = tlineprompt(term.line[y], x2 + 1);
+		if (h->fg == fg && h->bg == bg) {
+			/* the cells from h->len on are blank already */
+			tclearglyphs(&term.line[y][x1], MIN(x2 + 1, h->len) - x1, usecurattr);
+			if (x2 == term.col - 1)
+				h->len = MIN(h->len, x1);
+		} else {
+			tclearglyphs(&term.line[y][x1], x2 - x1 + 1, usecurattr);
+			if (x2 == term.col - 1) {
+				h->len = x1;
+				h->fg = fg;
+				h->bg = bg;
+			} else if (x2 >= h->len) {
+				h->len = x2 + 1;
+			}
+		}
 	}
 }
 
@@ -1565,6 +1974,9 @@ tdeletechar(int n)
 
 	if (n <= 0)
 		return;
+	if (regionselected(term.c.x + term.scr, term.c.y + term.scr,
+	                   term.col-1, term.c.y + term.scr))
+		xkeepsel();
 	dst = term.c.x;
 	src = MIN(term.c.x + n, term.col);
 	size = term.col - src;
@@ -1572,6 +1984,7 @@ tdeletechar(int n)
 	                   https://stackoverflow.com/questions/29844298 */
 		line = term.line[term.c.y];
 		memmove(&line[dst], &line[src], size * sizeof(Glyph));
+		tlineshift(line);
 	}
 	tclearregion(dst + size, term.c.y, term.col - 1, term.c.y, 1);
 }
@@ -1584,13 +1997,18 @@ tinsertblank(int n)
 
 	if (n <= 0)
 		return;
+	if (regionselected(term.c.x + term.scr, term.c.y + term.scr,
+	                   term.col-1, term.c.y + term.scr))
+		xkeepsel();
 	dst = MIN(term.c.x + n, term.col);
 	src = term.c.x;
 	size = term.col - dst;
 
 	if (size > 0) { /* otherwise dst would point beyond the array */
 		line = term.line[term.c.y];
+		tlinetouch(line, MIN(LINEHDR(line)->len + n, term.col) - 1);
 		memmove(&line[dst], &line[src], size * sizeof(Glyph));
+		tlineshift(line);
 	}
 	tclearregion(src, term.c.y, dst - 1, term.c.y, 1);
 }
@@ -1611,6 +2029,7 @@ tdeleteimages(void)
 		next = im->next;
 		delete_image(im);
 	}
+	term.imgoff = 0;
 }
 
 void
@@ -1684,121 +2103,203 @@ tdefcolor(const int *attr, int *npar, int l)
 }
 
 void
-tsetattr(const int *attr, int l)
+tattrmode(AttrDelta *d, Mode mask, Mode mode)
+{
+	d->modemask |= mask;
+	d->mode = (d->mode & ~mask) | mode;
+}
+
+void
+tattrextra(AttrDelta *d, uint32_t mask, uint32_t extra)
+{
+	d->extramask |= mask;
+	d->extra = (d->extra & ~mask) | extra;
+}
+
+/*
+ * Handles the attributes that TUIs send the most: resets, bold and
+ * truecolor without subarguments. Returns the number of arguments used or
+ * 0 if the attribute has to go through the full switch in tattrdelta().
+ */
+int
+tattrfast(AttrDelta *d, const int *attr, int i, int l)
+{
+	uint r, g, b;
+
+	switch (attr[i]) {
+	case 0:
+		tattrmode(d,
+			ATTR_BOLD       |
+			ATTR_FAINT      |
+			ATTR_ITALIC     |
+			ATTR_UNDERLINE  |
+			ATTR_BLINK      |
+			ATTR_REVERSE    |
+			ATTR_INVISIBLE  |
+			ATTR_STRUCK, 0);
+		d->fg = defaultfg;
+		d->bg = defaultbg;
+		tattrextra(d, ~(EXT_FTCS_PROMPT_PS1 | EXT_FTCS_PROMPT_PS2), 0);
+		return 1;
+	case 1:
+		tattrmode(d, ATTR_BOLD, ATTR_BOLD);
+		return 1;
+	case 22:
+		tattrmode(d, ATTR_BOLD | ATTR_FAINT, 0);
+		return 1;
+	case 39:
+		d->fg = defaultfg;
+		return 1;
+	case 49:
+		d->bg = defaultbg;
+		return 1;
+	case 38:
+	case 48:
+		if (i + 4 >= l || attr[i+1] != 2 || csiescseq.subarg[i].count > 0)
+			return 0;
+		r = attr[i+2];
+		g = attr[i+3];
+		b = attr[i+4];
+		if (r > 255 || g > 255 || b > 255)
+			return 0;
+		if (attr[i] == 38)
+			d->fg = TRUECOLOR(r, g, b);
+		else
+			d->bg = TRUECOLOR(r, g, b);
+		return 5;
+	}
+	return 0;
+}
+
+/*
+ * Decodes SGR arguments into the changes they make to the cursor
+ * attributes. Returns 0 if some of the arguments were not understood.
+ */
+int
+tattrdelta(AttrDelta *d, const int *attr, int l)
 {
-	int i, utype;
+	int i, n, utype, ok = 1;
 	int32_t color;
 
+	memset(d, 0, sizeof(*d));
+	d->fg = d->bg = -1;
+
 	for (i = 0; i < l; i++) {
+		if ((n = tattrfast(d, attr, i, l)) > 0) {
+			i += n - 1;
+			continue;
+		}
+
 		switch (attr[i]) {
-		case 0:
-			term.c.attr.mode &= ~(
-				ATTR_BOLD       |
-				ATTR_FAINT      |
-				ATTR_ITALIC     |
-				ATTR_UNDERLINE  |
-				ATTR_BLINK      |
-				ATTR_REVERSE    |
-				ATTR_INVISIBLE  |
-				ATTR_STRUCK     );
-			term.c.attr.fg = defaultfg;
-			term.c.attr.bg = defaultbg;
-			term.c.attr.extra &= (EXT_FTCS_PROMPT_PS1 | EXT_FTCS_PROMPT_PS2);
-			break;
-		case 1:
-			term.c.attr.mode |= ATTR_BOLD;
-			break;
 		case 2:
-			term.c.attr.mode |= ATTR_FAINT;
+			tattrmode(d, ATTR_FAINT, ATTR_FAINT);
 			break;
 		case 3:
-			term.c.attr.mode |= ATTR_ITALIC;
+			tattrmode(d, ATTR_ITALIC, ATTR_ITALIC);
 			break;
 		case 4:
 			utype = (csiescseq.subarg[i].count > 0) ? csiescseq.subarg[i].value[0] : 1;
 			utype = (!undercurl_style && utype >= 3) ? 0 : utype;
 			LIMIT(utype, 0, 5);
-			term.c.attr.extra = (term.c.attr.extra & ~UNDERLINE_TYPE_MASK) |
-			                     (utype << UNDERLINE_TYPE_SHIFT);
-			MODBIT(term.c.attr.mode, utype > 0, ATTR_UNDERLINE);
+			tattrextra(d, UNDERLINE_TYPE_MASK, utype << UNDERLINE_TYPE_SHIFT);
+			tattrmode(d, ATTR_UNDERLINE, (utype > 0) ? ATTR_UNDERLINE : 0);
 			break;
 		case 5: /* slow blink */
 			/* FALLTHROUGH */
 		case 6: /* rapid blink */
-			term.c.attr.mode |= ATTR_BLINK;
+			tattrmode(d, ATTR_BLINK, ATTR_BLINK);
 			break;
 		case 7:
-			term.c.attr.mode |= ATTR_REVERSE;
+			tattrmode(d, ATTR_REVERSE, ATTR_REVERSE);
 			break;
 		case 8:
-			term.c.attr.mode |= ATTR_INVISIBLE;
+			tattrmode(d, ATTR_INVISIBLE, ATTR_INVISIBLE);
 			break;
 		case 9:
-			term.c.attr.mode |= ATTR_STRUCK;
-			break;
-		case 22:
-			term.c.attr.mode &= ~(ATTR_BOLD | ATTR_FAINT);
+			tattrmode(d, ATTR_STRUCK, ATTR_STRUCK);
 			break;
 		case 23:
-			term.c.attr.mode &= ~ATTR_ITALIC;
+			tattrmode(d, ATTR_ITALIC, 0);
 			break;
 		case 24:
-			term.c.attr.mode &= ~ATTR_UNDERLINE;
+			tattrmode(d, ATTR_UNDERLINE, 0);
 			break;
 		case 25:
-			term.c.attr.mode &= ~ATTR_BLINK;
+			tattrmode(d, ATTR_BLINK, 0);
 			break;
 		case 27:
-			term.c.attr.mode &= ~ATTR_REVERSE;
+			tattrmode(d, ATTR_REVERSE, 0);
 			break;
 		case 28:
-			term.c.attr.mode &= ~ATTR_INVISIBLE;
+			tattrmode(d, ATTR_INVISIBLE, 0);
 			break;
 		case 29:
-			term.c.attr.mode &= ~ATTR_STRUCK;
+			tattrmode(d, ATTR_STRUCK, 0);
 			break;
 		case 38:
 			if ((color = tdefcolor(attr, &i, l)) >= 0)
-				term.c.attr.fg = color;
-			break;
-		case 39:
-			term.c.attr.fg = defaultfg;
+				d->fg = color;
+			else
+				ok = 0;
 			break;
 		case 48:
 			if ((color = tdefcolor(attr, &i, l)) >= 0)
-				term.c.attr.bg = color;
-			break;
-		case 49:
-			term.c.attr.bg = defaultbg;
+				d->bg = color;
+			else
+				ok = 0;
 			break;
 		case 58:
 			if ((color = tdefcolor(attr, &i, l)) >= 0) {
-				term.c.attr.extra = (term.c.attr.extra & ~UNDERLINE_COLOR_MASK) |
+				tattrextra(d, UNDERLINE_COLOR_MASK,
 					(IS_TRUECOL(color) ? EXT_UNDERLINE_COLOR_RGB : EXT_UNDERLINE_COLOR_PALETTE) |
-					(color & 0xffffff);
+					(color & 0xffffff));
+			} else {
+				ok = 0;
 			}
 			break;
 		case 59:
-			term.c.attr.extra &= ~UNDERLINE_COLOR_MASK;
+			tattrextra(d, UNDERLINE_COLOR_MASK, 0);
 			break;
 		default:
 			if (BETWEEN(attr[i], 30, 37)) {
-				term.c.attr.fg = attr[i] - 30;
+				d->fg = attr[i] - 30;
 			} else if (BETWEEN(attr[i], 40, 47)) {
-				term.c.attr.bg = attr[i] - 40;
+				d->bg = attr[i] - 40;
 			} else if (BETWEEN(attr[i], 90, 97)) {
-				term.c.attr.fg = attr[i] - 90 + 8;
+				d->fg = attr[i] - 90 + 8;
 			} else if (BETWEEN(attr[i], 100, 107)) {
-				term.c.attr.bg = attr[i] - 100 + 8;
+				d->bg = attr[i] - 100 + 8;
 			} else {
 				fprintf(stderr,
 					"erresc(default): gfx attr %d unknown\n",
 					attr[i]);
 				csidump();
+				ok = 0;
 			}
 			break;
 		}
 	}
+	return ok;
+}
+
+void
+tapplyattr(const AttrDelta *d)
+{
+	term.c.attr.mode = (term.c.attr.mode & ~d->modemask) | d->mode;
+	term.c.attr.extra = (term.c.attr.extra & ~d->extramask) | d->extra;
+	if (d->fg >= 0)
+		term.c.attr.fg = d->fg;
+	if (d->bg >= 0)
+		term.c.attr.bg = d->bg;
+}
+
+void
+tsetattr(const int *attr, int l)
+{
+	AttrDelta d;
+
+	tattrdelta(&d, attr, l);
+	tapplyattr(&d);
 }
 
 void
@@ -1957,391 +2458,715 @@ tsetmode(int priv, int set, const int *args, int narg)
 }
 
 void
-csihandle(void)
+csiunknown(void)
 {
-	char buf[40];
-	int n, x;
-	int pi, pa;
-	ImageList *im, *next;
+	fprintf(stderr, "erresc: unknown csi ");
+	csidump();
+	/* die(""); */
+}
 
-	switch (csiescseq.mode[0]) {
-	default:
-	unknown:
-		fprintf(stderr, "erresc: unknown csi ");
-		csidump();
-		/* die(""); */
+void
+csiich(void) /* ICH -- Insert <n> blank char */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tinsertblank(csiescseq.arg[0]);
+}
+
+void
+csicuu(void) /* CUU -- Cursor <n> Up */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tmoveto(term.c.x, term.c.y-csiescseq.arg[0]);
+}
+
+void
+csicud(void) /* CUD, VPR -- Cursor <n> Down */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tmoveto(term.c.x, term.c.y+csiescseq.arg[0]);
+}
+
+void
+csimc(void) /* MC -- Media Copy */
+{
+	switch (csiescseq.arg[0]) {
+	case 0:
+		tdump();
 		break;
-	case '@': /* ICH -- Insert <n> blank char */
-		DEFAULT(csiescseq.arg[0], 1);
-		tinsertblank(csiescseq.arg[0]);
+	case 1:
+		tdumpline(term.c.y);
 		break;
-	case 'A': /* CUU -- Cursor <n> Up */
-		DEFAULT(csiescseq.arg[0], 1);
-		tmoveto(term.c.x, term.c.y-csiescseq.arg[0]);
+	case 2:
+		tdumpsel();
 		break;
-	case 'B': /* CUD -- Cursor <n> Down */
-	case 'e': /* VPR --Cursor <n> Down */
-		DEFAULT(csiescseq.arg[0], 1);
-		tmoveto(term.c.x, term.c.y+csiescseq.arg[0]);
+	case 4:
+		term.mode &= ~MODE_PRINT;
 		break;
-	case 'i': /* MC -- Media Copy */
-		switch (csiescseq.arg[0]) {
-		case 0:
-			tdump();
-			break;
-		case 1:
-			tdumpline(term.c.y);
-			break;
-		case 2:
-			tdumpsel();
-			break;
-		case 4:
-			term.mode &= ~MODE_PRINT;
-			break;
-		case 5:
-			term.mode |= MODE_PRINT;
-			break;
-		}
-		break;
-	case 'c': /* DA -- Device Attributes */
-		if (csiescseq.arg[0] == 0)
-			ttywrite(vtiden, strlen(vtiden), 0);
-		break;
-	case 'b': /* REP -- if last char is printable print it <n> more times */
-		LIMIT(csiescseq.arg[0], 1, 65535);
-		if (term.lastc)
-			while (csiescseq.arg[0]-- > 0)
-				tputc(term.lastc);
+	case 5:
+		term.mode |= MODE_PRINT;
 		break;
-	case 'C': /* CUF -- Cursor <n> Forward */
-	case 'a': /* HPR -- Cursor <n> Forward */
-		DEFAULT(csiescseq.arg[0], 1);
-		tmoveto(term.c.x+csiescseq.arg[0], term.c.y);
+	}
+}
+
+void
+csida(void) /* DA -- Device Attributes */
+{
+	if (csiescseq.arg[0] == 0)
+		ttywrite(vtiden, strlen(vtiden), 0);
+}
+
+void
+csirep(void) /* REP -- if last char is printable print it <n> more times */
+{
+	LIMIT(csiescseq.arg[0], 1, 65535);
+	if (term.lastc)
+		while (csiescseq.arg[0]-- > 0)
+			tputc(term.lastc);
+}
+
+void
+csicuf(void) /* CUF, HPR -- Cursor <n> Forward */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tmoveto(term.c.x+csiescseq.arg[0], term.c.y);
+}
+
+void
+csicub(void) /* CUB -- Cursor <n> Backward */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tmoveto(term.c.x-csiescseq.arg[0], term.c.y);
+}
+
+void
+csicnl(void) /* CNL -- Cursor <n> Down and first col */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tmoveto(0, term.c.y+csiescseq.arg[0]);
+}
+
+void
+csicpl(void) /* CPL -- Cursor <n> Up and first col */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tmoveto(0, term.c.y-csiescseq.arg[0]);
+}
+
+void
+csitbc(void) /* TBC -- Tabulation clear */
+{
+	switch (csiescseq.arg[0]) {
+	case 0: /* clear current tab stop */
+		term.tabs[term.c.x] = 0;
 		break;
-	case 'D': /* CUB -- Cursor <n> Backward */
-		DEFAULT(csiescseq.arg[0], 1);
-		tmoveto(term.c.x-csiescseq.arg[0], term.c.y);
+	case 3: /* clear all the tabs */
+		memset(term.tabs, 0, term.col * sizeof(*term.tabs));
 		break;
-	case 'E': /* CNL -- Cursor <n> Down and first col */
-		DEFAULT(csiescseq.arg[0], 1);
-		tmoveto(0, term.c.y+csiescseq.arg[0]);
+	default:
+		csiunknown();
+	}
+}
+
+void
+csicha(void) /* CHA, HPA -- Move to <col> */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tmoveto(csiescseq.arg[0]-1, term.c.y);
+}
+
+void
+csicup(void) /* CUP, HVP -- Move to <row> <col> */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	DEFAULT(csiescseq.arg[1], 1);
+	tmoveato(csiescseq.arg[1]-1, csiescseq.arg[0]-1);
+}
+
+void
+csicht(void) /* CHT -- Cursor Forward Tabulation <n> tab stops */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tputtab(csiescseq.arg[0]);
+}
+
+void
+csied(void) /* ED -- Clear screen */
+{
+	ImageList *im;
+	int n;
+
+	switch (csiescseq.arg[0]) {
+	case 0: /* below */
+		tclearregion(term.c.x, term.c.y, term.col-1, term.c.y, 1);
+		if (term.c.y < term.row-1)
+			tclearregion(0, term.c.y+1, term.col-1, term.row-1, 1);
 		break;
-	case 'F': /* CPL -- Cursor <n> Up and first col */
-		DEFAULT(csiescseq.arg[0], 1);
-		tmoveto(0, term.c.y-csiescseq.arg[0]);
+	case 1: /* above */
+		if (term.c.y >= 1)
+			tclearregion(0, 0, term.col-1, term.c.y-1, 1);
+		tclearregion(0, term.c.y, term.c.x, term.c.y, 1);
 		break;
-	case 'g': /* TBC -- Tabulation clear */
-		switch (csiescseq.arg[0]) {
-		case 0: /* clear current tab stop */
-			term.tabs[term.c.x] = 0;
-			break;
-		case 3: /* clear all the tabs */
-			memset(term.tabs, 0, term.col * sizeof(*term.tabs));
+	case 2: /* screen */
+		if (IS_SET(MODE_ALTSCREEN)) {
+			tclearregion(0, 0, term.col-1, term.row-1, 1);
+			tdeleteimages();
+			deletehyperlinks(0);
 			break;
-		default:
-			goto unknown;
 		}
+		/* vte does this:
+		tscrollup(0, term.row-1, term.row, SCROLL_SAVEHIST); */
+		/* alacritty does this: */
+		for (n = term.row-1; n >= 0 && tlinelen(term.line[n]) == 0; n--)
+			;
+		if (term.imagestail)
+			n = MAX(IMGROW(term.imagestail), n);
+		if (n >= 0)
+			tscrollup(0, term.row-1, n+1, SCROLL_SAVEHIST);
+		tscrollup(0, term.row-1, term.row-n-1, SCROLL_NOSAVEHIST);
 		break;
-	case 'G': /* CHA -- Move to <col> */
-	case '`': /* HPA */
-		DEFAULT(csiescseq.arg[0], 1);
-		tmoveto(csiescseq.arg[0]-1, term.c.y);
+	case 3: /* scrollback */
+		if (IS_SET(MODE_ALTSCREEN))
+			break;
+		kscrolldown(&((Arg){ .i = term.scr }));
+		term.scr = 0;
+		term.histi = 0;
+		term.histf = 0;
+		while ((im = term.images) && IMGROW(im) < 0)
+			delete_image(im);
+		clearprompts(INT_MIN, -1);
+		deletehyperlinks(1);
 		break;
-	case 'H': /* CUP -- Move to <row> <col> */
-	case 'f': /* HVP */
-		DEFAULT(csiescseq.arg[0], 1);
-		DEFAULT(csiescseq.arg[1], 1);
-		tmoveato(csiescseq.arg[1]-1, csiescseq.arg[0]-1);
+	case 6: /* sixels */
+		tdeleteimages();
+		tfulldirt();
 		break;
-	case 'I': /* CHT -- Cursor Forward Tabulation <n> tab stops */
-		DEFAULT(csiescseq.arg[0], 1);
-		tputtab(csiescseq.arg[0]);
+	default:
+		csiunknown();
+	}
+}
+
+void
+csiel(void) /* EL -- Clear line */
+{
+	switch (csiescseq.arg[0]) {
+	case 0: /* right */
+		tclearregion(term.c.x, term.c.y, term.col-1, term.c.y, 1);
 		break;
-	case 'J': /* ED -- Clear screen */
-		switch (csiescseq.arg[0]) {
-		case 0: /* below */
-			tclearregion(term.c.x, term.c.y, term.col-1, term.c.y, 1);
-			if (term.c.y < term.row-1)
-				tclearregion(0, term.c.y+1, term.col-1, term.row-1, 1);
-			break;
-		case 1: /* above */
-			if (term.c.y >= 1)
-				tclearregion(0, 0, term.col-1, term.c.y-1, 1);
-			tclearregion(0, term.c.y, term.c.x, term.c.y, 1);
-			break;
-		case 2: /* screen */
-			if (IS_SET(MODE_ALTSCREEN)) {
-				tclearregion(0, 0, term.col-1, term.row-1, 1);
-				tdeleteimages();
-				deletehyperlinks(0);
-				break;
-			}
-			/* vte does this:
-			tscrollup(0, term.row-1, term.row, SCROLL_SAVEHIST); */
-			/* alacritty does this: */
-			for (n = term.row-1; n >= 0 && tlinelen(term.line[n]) == 0; n--)
-				;
-			for (im = term.images; im; im = im->next)
-				n = MAX(im->y - term.scr, n);
-			if (n >= 0)
-				tscrollup(0, term.row-1, n+1, SCROLL_SAVEHIST);
-			tscrollup(0, term.row-1, term.row-n-1, SCROLL_NOSAVEHIST);
-			break;
-		case 3: /* scrollback */
-			if (IS_SET(MODE_ALTSCREEN))
-				break;
-			kscrolldown(&((Arg){ .i = term.scr }));
-			term.scr = 0;
-			term.histi = 0;
-			term.histf = 0;
-			for (im = term.images; im; im = next) {
-				next = im->next;
-				if (im->y < 0)
-					delete_image(im);
-			}
-			deletehyperlinks(1);
-			break;
-		case 6: /* sixels */
-			tdeleteimages();
-			tfulldirt();
-			break;
-		default:
-			goto unknown;
-		}
+	case 1: /* left */
+		tclearregion(0, term.c.y, term.c.x, term.c.y, 1);
 		break;
-	case 'K': /* EL -- Clear line */
-		switch (csiescseq.arg[0]) {
-		case 0: /* right */
-			tclearregion(term.c.x, term.c.y, term.col-1, term.c.y, 1);
-			break;
-		case 1: /* left */
-			tclearregion(0, term.c.y, term.c.x, term.c.y, 1);
-			break;
-		case 2: /* all */
-			tclearregion(0, term.c.y, term.col-1, term.c.y, 1);
-			break;
-		}
+	case 2: /* all */
+		tclearregion(0, term.c.y, term.col-1, term.c.y, 1);
 		break;
-	case 'S':
-		/* XTSMGRAPHICS */
-		if (csiescseq.priv) {
-			if (csiescseq.narg > 1) {
-				pi = csiescseq.arg[0];
-				pa = csiescseq.arg[1];
-				if (pi == 1 && (pa == 1 || pa == 2 || pa == 4)) {
-					/* number of sixel color registers */
-					/* (read, reset and read the maximum value give the same response) */
-					n = snprintf(buf, sizeof buf, "\033[?1;0;%dS", DECSIXEL_PALETTE_MAX);
-					ttywrite(buf, n, 1);
-					break;
-				} else if (pi == 2 && (pa == 1 || pa == 2 || pa == 4)) {
-					/* sixel graphics geometry (in pixels) */
-					/* (read, reset and read the maximum value give the same response) */
-					n = snprintf(buf, sizeof buf, "\033[?2;0;%d;%dS",
-					             MIN(term.col * win.cw, DECSIXEL_WIDTH_MAX),
-					             MIN(term.row * win.ch, DECSIXEL_HEIGHT_MAX));
-					ttywrite(buf, n, 1);
-					break;
-				}
-				/* the number of color registers and sixel geometry can't be changed */
-				n = snprintf(buf, sizeof buf, "\033[?%d;3;0S", pi); /* failure */
-				ttywrite(buf, n, 1);
-			}
-			goto unknown;
+	}
+}
+
+void
+csixtsmgraphics(void) /* XTSMGRAPHICS */
+{
+	char buf[40];
+	int n, pi, pa;
+
+	if (csiescseq.narg > 1) {
+		pi = csiescseq.arg[0];
+		pa = csiescseq.arg[1];
+		if (pi == 1 && (pa == 1 || pa == 2 || pa == 4)) {
+			/* number of sixel color registers */
+			/* (read, reset and read the maximum value give the same response) */
+			n = snprintf(buf, sizeof buf, "\033[?1;0;%dS", DECSIXEL_PALETTE_MAX);
+			ttywrite(buf, n, 1);
+			return;
+		} else if (pi == 2 && (pa == 1 || pa == 2 || pa == 4)) {
+			/* sixel graphics geometry (in pixels) */
+			/* (read, reset and read the maximum value give the same response) */
+			n = snprintf(buf, sizeof buf, "\033[?2;0;%d;%dS",
+			             MIN(term.col * win.cw, DECSIXEL_WIDTH_MAX),
+			             MIN(term.row * win.ch, DECSIXEL_HEIGHT_MAX));
+			ttywrite(buf, n, 1);
+			return;
 		}
-		/* SU -- Scroll <n> line up */
-		DEFAULT(csiescseq.arg[0], 1);
-		/* xterm, urxvt, alacritty save this in history */
-		tscrollup(term.top, term.bot, csiescseq.arg[0], SCROLL_SAVEHIST);
-		break;
-	case 'T': /* SD -- Scroll <n> line down */
-		DEFAULT(csiescseq.arg[0], 1);
-		tscrolldown(term.top, csiescseq.arg[0]);
+		/* the number of color registers and sixel geometry can't be changed */
+		n = snprintf(buf, sizeof buf, "\033[?%d;3;0S", pi); /* failure */
+		ttywrite(buf, n, 1);
+	}
+	csiunknown();
+}
+
+void
+csisu(void) /* SU -- Scroll <n> line up */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	/* xterm, urxvt, alacritty save this in history */
+	tscrollup(term.top, term.bot, csiescseq.arg[0], SCROLL_SAVEHIST);
+}
+
+void
+csisd(void) /* SD -- Scroll <n> line down */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tscrolldown(term.top, csiescseq.arg[0]);
+}
+
+void
+csiil(void) /* IL -- Insert <n> blank lines */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tinsertblankline(csiescseq.arg[0]);
+}
+
+void
+csirm(void) /* RM -- Reset Mode */
+{
+	tsetmode(csiescseq.priv, 0, csiescseq.arg, csiescseq.narg);
+}
+
+void
+csidl(void) /* DL -- Delete <n> lines */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tdeleteline(csiescseq.arg[0]);
+}
+
+void
+csiech(void) /* ECH -- Erase <n> char */
+{
+	int x;
+
+	if (csiescseq.arg[0] < 0)
+		return;
+	DEFAULT(csiescseq.arg[0], 1);
+	x = MIN(term.c.x + csiescseq.arg[0], term.col) - 1;
+	tclearregion(term.c.x, term.c.y, x, term.c.y, 1);
+}
+
+void
+csidch(void) /* DCH -- Delete <n> char */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tdeletechar(csiescseq.arg[0]);
+}
+
+void
+csicbt(void) /* CBT -- Cursor Backward Tabulation <n> tab stops */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tputtab(-csiescseq.arg[0]);
+}
+
+void
+csivpa(void) /* VPA -- Move to <row> */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tmoveato(term.c.x, csiescseq.arg[0]-1);
+}
+
+void
+csism(void) /* SM -- Set terminal mode */
+{
+	tsetmode(csiescseq.priv, 1, csiescseq.arg, csiescseq.narg);
+}
+
+void
+csisgr(void) /* SGR -- Terminal attribute (color) */
+{
+	tsetattr(csiescseq.arg, csiescseq.narg);
+}
+
+void
+csidsr(void) /* DSR -- Device Status Report */
+{
+	char buf[40];
+	int n;
+
+	switch (csiescseq.arg[0]) {
+	case 5: /* Status Report "OK" `0n` */
+		ttywrite("\033[0n", sizeof("\033[0n") - 1, 0);
 		break;
-	case 'L': /* IL -- Insert <n> blank lines */
-		DEFAULT(csiescseq.arg[0], 1);
-		tinsertblankline(csiescseq.arg[0]);
+	case 6: /* Report Cursor Position (CPR) "<row>;<column>R" */
+		n = snprintf(buf, sizeof(buf), "\033[%i;%iR",
+		               term.c.y+1, term.c.x+1);
+		ttywrite(buf, n, 0);
 		break;
-	case 'l': /* RM -- Reset Mode */
-		tsetmode(csiescseq.priv, 0, csiescseq.arg, csiescseq.narg);
+	default:
+		csiunknown();
+	}
+}
+
+void
+csidecrqm(void) /* DECRQM -- DEC Request Mode (private) */
+{
+	switch (csiescseq.arg[0]) {
+	case 80: /* Sixel Display Mode  */
+		ttywrite(IS_SET(MODE_SIXEL_SDM) ? "\033[?80;1$y"
+		                                : "\033[?80;2$y", 9, 1);
 		break;
-	case 'M': /* DL -- Delete <n> lines */
-		DEFAULT(csiescseq.arg[0], 1);
-		tdeleteline(csiescseq.arg[0]);
+	case 1070:
+		/* Use private color registers for each sixel */
+		/* https://invisible-island.net/xterm/ctlseqs/ctlseqs.html */
+		ttywrite(IS_SET(MODE_SIXEL_PRIVATE_PALETTE) ? "\033[?1070;1$y"
+		                                            : "\033[?1070;2$y", 11, 1);
 		break;
-	case 'X': /* ECH -- Erase <n> char */
-		if (csiescseq.arg[0] < 0)
-			return;
-		DEFAULT(csiescseq.arg[0], 1);
-		x = MIN(term.c.x + csiescseq.arg[0], term.col) - 1;
-		tclearregion(term.c.x, term.c.y, x, term.c.y, 1);
+	case 2026:
+		/* Synchronized Output */
+		/* https://gist.github.com/christianparpart/d8a62cc1ab659194337d73e399004036 */
+		ttywrite(su ? "\033[?2026;1$y" : "\033[?2026;2$y", 11, 1);
 		break;
-	case 'P': /* DCH -- Delete <n> char */
-		DEFAULT(csiescseq.arg[0], 1);
-		tdeletechar(csiescseq.arg[0]);
+	case 8452:
+		/* sixel scrolling leaves cursor to right of graphic */
+		ttywrite(IS_SET(MODE_SIXEL_CUR_RT) ? "\033[?8452;1$y"
+		                                   : "\033[?8452;2$y", 11, 1);
 		break;
-	case 'Z': /* CBT -- Cursor Backward Tabulation <n> tab stops */
-		DEFAULT(csiescseq.arg[0], 1);
-		tputtab(-csiescseq.arg[0]);
+	default:
+		csiunknown();
+	}
+}
+
+void
+csidecstbm(void) /* DECSTBM -- Set Scrolling Region */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	DEFAULT(csiescseq.arg[1], term.row);
+	tsetscroll(csiescseq.arg[0]-1, csiescseq.arg[1]-1);
+	tmoveato(0, 0);
+}
+
+void
+csisc(void) /* DECSC -- Save cursor position (ANSI.SYS) */
+{
+	tcursor(CURSOR_SAVE);
+}
+
+void
+csixtwinops(void) /* XTWINOPS */
+{
+	char buf[40];
+	int n;
+
+	switch (csiescseq.arg[0]) {
+	case 14: /* text area size in pixels */
+		if (csiescseq.narg > 1)
+			goto unknown;
+		n = snprintf(buf, sizeof buf, "\033[4;%d;%dt",
+		             term.row * win.ch, term.col * win.cw);
+		ttywrite(buf, n, 1);
 		break;
-	case 'd': /* VPA -- Move to <row> */
-		DEFAULT(csiescseq.arg[0], 1);
-		tmoveato(term.c.x, csiescseq.arg[0]-1);
+	case 16: /* character cell size in pixels */
+		n = snprintf(buf, sizeof buf, "\033[6;%d;%dt", win.ch, win.cw);
+		ttywrite(buf, n, 1);
 		break;
-	case 'h': /* SM -- Set terminal mode */
-		tsetmode(csiescseq.priv, 1, csiescseq.arg, csiescseq.narg);
+	case 18: /* size of the text area in characters */
+		n = snprintf(buf, sizeof buf, "\033[8;%d;%dt", term.row, term.col);
+		ttywrite(buf, n, 1);
 		break;
-	case 'm': /* SGR -- Terminal attribute (color) */
-		if (csiescseq.priv)
+	case 22: /* pust current title on stack */
+		if (!BETWEEN(csiescseq.arg[1], 0, 2))
 			goto unknown;
-		tsetattr(csiescseq.arg, csiescseq.narg);
+		xpushtitle();
 		break;
-	case 'n': /* DSR -- Device Status Report */
-		switch (csiescseq.arg[0]) {
-		case 5: /* Status Report "OK" `0n` */
-			ttywrite("\033[0n", sizeof("\033[0n") - 1, 0);
-			break;
-		case 6: /* Report Cursor Position (CPR) "<row>;<column>R" */
-			n = snprintf(buf, sizeof(buf), "\033[%i;%iR",
-			               term.c.y+1, term.c.x+1);
-			ttywrite(buf, n, 0);
-			break;
-		default:
+	case 23: /* pop last title from stack */
+		if (!BETWEEN(csiescseq.arg[1], 0, 2))
 			goto unknown;
-		}
+		xsettitle(NULL, 1);
 		break;
-	case '$':
-		/* DECRQM -- DEC Request Mode (private) */
-		if (csiescseq.mode[1] == 'p' && csiescseq.priv) {
-			if (csiescseq.arg[0] == 80) {
-				/* Sixel Display Mode  */
-				ttywrite(IS_SET(MODE_SIXEL_SDM) ? "\033[?80;1$y"
-				                                : "\033[?80;2$y", 9, 1);
-				break;
-			} else if (csiescseq.arg[0] == 1070) {
-				/* Use private color registers for each sixel */
-				/* https://invisible-island.net/xterm/ctlseqs/ctlseqs.html */
-				ttywrite(IS_SET(MODE_SIXEL_PRIVATE_PALETTE) ? "\033[?1070;1$y"
-				                                            : "\033[?1070;2$y", 11, 1);
-				break;
-			} else if (csiescseq.arg[0] == 2026) {
-				/* Synchronized Output */
-				/* https://gist.github.com/christianparpart/d8a62cc1ab659194337d73e399004036 */
-				ttywrite(su ? "\033[?2026;1$y" : "\033[?2026;2$y", 11, 1);
-				break;
-			} else if (csiescseq.arg[0] == 8452) {
-				/* sixel scrolling leaves cursor to right of graphic */
-				ttywrite(IS_SET(MODE_SIXEL_CUR_RT) ? "\033[?8452;1$y"
-				                                   : "\033[?8452;2$y", 11, 1);
-				break;
-			}
+	default:
+	unknown:
+		csiunknown();
+	}
+}
+
+void
+csirc(void) /* DECRC -- Restore cursor position (ANSI.SYS) */
+{
+	tcursor(CURSOR_LOAD);
+}
+
+void
+csidecscusr(void) /* DECSCUSR -- Set Cursor Style */
+{
+	if (xsetcursor(csiescseq.arg[0]))
+		csiunknown();
+}
+
+/*
+ * Handlers indexed by private marker, intermediate byte and final byte.
+ * The sequences that are handled the same with and without a marker
+ * have an entry in both tables.
+ */
+#define CSI(f, fn)      [CSI_NOPRIV][CSI_NOINTER][(f) - '@'] = fn
+#define CSIDEC(f, fn)   [CSI_PRIVDEC][CSI_NOINTER][(f) - '@'] = fn
+#define CSIANY(f, fn)   CSI(f, fn), CSIDEC(f, fn)
+
+static void (*const csitable[CSI_NPRIV][CSI_NINTER]['~' - '@' + 1])(void) = {
+	CSIANY('@', csiich),
+	CSIANY('A', csicuu),
+	CSIANY('B', csicud),
+	CSIANY('e', csicud),
+	CSIANY('i', csimc),
+	CSIANY('c', csida),
+	CSIANY('b', csirep),
+	CSIANY('C', csicuf),
+	CSIANY('a', csicuf),
+	CSIANY('D', csicub),
+	CSIANY('E', csicnl),
+	CSIANY('F', csicpl),
+	CSIANY('g', csitbc),
+	CSIANY('G', csicha),
+	CSIANY('`', csicha),
+	CSIANY('H', csicup),
+	CSIANY('f', csicup),
+	CSIANY('I', csicht),
+	CSIANY('J', csied),
+	CSIANY('K', csiel),
+	CSIDEC('S', csixtsmgraphics),
+	CSI('S', csisu),
+	CSIANY('T', csisd),
+	CSIANY('L', csiil),
+	CSIANY('l', csirm),
+	CSIANY('M', csidl),
+	CSIANY('X', csiech),
+	CSIANY('P', csidch),
+	CSIANY('Z', csicbt),
+	CSIANY('d', csivpa),
+	CSIANY('h', csism),
+	CSI('m', csisgr),
+	CSIANY('n', csidsr),
+	[CSI_PRIVDEC][CSI_INTERDOLLAR]['p' - '@'] = csidecrqm,
+	CSI('r', csidecstbm),
+	CSI('s', csisc),
+	CSIANY('t', csixtwinops),
+	CSI('u', csirc),
+	[CSI_NOPRIV][CSI_INTERSPACE]['q' - '@'] = csidecscusr,
+	[CSI_PRIVDEC][CSI_INTERSPACE]['q' - '@'] = csidecscusr,
+};
+
+#undef CSI
+#undef CSIDEC
+#undef CSIANY
+
+/*
+ * Feeds one byte of a CSI sequence or of the header of a DCS sequence to
+ * the parser. The arguments are accumulated as the bytes arrive. Returns 1
+ * when the final byte has been read.
+ */
+int
+csiput(Rune u)
+{
+	CSIEscape *csi = &csiescseq;
+	int *v;
+
+	if (csi->state == CSI_DONE)
+		return 0;
+
+	if (BETWEEN(u, '0', ';')) {
+		if (csi->state != CSI_PARAM) {
+			csi->state = CSI_IGNORE;
+			return 0;
 		}
-		goto unknown;
-	case 'r': /* DECSTBM -- Set Scrolling Region */
-		if (csiescseq.priv) {
-			goto unknown;
+		if (csi->narg == 0)
+			csi->narg = 1;
+		if (csi->narg > ESC_ARG_SIZ)
+			return 0; /* the remaining arguments are dropped */
+
+		if (u == ';') {
+			if (csi->narg++ < ESC_ARG_SIZ)
+				csi->subarg[csi->narg-1].count = 0;
+			csi->sub = -1;
+		} else if (u == ':') {
+			csi->sub = csi->subarg[csi->narg-1].count;
+			if (csi->sub < SUB_ARG_SIZ)
+				csi->subarg[csi->narg-1].value[csi->sub] = 0;
+			csi->subarg[csi->narg-1].count = MIN(csi->sub + 1, SUB_ARG_SIZ);
 		} else {
-			DEFAULT(csiescseq.arg[0], 1);
-			DEFAULT(csiescseq.arg[1], term.row);
-			tsetscroll(csiescseq.arg[0]-1, csiescseq.arg[1]-1);
-			tmoveato(0, 0);
-		}
-		break;
-	case 's': /* DECSC -- Save cursor position (ANSI.SYS) */
-		if (csiescseq.priv)
-			goto unknown;
-		tcursor(CURSOR_SAVE);
-		break;
-	case 't': /* XTWINOPS */
-		switch (csiescseq.arg[0]) {
-		case 14: /* text area size in pixels */
-			if (csiescseq.narg > 1)
-				goto unknown;
-			n = snprintf(buf, sizeof buf, "\033[4;%d;%dt",
-			             term.row * win.ch, term.col * win.cw);
-			ttywrite(buf, n, 1);
-			break;
-		case 16: /* character cell size in pixels */
-			n = snprintf(buf, sizeof buf, "\033[6;%d;%dt", win.ch, win.cw);
-			ttywrite(buf, n, 1);
-			break;
-		case 18: /* size of the text area in characters */
-			n = snprintf(buf, sizeof buf, "\033[8;%d;%dt", term.row, term.col);
-			ttywrite(buf, n, 1);
-			break;
-		case 22: /* pust current title on stack */
-			switch (csiescseq.arg[1]) {
-			case 0:
-			case 1:
-			case 2:
-				xpushtitle();
-				break;
-			default:
-				goto unknown;
-			}
-			break;
-		case 23: /* pop last title from stack */
-			switch (csiescseq.arg[1]) {
-			case 0:
-			case 1:
-			case 2:
-				xsettitle(NULL, 1);
-				break;
-			default:
-				goto unknown;
-			}
-			break;
-		default:
-			goto unknown;
+			if (csi->sub < 0)
+				v = &csi->arg[csi->narg-1];
+			else if (csi->sub < SUB_ARG_SIZ)
+				v = &csi->subarg[csi->narg-1].value[csi->sub];
+			else
+				return 0;
+			/* values that do not fit are -1 */
+			if (*v >= 0)
+				*v = (*v > (INT_MAX - 9) / 10) ? -1 : *v * 10 + (u - '0');
 		}
+	} else if (BETWEEN(u, '<', '?')) {
+		if (csi->state != CSI_PARAM || csi->narg > 0 || csi->priv)
+			csi->state = CSI_IGNORE;
+		else
+			csi->priv = u;
+	} else if (BETWEEN(u, ' ', '/')) {
+		if (csi->state == CSI_IGNORE || csi->inter)
+			csi->state = CSI_IGNORE;
+		else
+			csi->state = CSI_INTER, csi->inter = u;
+	} else if (BETWEEN(u, '@', '~')) {
+		csi->final = u;
+		csi->narg = MIN(MAX(csi->narg, 1), ESC_ARG_SIZ);
+		csi->state = (csi->state == CSI_IGNORE) ? CSI_IGNORE : CSI_DONE;
+		return 1;
+	} else {
+		csi->state = CSI_IGNORE;
+	}
+	return 0;
+}
+
+/*
+ * Short sequences are buffered by csifeed() and looked up in the cache
+ * of decoded operations before they are parsed. Longer ones are parsed by
+ * csiput() as they arrive. Returns 1 when the final byte has been read.
+ */
+int
+csifeed(Rune u)
+{
+	CSIEscape *csi = &csiescseq;
+	int i;
+
+	if (csi->rawlen < 0)
+		return csiput(u);
+	if (csi->rawlen < CSI_CACHE_LEN && u < 0x80) {
+		csi->raw[csi->rawlen++] = u;
+		csi->hash = (csi->hash ^ u) * 16777619u;
+		return BETWEEN(u, '@', '~');
+	}
+	for (i = 0; i < csi->rawlen; i++)
+		csiput(csi->raw[i]);
+	csi->rawlen = -1;
+	return csiput(u);
+}
+
+int
+csicacheable(void (*handler)(void))
+{
+	static void (*const handlers[])(void) = {
+		csicuu, csicud, csicuf, csicub, csicnl, csicpl, csicha, csicup,
+		csivpa
+	};
+	int i;
+
+	for (i = 0; i < LEN(handlers); i++) {
+		if (handler == handlers[i])
+			return 1;
+	}
+	return 0;
+}
+
+void
+csirunop(const CSIOp *op)
+{
+	switch (op->type) {
+	case CSIOP_CALL:
+		csiescseq.arg[0] = op->arg[0];
+		csiescseq.arg[1] = op->arg[1];
+		csiescseq.narg = op->narg;
+		op->handler();
 		break;
-	case 'u': /* DECRC -- Restore cursor position (ANSI.SYS) */
-		if (csiescseq.priv)
-			goto unknown;
-		tcursor(CURSOR_LOAD);
+	case CSIOP_SGR:
+		tapplyattr(&op->attr);
 		break;
-	case ' ':
-		switch (csiescseq.mode[1]) {
-		case 'q': /* DECSCUSR -- Set Cursor Style */
-			if (xsetcursor(csiescseq.arg[0]))
-				goto unknown;
-			break;
-		default:
-			goto unknown;
+	}
+}
+
+void
+csihandle(void)
+{
+	void (*handler)(void) = NULL;
+	CSIOp *op = NULL;
+	int i, priv, inter, len = csiescseq.rawlen;
+
+	if (len >= 0) {
+		op = &csicache[csiescseq.hash % CSI_CACHE_SIZ];
+		if (op->type != CSIOP_NONE && op->len == len &&
+		    !memcmp(op->raw, csiescseq.raw, len)) {
+			csicachestat.hits++;
+			csirunop(op);
+			return;
 		}
-		break;
+		for (i = 0; i < len; i++)
+			csiput(csiescseq.raw[i]);
+	}
+
+	priv = !csiescseq.priv ? CSI_NOPRIV :
+	       (csiescseq.priv == '?') ? CSI_PRIVDEC : -1;
+	inter = !csiescseq.inter ? CSI_NOINTER :
+	        (csiescseq.inter == ' ') ? CSI_INTERSPACE :
+	        (csiescseq.inter == '$') ? CSI_INTERDOLLAR : -1;
+
+	if (csiescseq.state == CSI_DONE && priv >= 0 && inter >= 0)
+		handler = csitable[priv][inter][csiescseq.final - '@'];
+	if (!handler) {
+		csiunknown();
+		return;
+	}
+
+	if (op && handler == csisgr) {
+		/* replace the entry, it is only kept if all arguments were understood */
+		csicachestat.misses++;
+		op->type = tattrdelta(&op->attr, csiescseq.arg, csiescseq.narg) ? CSIOP_SGR : CSIOP_NONE;
+		tapplyattr(&op->attr);
+	} else if (op && csicacheable(handler)) {
+		csicachestat.misses++;
+		op->type = CSIOP_CALL;
+		op->handler = handler;
+		op->arg[0] = csiescseq.arg[0];
+		op->arg[1] = csiescseq.arg[1];
+		op->narg = csiescseq.narg;
+		handler();
+	} else {
+		csicachestat.uncached++;
+		handler();
+		return;
 	}
+	op->len = len;
+	memcpy(op->raw, csiescseq.raw, len);
+}
+
+void
+csicachestats(void)
+{
+	uint looked = csicachestat.hits + csicachestat.misses;
+
+	fprintf(stderr, "csi cache: %u hits, %u misses (%.1f%% hit rate), "
+	        "%u sequences not cacheable\n", csicachestat.hits,
+	        csicachestat.misses, looked ? 100.0 * csicachestat.hits / looked : 0.0,
+	        csicachestat.uncached);
 }
 
 void
 csidump(void)
 {
-	size_t i;
-	uint c;
+	int i, j;
 
 	fprintf(stderr, (term.esc & ESC_DCS) ? "ESCP" : "ESC[");
-	for (i = 0; i < csiescseq.len; i++) {
-		c = csiescseq.buf[i] & 0xff;
-		if (isprint(c)) {
-			putc(c, stderr);
-		} else if (c == '\n') {
-			fprintf(stderr, "(\\n)");
-		} else if (c == '\r') {
-			fprintf(stderr, "(\\r)");
-		} else if (c == 0x1b) {
-			fprintf(stderr, "(\\e)");
-		} else {
-			fprintf(stderr, "(%02x)", c);
-		}
+	if (csiescseq.priv)
+		putc(csiescseq.priv, stderr);
+	for (i = 0; i < csiescseq.narg; i++) {
+		if (i > 0)
+			putc(';', stderr);
+		if (csiescseq.arg[i])
+			fprintf(stderr, "%d", csiescseq.arg[i]);
+		for (j = 0; j < csiescseq.subarg[i].count; j++)
+			fprintf(stderr, ":%d", csiescseq.subarg[i].value[j]);
 	}
+	if (csiescseq.inter)
+		putc(csiescseq.inter, stderr);
+	if (csiescseq.final)
+		putc(csiescseq.final, stderr);
+	if (csiescseq.state == CSI_IGNORE)
+		fprintf(stderr, " (malformed)");
 	putc('\n', stderr);
 }
 
 void
 csireset(void)
 {
-	csiescseq.len = 0;
 	memset(&csiescseq.arg, 0, sizeof(csiescseq.arg));
+	csiescseq.narg = 0;
+	csiescseq.subarg[0].count = 0;
+	csiescseq.sub = -1;
+	csiescseq.priv = 0;
+	csiescseq.inter = 0;
+	csiescseq.final = 0;
+	csiescseq.state = CSI_PARAM;
+	csiescseq.rawlen = 0;
+	csiescseq.hash = 2166136261u;
 }
 
 void
@@ -2416,7 +3241,7 @@ strhandle(void)
 			osc7parsecwd((const char *)strescseq.args[1]);
 			return;
 		case 8:
-			if (!disablehyperlinks && term.hyperlinks->capacity > 0)
+			if (!disablehyperlinks && term.hyperlinks->budget > 0)
 				parsehyperlink(narg-1, strescseq.args[1], strescseq.args[2]);
 			return;
 		case 10:
@@ -2479,6 +3304,16 @@ strhandle(void)
 					}
 				}
 				break;
+			case 'B':
+				markprompt(PROMPT_COMMAND, term.c.x, term.c.y, -1);
+				break;
+			case 'C':
+				markprompt(PROMPT_OUTPUT, term.c.x, term.c.y, -1);
+				break;
+			case 'D':
+				markprompt(PROMPT_END, term.c.x, term.c.y,
+				           narg > 2 ? atoi(strescseq.args[2]) : -1);
+				break;
 			default:
 				/* fprintf(stderr, "erresc: unknown OSC 133 argument: %c\n", *strescseq.args[1]); */
 				break;
@@ -2494,6 +3329,10 @@ strhandle(void)
 		dcshandle();
 		return;
 	case '_': /* APC -- Application Program Command */
+		strescseq.buf[strescseq.len] = '\0';
+		if (strescseq.buf[0] == 'G')
+			kgphandle(strescseq.buf);
+		return;
 	case '^': /* PM -- Privacy Message */
 		return;
 	}
@@ -2590,14 +3429,164 @@ sendbreak(const Arg *arg)
 		perror("Error sending break");
 }
 
+int
+tprinterstart(void)
+{
+	sigset_t set, oset;
+	int err;
+
+	printq.size = MAX(printbuffersize, 1);
+	printq.buf = xmalloc(printq.size);
+	/* the signals, SIGCHLD above all, are left to the main thread */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &oset);
+	err = pthread_create(&printq.thread, NULL, tprinterthread, NULL);
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+	if (err != 0) {
+		free(printq.buf);
+		printq.buf = NULL;
+		return -1;
+	}
+	printq.running = 1;
+	atexit(tprinterstop);
+	return 0;
+}
+
+/* the printer thread closes iofd when a write fails */
+int
+tprinteropen(void)
+{
+	int fd;
+
+	pthread_mutex_lock(&printq.lock);
+	fd = iofd;
+	pthread_mutex_unlock(&printq.lock);
+	return fd != -1;
+}
+
+/* writes the pending output before st exits, but does not wait for an
+ * output file that stopped reading */
+void
+tprinterstop(void)
+{
+	struct timespec deadline;
+	int done;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += PRINT_DRAIN_SEC;
+	pthread_mutex_lock(&printq.lock);
+	printq.quit = 1;
+	pthread_cond_signal(&printq.cond);
+	while (!printq.done && pthread_cond_timedwait(&printq.cond,
+	       &printq.lock, &deadline) != ETIMEDOUT)
+		;
+	if (!(done = printq.done))
+		fprintf(stderr, "printer: output file stalled with %zu bytes pending\n",
+		        printq.len);
+	pthread_mutex_unlock(&printq.lock);
+	if (done)
+		pthread_join(printq.thread, NULL);
+}
+
+void *
+tprinterthread(void *arg)
+{
+	fd_set wfd;
+	ssize_t r;
+	size_t n;
+
+	pthread_mutex_lock(&printq.lock);
+	for (;;) {
+		while (printq.len == 0 && !printq.quit)
+			pthread_cond_wait(&printq.cond, &printq.lock);
+		if (printq.len == 0)
+			break;
+		/* only this thread moves the head and changes iofd */
+		n = MIN(printq.len, printq.size - printq.head);
+		pthread_mutex_unlock(&printq.lock);
+		if ((r = write(iofd, printq.buf + printq.head, n)) < 0 && errno == EAGAIN) {
+			FD_ZERO(&wfd);
+			FD_SET(iofd, &wfd);
+			select(iofd + 1, NULL, &wfd, NULL, NULL);
+		}
+		pthread_mutex_lock(&printq.lock);
+
+		if (r < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (r < 0) {
+			perror("Error writing to output file");
+			close(iofd);
+			iofd = -1;
+			printq.dropped += printq.len;
+			printq.len = 0;
+			break;
+		}
+		printq.head = (printq.head + r) % printq.size;
+		printq.len -= r;
+		printq.written += r;
+	}
+	printq.done = 1;
+	pthread_cond_signal(&printq.cond);
+	pthread_mutex_unlock(&printq.lock);
+	return NULL;
+}
+
 void
 tprinter(char *s, size_t len)
 {
-	if (iofd != -1 && xwrite(iofd, s, len) < 0) {
-		perror("Error writing to output file");
-		close(iofd);
-		iofd = -1;
+	size_t n, tail;
+
+	pthread_mutex_lock(&printq.lock);
+	if (iofd == -1 || len == 0 || (!printq.running && tprinterstart() < 0)) {
+		pthread_mutex_unlock(&printq.lock);
+		/* without the thread the output is written right away */
+		if (iofd != -1 && len > 0 && !printq.running &&
+		    xwrite(iofd, s, len) < 0) {
+			perror("Error writing to output file");
+			close(iofd);
+			iofd = -1;
+		}
+		return;
+	}
+
+	n = MIN(len, printq.size - printq.len);
+	printq.dropped += len - n;
+	if (n < len && !printq.warned) {
+		fprintf(stderr, "printer: output file too slow, dropping output\n");
+		printq.warned = 1;
 	}
+	if (printq.len == 0 && n > 0)
+		pthread_cond_signal(&printq.cond);
+	tail = (printq.head + printq.len) % printq.size;
+	if (tail + n > printq.size) {
+		memcpy(printq.buf + tail, s, printq.size - tail);
+		memcpy(printq.buf, s + printq.size - tail, n - (printq.size - tail));
+	} else {
+		memcpy(printq.buf + tail, s, n);
+	}
+	printq.len += n;
+	pthread_mutex_unlock(&printq.lock);
+}
+
+void
+printerstats(void)
+{
+	unsigned long long written, dropped;
+	size_t pending;
+
+	pthread_mutex_lock(&printq.lock);
+	written = printq.written, dropped = printq.dropped, pending = printq.len;
+	pthread_mutex_unlock(&printq.lock);
+	fprintf(stderr, "printer: %llu bytes written, %zu pending, %llu dropped\n",
+	        written, pending, dropped);
+}
+
+void
+dumpstats(const Arg *arg)
+{
+	csicachestats();
+	hyperlinkstats();
+	printerstats();
 }
 
 void
@@ -2612,6 +3601,18 @@ printscreen(const Arg *arg)
 	tdump();
 }
 
+void
+printoutput(const Arg *arg)
+{
+	tdumpoutput(arg->i, 0);
+}
+
+void
+printoutputjson(const Arg *arg)
+{
+	tdumpoutput(arg->i, 1);
+}
+
 void
 printsel(const Arg *arg)
 {
@@ -2632,7 +3633,7 @@ tdumpsel(void)
 void
 tdumpline(int n)
 {
-	char str[(term.col + 1) * UTF_SIZ];
+	char str[(term.col + 1) * UTF_SIZ * CLUSTER_MAXLEN];
 
 	tprinter(str, tgetline(str, &term.line[n][0]));
 }
@@ -2708,6 +3709,7 @@ tstrsequence(uchar c)
 	case 0x90:   /* DCS -- Device Control String */
 		c = 'P';
 		term.esc |= ESC_DCS;
+		csireset();
 		break;
 	case 0x9f:   /* APC -- Application Program Command */
 		c = '_';
@@ -2891,11 +3893,8 @@ initsixel(void)
 void
 createsixel(void)
 {
-	int cx, cy;
-	ImageList *im, *newimages, *next, *tail = NULL;
-	int scr = IS_SET(MODE_ALTSCREEN) ? 0 : term.scr;
-	int i, j, x1, y1, x2, y2, y, numimages;
-	Line line;
+	int cx, cy, cols, numimages;
+	ImageList *newimages;
 
 	if (!sixel_st.image.data) {
 		sixel_parser_deinit(&sixel_st);
@@ -2905,13 +3904,32 @@ createsixel(void)
 	cx = IS_SET(MODE_SIXEL_SDM) ? 0 : term.c.x;
 	cy = IS_SET(MODE_SIXEL_SDM) ? 0 : term.c.y;
 	if ((numimages = sixel_parser_finalize(&sixel_st, &newimages,
-			cx, cy + scr, win.cw, win.ch)) <= 0) {
+			cx, cy, win.cw, win.ch)) <= 0) {
 		sixel_parser_deinit(&sixel_st);
 		perror("sixel_parser_finalize() failed");
 		return;
 	}
 	sixel_parser_deinit(&sixel_st);
 
+	/* Sixel display mode: put the sixel in the upper left corner of the
+	 * screen, disable scrolling (the sixel will be truncated if it is too
+	 * long) and do not change the cursor position. */
+	cols = newimages->cols;
+	tputimages(newimages, numimages, !IS_SET(MODE_SIXEL_SDM));
+
+	/* if mode 8452 is set, sixel scrolling leaves cursor to right of graphic */
+	if (!IS_SET(MODE_SIXEL_SDM) && IS_SET(MODE_SIXEL_CUR_RT))
+		term.c.x = MIN(term.c.x + cols, term.col-1);
+}
+
+void
+tputimages(ImageList *newimages, int numimages, int scroll)
+{
+	ImageList *im, *next, *prev;
+	int scr = IS_SET(MODE_ALTSCREEN) ? 0 : term.scr;
+	int i, j, x1, y1, x2, y2, y;
+	Line line;
+
 	x1 = newimages->x;
 	y1 = newimages->y;
 	x2 = x1 + newimages->cols;
@@ -2919,74 +3937,62 @@ createsixel(void)
 
 	/* Delete the old images that are covered by the new image(s). We also need
 	 * to check if they have already been deleted before adding the new ones. */
-	if (term.images) {
+	if (term.imagestail) {
 		char transparent[numimages];
 		for (i = 0, im = newimages; im; im = im->next, i++) {
 			transparent[i] = im->transparent;
 		}
-		for (im = term.images; im; im = next) {
-			next = im->next;
-			if (im->y >= y1 && im->y < y2) {
-				y = im->y - scr;
-				if (y >= 0 && y < term.row && term.dirty[y]) {
-					line = term.line[y];
-					j = MIN(im->x + im->cols, term.col);
-					for (i = im->x; i < j; i++) {
-						if (line[i].extra & EXT_SIXEL)
-							break;
-					}
-					if (i == j) {
-						delete_image(im);
-						continue;
-					}
+		for (im = term.imagestail; im && (y = IMGROW(im)) >= y1; im = prev) {
+			prev = im->prev;
+			if (y >= y2)
+				continue;
+			if (y < term.row && term.dirty[y]) {
+				line = term.line[y];
+				j = MIN(im->x + im->cols, term.col);
+				for (i = (LINEHDR(line)->flags & LINE_SIXEL) ? im->x : j; i < j; i++) {
+					if (line[i].extra & EXT_SIXEL)
+						break;
 				}
-				if (im->x >= x1 && im->x + im->cols <= x2 && !transparent[im->y - y1]) {
+				if (i == j) {
 					delete_image(im);
 					continue;
 				}
 			}
-			tail = im;
+			if (im->x >= x1 && im->x + im->cols <= x2 && !transparent[y - y1])
+				delete_image(im);
 		}
 	}
-	if (tail) {
-		tail->next = newimages;
-		newimages->prev = tail;
-	} else {
-		term.images = newimages;
-	}
 
+	/* the new images are inserted one by one as they are positioned, so
+	 * that the scrolling below only moves the ones already placed */
 	x2 = MIN(x2, term.col) - 1;
-	if (IS_SET(MODE_SIXEL_SDM)) {
-		/* Sixel display mode: put the sixel in the upper left corner of
-		 * the screen, disable scrolling (the sixel will be truncated if
-		 * it is too long) and do not change the cursor position. */
+	if (!scroll) {
+		/* put the images on the rows below y1 without scrolling, the
+		 * images that do not fit on the screen are truncated */
 		for (i = 0, im = newimages; im; im = next, i++) {
 			next = im->next;
-			if (i >= term.row) {
-				delete_image(im);
+			if (y1 + i >= term.row) {
+				free(im->pixels);
+				free(im);
 				continue;
 			}
-			im->y = i + scr;
-			tsetsixelattr(term.line[i], x1, x2);
-			term.dirty[MIN(im->y, term.row-1)] = 1;
-			term.dirtyimg[MIN(im->y, term.row-1)] = 1;
+			im->y = term.imgoff + y1 + i;
+			insert_image(im);
+			tsetsixelattr(term.line[y1 + i], x1, x2);
+			term.dirty[MIN(y1 + i + scr, term.row-1)] = 1;
+			term.dirtyimg[MIN(y1 + i + scr, term.row-1)] = 1;
 		}
 	} else {
 		for (i = 0, im = newimages; im; im = next, i++) {
 			next = im->next;
-			im->y = term.c.y + scr;
+			im->y = term.imgoff + term.c.y;
+			insert_image(im);
 			tsetsixelattr(term.line[term.c.y], x1, x2);
-			term.dirty[MIN(im->y, term.row-1)] = 1;
-			term.dirtyimg[MIN(im->y, term.row-1)] = 1;
-			if (i < numimages-1) {
-				im->next = NULL;
+			term.dirty[MIN(term.c.y + scr, term.row-1)] = 1;
+			term.dirtyimg[MIN(term.c.y + scr, term.row-1)] = 1;
+			if (i < numimages-1)
 				tnewline(0);
-				im->next = next;
-			}
 		}
-		/* if mode 8452 is set, sixel scrolling leaves cursor to right of graphic */
-		if (IS_SET(MODE_SIXEL_CUR_RT))
-			term.c.x = MIN(term.c.x + newimages->cols, term.col-1);
 	}
 }
 
@@ -3098,8 +4104,8 @@ tputc(Rune u)
 		width = len = 1;
 	} else {
 		len = utf8encode(u, c);
-		if (!control && (width = wcwidth(u)) == -1)
-			width = 1;
+		if (!control)
+			width = runewidth(u);
 	}
 
 	if (IS_SET(MODE_PRINT))
@@ -3170,26 +4176,19 @@ check_control_code:
 		return;
 	} else if (term.esc & ESC_START) {
 		if (term.esc & ESC_CSI) {
-			csiescseq.buf[csiescseq.len++] = u;
-			if (BETWEEN(u, 0x40, 0x7E)
-					|| csiescseq.len >= \
-					sizeof(csiescseq.buf)-1) {
+			if (csifeed(u)) {
 				term.esc = 0;
-				csiparse();
 				csihandle();
 			}
 			return;
 		} else if (term.esc & ESC_DCS) {
-			if (strescseq.len < STR_BUF_SIZ-1 && strescseq.len < sizeof(csiescseq.buf)-1) {
+			if (strescseq.len < STR_BUF_SIZ-1) {
 				strescseq.buf[strescseq.len++] = u;
-				csiescseq.buf[csiescseq.len++] = u;
-				if (u == 'q') {
-					/* DCS sequences are processed after the ST arrives, but the sixel
-					 * mode must be turned on as soon as the sixel header is detected. */
-					csiparse();
-					if (csiescseq.mode[0] == 'q')
-						initsixel();
-				}
+				/* DCS sequences are processed after the ST arrives, but the sixel
+				 * mode must be turned on as soon as the sixel header is detected. */
+				if (csiput(u) && csiescseq.final == 'q' &&
+				    !csiescseq.priv && !csiescseq.inter)
+					initsixel();
 			}
 			return;
 		} else if (term.esc & ESC_UTF8) {
@@ -3210,6 +4209,13 @@ check_control_code:
 		 */
 		return;
 	}
+	/* combining marks and characters after a zero width joiner are added
+	 * to the cluster of the previous character */
+	if (term.lastc && IS_SET(MODE_UTF8) &&
+	    (width == 0 || (term.lastzwj && u >= 0x80)) && tcombine(u, width))
+		return;
+	term.lastzwj = 0;
+
 	/* selected() takes relative coordinates */
 	if (selected(term.c.x + term.scr, term.c.y + term.scr))
 		selclear();
@@ -3217,19 +4223,27 @@ check_control_code:
 	gp = &term.line[term.c.y][term.c.x];
 	if (IS_SET(MODE_WRAP) && (term.c.state & CURSOR_WRAPNEXT)) {
 		term.line[term.c.y][term.col-1].mode |= ATTR_WRAP;
+		tlineput(term.line[term.c.y], term.col-1, 0);
+		LINEHDR(term.line[term.c.y])->gen = ++term.textgen;
 		tnewline(1);
 		gp = &term.line[term.c.y][term.c.x];
 	}
 
 	if (IS_SET(MODE_INSERT) && term.c.x+width < term.col) {
+		tlinetouch(term.line[term.c.y], MIN(LINEHDR(term.line[term.c.y])->len + width, term.col) - 1);
 		memmove(gp+width, gp, (term.col - term.c.x - width) * sizeof(Glyph));
+		tlineshift(term.line[term.c.y]);
 		gp->mode &= ~ATTR_WIDE;
 	}
 
 	if (term.c.x+width > term.col) {
 		if (IS_SET(MODE_WRAP)) {
+			tlinetouch(term.line[term.c.y], term.col-1);
 			tclearglyph(&term.line[term.c.y][term.col-1], 0);
 			term.line[term.c.y][term.col-2].mode |= ATTR_WRAP;
+			LINEHDR(term.line[term.c.y])->used[0] = -1;
+			LINEHDR(term.line[term.c.y])->used[1] = -1;
+			LINEHDR(term.line[term.c.y])->gen = ++term.textgen;
 			tnewline(1);
 		} else {
 			tmoveto(term.col - width, term.c.y);
@@ -3244,12 +4258,15 @@ check_control_code:
 	if (width == 2) {
 		gp->mode |= ATTR_WIDE;
 		if (term.c.x+1 < term.col) {
+			tlinetouch(term.line[term.c.y], term.c.x+1);
 			if (gp[1].mode == ATTR_WIDE && term.c.x+2 < term.col) {
 				gp[2].u = ' ';
 				gp[2].mode &= ~ATTR_WDUMMY;
+				LINEHDR(term.line[term.c.y])->used[1] = -1;
 			}
 			gp[1].u = '\0';
 			gp[1].mode = ATTR_WDUMMY | ATTR_SET;
+			tlineput(term.line[term.c.y], term.c.x+1, 0);
 		}
 	}
 	if (term.c.x+width < term.col) {
@@ -3303,14 +4320,28 @@ twrite(const char *buf, int buflen, int show_ctrl)
 }
 
 void
-treflow_moveimages(int oldy, int newy)
+treflow_moveimages(ImageList **cur, int oldy, int newy)
 {
 	ImageList *im;
 
-	for (im = term.images; im; im = im->next) {
-		if (im->y == oldy)
-			im->reflow_y = newy;
-	}
+	/* the rows are visited in ascending order, so we can continue from
+	 * the first image that was not above the previous row */
+	for (; *cur && IMGROW(*cur) < oldy; *cur = (*cur)->next)
+		;
+	for (im = *cur; im && IMGROW(im) == oldy; im = im->next)
+		im->reflow_y = newy;
+}
+
+/* copies n cells and the line metadata describing them */
+void
+treflow_copy(Line dst, int nx, Line src, int ox, int n)
+{
+	LineHeader *dh = LINEHDR(dst), *sh = LINEHDR(src);
+
+	memcpy(&dst[nx], &src[ox], n * sizeof(Glyph));
+	dh->flags |= sh->flags;
+	if (dh->prompt < 0 && BETWEEN(sh->prompt, ox, ox + n - 1))
+		dh->prompt = nx + sh->prompt - ox;
 }
 
 void
@@ -3322,10 +4353,11 @@ treflow(int col, int row)
 	int cy = -1; /* proxy for new y coordinate of cursor */
 	int buflen, nlines;
 	Line *buf, bufline, line;
-	ImageList *im, *next;
+	ImageList *im, *next, *cur = term.images;
 
 	for (im = term.images; im; im = im->next)
 		im->reflow_y = INT_MIN; /* unset reflow_y */
+	treflow_saveprompts();
 
 	/* y coordinate of cursor line end */
 	for (oce = term.c.y; oce < term.row - 1 &&
@@ -3334,8 +4366,10 @@ treflow(int col, int row)
 	nlines = HISTSIZE + row;
 	buf = xmalloc(nlines * sizeof(Line));
 	do {
-		if (!nx && ++ny < nlines)
-			buf[ny] = xmalloc(col * sizeof(Glyph));
+		if (!nx && ++ny < nlines) {
+			buf[ny] = tallocline(col);
+			LINEHDR(buf[ny])->flags = 0;
+		}
 		if (!ox) {
 			line = TLINEABS(oy);
 			len = tlinelen(line);
@@ -3352,23 +4386,24 @@ treflow(int col, int row)
 		/* get reflowed lines in buf */
 		bufline = buf[ny % nlines];
 		if (col - nx > len - ox) {
-			memcpy(&bufline[nx], &line[ox], (len-ox) * sizeof(Glyph));
+			treflow_copy(bufline, nx, line, ox, len - ox);
+			treflow_moveprompts(oy, ox, len - ox, 1, ny, nx, col);
 			nx += len - ox;
 			if (len == 0 || !(line[len - 1].mode & ATTR_WRAP)) {
-				for (j = nx; j < col; j++)
-					tclearglyph(&bufline[j], 0);
-				treflow_moveimages(oy+term.scr, ny);
+				tclearglyphs(&bufline[nx], col - nx, 0);
+				treflow_moveimages(&cur, oy, ny);
 				nx = 0;
 			} else if (nx > 0) {
 				bufline[nx - 1].mode &= ~ATTR_WRAP;
 			}
 			ox = 0, oy++;
 		} else if (col - nx == len - ox) {
-			memcpy(&bufline[nx], &line[ox], (col-nx) * sizeof(Glyph));
-			treflow_moveimages(oy+term.scr, ny);
+			treflow_copy(bufline, nx, line, ox, col - nx);
+			treflow_moveprompts(oy, ox, col - nx, 1, ny, nx, col);
+			treflow_moveimages(&cur, oy, ny);
 			ox = 0, oy++, nx = 0;
 		} else/* if (col - nx < len - ox) */ {
-			memcpy(&bufline[nx], &line[ox], (col-nx) * sizeof(Glyph));
+			treflow_copy(bufline, nx, line, ox, col - nx);
 			if (bufline[col - 1].mode & ATTR_WIDE) {
 				bufline[col - 2].mode |= ATTR_WRAP;
 				tclearglyph(&bufline[col - 1], 0);
@@ -3376,18 +4411,18 @@ treflow(int col, int row)
 			} else {
 				bufline[col - 1].mode |= ATTR_WRAP;
 			}
-			treflow_moveimages(oy+term.scr, ny);
+			treflow_moveprompts(oy, ox, col - nx, 0, ny, nx, col);
+			treflow_moveimages(&cur, oy, ny);
 			ox += col - nx;
 			nx = 0;
 		}
 	} while (oy <= oce);
 	if (nx)
-		for (j = nx; j < col; j++)
-			tclearglyph(&bufline[j], 0);
+		tclearglyphs(&bufline[nx], col - nx, 0);
 
 	/* free extra lines */
 	for (i = row; i < term.row; i++)
-		free(term.line[i]);
+		tfreeline(term.line[i]);
 	/* resize to new height */
 	term.line = xrealloc(term.line, row * sizeof(Line));
 
@@ -3402,7 +4437,7 @@ treflow(int col, int row)
 		j = nce, nce = MIN(nce + -term.c.y, bot);
 		term.c.y += nce - j;
 		while (term.c.y < 0) {
-			free(buf[ny-- % nlines]);
+			tfreeline(buf[ny-- % nlines]);
 			buflen--;
 			term.c.y++;
 		}
@@ -3410,23 +4445,22 @@ treflow(int col, int row)
 	/* allocate new rows */
 	for (i = row - 1; i > nce; i--) {
 		if (i >= term.row)
-			term.line[i] = xmalloc(col * sizeof(Glyph));
+			term.line[i] = tallocline(col);
 		else
-			term.line[i] = xrealloc(term.line[i], col * sizeof(Glyph));
-		for (j = 0; j < col; j++)
-			tclearglyph(&term.line[i][j], 0);
+			term.line[i] = treallocline(term.line[i], col);
+		tclearline(term.line[i], col, 0);
 	}
 	/* fill visible area */
 	for (/*i = nce */; i >= term.row; i--, ny--, buflen--)
 		term.line[i] = buf[ny % nlines];
 	for (/*i = term.row - 1 */; i >= 0; i--, ny--, buflen--) {
-		free(term.line[i]);
+		tfreeline(term.line[i]);
 		term.line[i] = buf[ny % nlines];
 	}
 	/* fill lines in history buffer and update term.histf */
 	for (/*i = -1 */; buflen > 0 && i >= -HISTSIZE; i--, ny--, buflen--) {
 		j = (term.histi + i + 1 + HISTSIZE) % HISTSIZE;
-		free(term.hist[j]);
+		tfreeline(term.hist[j]);
 		term.hist[j] = buf[ny % nlines];
 	}
 	term.histf = -i - 1;
@@ -3434,17 +4468,20 @@ treflow(int col, int row)
 	/* resize rest of the history lines */
 	for (/*i = -term.histf - 1 */; i >= -HISTSIZE; i--) {
 		j = (term.histi + i + 1 + HISTSIZE) % HISTSIZE;
-		term.hist[j] = xrealloc(term.hist[j], col * sizeof(Glyph));
+		term.hist[j] = treallocline(term.hist[j], col);
 	}
 
-	/* move images to the final position */
+	treflow_restoreprompts(term.histf + ny + 1, row);
+
+	/* move images to the final position, the order of the rows is kept */
+	term.imgoff = 0;
 	for (im = term.images; im; im = next) {
 		next = im->next;
 		if (im->reflow_y == INT_MIN) {
 			delete_image(im);
 		} else {
-			im->y = im->reflow_y - term.histf + term.scr - (ny + 1);
-			if (im->y - term.scr < -HISTSIZE || im->y - term.scr >= row)
+			im->y = im->reflow_y - term.histf - (ny + 1);
+			if (im->y < -HISTSIZE || im->y >= row)
 				delete_image(im);
 		}
 	}
@@ -3452,15 +4489,18 @@ treflow(int col, int row)
 	/* expand images into new text cells */
 	for (im = term.images; im; im = im->next) {
 		j = MIN(im->x + im->cols, col);
-		line = TLINE(im->y);
+		line = TLINEABS(im->y);
 		for (i = im->x; i < j; i++) {
-			if (!(line[i].mode & ATTR_SET))
+			if (!(line[i].mode & ATTR_SET)) {
+				tlinetouch(line, i);
+				LINEHDR(line)->flags |= LINE_SIXEL;
 				line[i].extra |= EXT_SIXEL;
+			}
 		}
 	}
 
 	for (; buflen > 0; ny--, buflen--)
-		free(buf[ny % nlines]);
+		tfreeline(buf[ny % nlines]);
 	free(buf);
 }
 
@@ -3490,10 +4530,11 @@ rscrolldown(int n)
 	}
 	term.c.y += n;
 	term.histf -= n;
+	scroll_images(n);
+	scrollprompts(n);
 	if ((i = term.scr - n) >= 0) {
 		term.scr = i;
 	} else {
-		scroll_images(n - term.scr);
 		term.scr = 0;
 		if (sel.ob.x != -1 && !sel.alt)
 			selmove(-i);
@@ -3516,6 +4557,7 @@ tresize(int col, int row)
 	if (row != term.row || col != term.col)
 		win.mode ^= kbds_keyboardhandler(XK_Escape, NULL, 0, 1);
 
+	term.textgen++;
 	term.dirty = xrealloc(term.dirty, row * sizeof(*term.dirty));
 	term.dirtyimg = xrealloc(term.dirtyimg, row * sizeof(*term.dirtyimg));
 	term.tabs = xrealloc(term.tabs, col * sizeof(*term.tabs));
@@ -3537,7 +4579,7 @@ tresize(int col, int row)
 void
 tresizedef(int col, int row)
 {
-	int i, j;
+	int i;
 
 	/* return if dimensions haven't changed */
 	if (term.col == col && term.row == row) {
@@ -3554,16 +4596,19 @@ tresizedef(int col, int row)
 			tscrollup(0, term.row - 1, term.c.y - row + 1, SCROLL_RESIZE);
 			term.c.y = row - 1;
 		}
+		/* the selection must not refer to the rows that are freed */
+		if (regionselected(0, row + term.scr, term.col-1, term.row-1 + term.scr))
+			selremove();
 		for (i = row; i < term.row; i++)
-			free(term.line[i]);
+			tfreeline(term.line[i]);
+		clearprompts(row, INT_MAX);
 
 		/* resize to new height */
 		term.line = xrealloc(term.line, row * sizeof(Line));
 		/* allocate any new rows */
 		for (i = term.row; i < row; i++) {
-			term.line[i] = xmalloc(col * sizeof(Glyph));
-			for (j = 0; j < col; j++)
-				tclearglyph(&term.line[i][j], 0);
+			term.line[i] = tallocline(col);
+			tclearline(term.line[i], col, 0);
 		}
 		/* scroll down as much as height has increased */
 		rscrolldown(row - term.row);
@@ -3579,7 +4624,7 @@ tresizedef(int col, int row)
 void
 tresizealt(int col, int row)
 {
-	int i, j;
+	int i;
 	ImageList *im, *next;
 
 	/* return if dimensions haven't changed */
@@ -3591,7 +4636,7 @@ tresizealt(int col, int row)
 		selremove();
 	/* slide screen up if otherwise cursor would get out of the screen */
 	for (i = 0; i <= term.c.y - row; i++)
-		free(term.line[i]);
+		tfreeline(term.line[i]);
 	if (i > 0) {
 		/* ensure that both src and dst are not NULL */
 		memmove(term.line, term.line + i, row * sizeof(Line));
@@ -3599,20 +4644,18 @@ tresizealt(int col, int row)
 		term.c.y = row - 1;
 	}
 	for (i += row; i < term.row; i++)
-		free(term.line[i]);
+		tfreeline(term.line[i]);
 	/* resize to new height */
 	term.line = xrealloc(term.line, row * sizeof(Line));
 	/* resize to new width */
 	for (i = 0; i < MIN(row, term.row); i++) {
-		term.line[i] = xrealloc(term.line[i], col * sizeof(Glyph));
-		for (j = term.col; j < col; j++)
-			tclearglyph(&term.line[i][j], 0);
+		term.line[i] = treallocline(term.line[i], col);
+		tclearglyphs(&term.line[i][term.col], col - term.col, 0);
 	}
 	/* allocate any new rows */
 	for (/*i = MIN(row, term.row) */; i < row; i++) {
-		term.line[i] = xmalloc(col * sizeof(Glyph));
-		for (j = 0; j < col; j++)
-			tclearglyph(&term.line[i][j], 0);
+		term.line[i] = tallocline(col);
+		tclearline(term.line[i], col, 0);
 	}
 	/* update cursor */
 	if (term.c.x >= col) {
@@ -3629,7 +4672,7 @@ tresizealt(int col, int row)
 	/* delete or clip images if they are not inside the screen */
 	for (im = term.images; im; im = next) {
 		next = im->next;
-		if (im->x >= term.col || im->y >= term.row || im->y < 0) {
+		if (im->x >= term.col || IMGROW(im) >= term.row || IMGROW(im) < 0) {
 			delete_image(im);
 		} else {
 			if ((im->cols = MIN(im->x + im->cols, term.col) - im->x) <= 0)
@@ -3679,6 +4722,7 @@ draw(void)
 	if (term.line[term.c.y][cx].mode & ATTR_WDUMMY)
 		cx--;
 
+	kbds_updatestatus();
 	if (!kbds_drawcursor()) {
 		xdrawcursor(cx, term.c.y, term.line[term.c.y][cx],
 		            term.ocx, term.ocy, term.line[term.ocy]);
@@ -94,8 +94,16 @@ typedef struct _ImageList {
 	int cw;
 	int ch;
 	int transparent;
+	int kitty;            /* placed by the kitty graphics protocol */
+	uint32_t id;          /* kitty graphics image id */
+	uint32_t placementid; /* kitty graphics placement id */
 } ImageList;
 
+/* images are kept sorted by im->y, which is an absolute row number. IMGROW()
+ * gives the screen row (negative rows are in the scrollback), so scrolling
+ * the whole screen only has to adjust term.imgoff. */
+#define IMGROW(im)		((im)->y - term.imgoff)
+
 enum drawing_mode {
 	DRAW_NONE = 0,
 	DRAW_BG   = 1 << 0,
@@ -145,10 +153,9 @@ typedef XftGlyphFontSpec GlyphFontSpec;
 
 #define Glyph Glyph_
 typedef struct {
-	Rune u;           /* character code */
-	Rune ubk;         /* character code for flash label */
+	Rune u;           /* character code or GLYPH_CLUSTER | cluster id */
 	Mode mode;        /* attribute flags */
-	ushort hlink;     /* hyperlink index */
+	uint32_t hlink;   /* hyperlink id */
 	uint32_t fg;      /* foreground  */
 	uint32_t bg;      /* background  */
 	uint32_t extra;   /* underline style and color, semantic prompts, sixel */
@@ -156,6 +163,29 @@ typedef struct {
 
 typedef Glyph *Line;
 
+enum line_flags {
+	LINE_BLINK      = 1 << 0,
+	LINE_HYPERLINK  = 1 << 1,
+	LINE_SIXEL      = 1 << 2,
+	LINE_ALL        = LINE_BLINK | LINE_HYPERLINK | LINE_SIXEL,
+};
+
+/* kept in front of the cells of every screen and history line */
+typedef struct {
+	int len;          /* the cells from len on are blank */
+	uint32_t fg, bg;  /* colors of the blank cells */
+	int used[2];      /* tlinelen() on the main and alt screen, -1 if unknown */
+	int prompt;       /* first cell with EXT_FTCS_PROMPT_PS1, -1 if none */
+	int flags;        /* LINE_* attributes that the cells may have */
+	uint gen;         /* term.textgen when the text of the line last changed */
+} LineHeader;
+
+#define LINEHDR(line)   ((LineHeader *)(line) - 1)
+
+#define GLYPH_CLUSTER   0x80000000  /* the cell holds an interned grapheme cluster */
+#define CLUSTER_MAXLEN  32          /* code points of a cluster */
+#define GLYPHRUNE(u)    (((u) & GLYPH_CLUSTER) ? clusterbase(u) : (u))
+
 typedef struct {
 	int ox;
 	int charlen;
@@ -170,14 +200,59 @@ typedef struct {
 	char state;
 } TCursor;
 
+#define HLINK_MASK 0x7fffffff   /* hyperlink ids wrap around after 31 bits */
+#define HLINK_NONE UINT_MAX
+
+typedef struct {
+	uint off;             /* offset of the key in the arena */
+	uint len;             /* the key is the url, a 0 and the OSC 8 id */
+	uint hash;
+} HyperlinkEntry;
+
 typedef struct {
-	char **urls;
-	char lastid[256];
-	int head;
-	int count;
-	int capacity;
+	HyperlinkEntry *ids;  /* entry of every live id, indexed by id % idsize */
+	uint idsize;
+	uint *table;          /* newest id of every key, HLINK_NONE if empty */
+	uint tablesize;
+	uint nkeys;
+	char *arena;          /* keys of the live ids in the order of the ids */
+	uint head, tail;      /* the next key is put at head, the oldest is at tail */
+	size_t budget;        /* memory for the keys and the entries */
+	size_t used;
+	uint next;            /* id of the next new hyperlink */
+	uint count;           /* the ids next-count .. next-1 are live */
+	uint created, reused, evicted;
+	size_t evictedbytes;
 } Hyperlinks;
 
+/* OSC 133 marks of a shell command */
+enum prompt_mark {
+	PROMPT_START,   /* "133;A" - start of the prompt */
+	PROMPT_COMMAND, /* "133;B" - start of the command line */
+	PROMPT_OUTPUT,  /* "133;C" - start of the command output */
+	PROMPT_END,     /* "133;D" - end of the command */
+	PROMPT_NMARKS
+};
+
+typedef struct {
+	int y[PROMPT_NMARKS]; /* absolute rows of the marks, see PROMPTROW() */
+	int x[PROMPT_NMARKS];
+	int marks;            /* 1 << mark for every mark that was seen */
+	int status;           /* exit status given with "133;D", -1 if none */
+	struct timespec start, end; /* when the output started and ended */
+} Prompt;
+
+/* prompts of the main screen in a circular list sorted by the row of their
+ * first mark, which is unique. Like the images they are moved as a whole by
+ * changing the offset. */
+typedef struct {
+	Prompt *list;
+	int head, n, size;
+	int off;
+} Prompts;
+
+#define PROMPTROW(p, m)		((p)->y[m] - term.prompts.off)
+
 /* Internal representation of the screen */
 typedef struct {
 	int row;      /* nb row */
@@ -189,6 +264,7 @@ typedef struct {
 	int scr;             /* scroll back */
 	int wrapcwidth[2];   /* used in updating WRAPNEXT when resizing */
 	int *dirty;     /* dirtyness of lines */
+	uint textgen;   /* bumped whenever the text of the screen or history changes */
 	char *dirtyimg; /* dirtyness of image lines */
 	TCursor c;    /* cursor */
 	int ocx;      /* old cursor col */
@@ -201,11 +277,17 @@ typedef struct {
 	int charset;  /* current charset */
 	int icharset; /* selected charset for sequence */
 	int *tabs;
-	ImageList *images;     /* sixel images */
+	ImageList *images;     /* sixel images, sorted by row */
 	ImageList *images_alt; /* sixel images for alternate screen */
+	ImageList *imagestail;     /* last image in term.images */
+	ImageList *imagestail_alt; /* last image in term.images_alt */
+	int imgoff;     /* row offset of the images, see IMGROW() */
+	int imgoff_alt; /* row offset of the alternate screen images */
 	Hyperlinks *hyperlinks;
 	Hyperlinks *hyperlinks_alt;
+	Prompts prompts; /* shell prompts of the main screen */
 	Rune lastc;   /* last printed char outside of sequence, 0 if control */
+	int lastzwj;  /* the last printed char ended with a zero width joiner */
 	char *cwd;    /* current working directory */
 } Term;
 
@@ -260,9 +342,18 @@ typedef struct {
 	int gm; /* geometry mask */
 } XWindow;
 
+typedef struct {
+	char *str;
+	size_t len;
+	int refs;         /* shared by the primary selection, the clipboard
+	                     and incremental transfers */
+} SelText;
+
 typedef struct {
 	Atom xtarget;
-	char *primary, *clipboard;
+	SelText *primary, *clipboard;
+	int lazy;         /* owned selections whose text is not made yet */
+	size_t incrsize;  /* larger texts are sent incrementally */
 	struct timespec tclick1;
 	struct timespec tclick2;
 } XSelection;
@@ -324,6 +415,9 @@ void draw(void);
 void drawregion(int, int, int, int);
 void tfulldirt(void);
 
+void dumpstats(const Arg *);
+void printoutput(const Arg *);
+void printoutputjson(const Arg *);
 void printscreen(const Arg *);
 void printsel(const Arg *);
 void sendbreak(const Arg *);
@@ -334,6 +428,8 @@ int tisaltscr(void);
 void tnew(int, int);
 void tresize(int, int);
 void tsetdirtattr(int);
+void ttycheckexit(void);
+int ttychildfd(void);
 void ttyhangup(void);
 int ttynew(const char *, char *, const char *, char **);
 size_t ttyread(void);
@@ -348,10 +444,15 @@ void selstart(int, int, int);
 void selextend(int, int, int, int);
 void xyselextend(int, int, int);
 int selected(int, int);
+int selrow(int, int *, int *);
 char *getsel(void);
+int hassel(void);
 
 size_t utf8decode(const char *, Rune *, size_t);
 size_t utf8encode(Rune, char *);
+int runewidth(Rune);
+int glyphrunes(const Rune *, const Rune **);
+Rune clusterbase(Rune);
 
 void *xmalloc(size_t);
 void *xrealloc(void *, size_t);
@@ -399,4 +500,5 @@ extern XSelection xsel;
 extern TermWindow win;
 extern Term term;
 extern unsigned int disablehyperlinks;
+extern unsigned int printbuffersize;
 extern int undercurl_style;
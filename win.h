@@ -40,6 +40,8 @@ int xsetcursor(int);
 void xsetmode(int, unsigned int);
 void xsetpointermotion(int);
 void xsetsel(char *);
+void xownsel(void);
+void xkeepsel(void);
 int xstartdraw(void);
 void xximspot(int, int);
 void xclearwin(void);
@@ -112,7 +112,9 @@ static void propnotify(XEvent *);
 static void selnotify(XEvent *);
 static void selclear_(XEvent *);
 static void selrequest(XEvent *);
+static void selincrsend(Window, Atom);
 static void setsel(char *, Time);
+static void ownsel(Time);
 static void sigusr1_reload(int sig);
 static int mouseaction(XEvent *, uint);
 static void mousesel(XEvent *, int);
@@ -236,16 +238,83 @@ extern int ttyread_pending();
 
 #include "patch/x_include.c"
 
+enum { LAZY_PRIMARY = 1, LAZY_CLIPBOARD = 2 };
+
+/* an incremental transfer of a selection to another client */
+typedef struct SelTransfer {
+	Window requestor;
+	Atom property, target;
+	SelText *text;
+	size_t off;
+	struct SelTransfer *next;
+} SelTransfer;
+
+static SelTransfer *seltransfers;
+static int selxerror;
+
+static SelText *
+seltextnew(char *str)
+{
+	SelText *t;
+
+	if (!str)
+		return NULL;
+	t = xmalloc(sizeof(SelText));
+	t->str = str;
+	t->len = strlen(str);
+	t->refs = 1;
+	return t;
+}
+
+static SelText *
+seltextref(SelText *t)
+{
+	if (t)
+		t->refs++;
+	return t;
+}
+
+static void
+seltextunref(SelText *t)
+{
+	if (t && --t->refs == 0) {
+		free(t->str);
+		free(t);
+	}
+}
+
+/* The mouse selection is owned without its text. The text is made once when
+ * a client asks for it or before the selected lines change. */
+void
+xkeepsel(void)
+{
+	SelText *t;
+
+	if (!xsel.lazy)
+		return;
+	t = seltextnew(getsel());
+	if (xsel.lazy & LAZY_PRIMARY)
+		xsel.primary = seltextref(t);
+	if (xsel.lazy & LAZY_CLIPBOARD)
+		xsel.clipboard = seltextref(t);
+	xsel.lazy = 0;
+	seltextunref(t);
+}
+
 void
 clipcopy(const Arg *dummy)
 {
 	Atom clipboard;
 
-	free(xsel.clipboard);
+	seltextunref(xsel.clipboard);
 	xsel.clipboard = NULL;
+	xsel.lazy &= ~LAZY_CLIPBOARD;
 
-	if (xsel.primary != NULL) {
-		xsel.clipboard = xstrdup(xsel.primary);
+	if (xsel.primary != NULL || (xsel.lazy & LAZY_PRIMARY)) {
+		if (xsel.primary != NULL)
+			xsel.clipboard = seltextref(xsel.primary);
+		else
+			xsel.lazy |= LAZY_CLIPBOARD;
 		clipboard = XInternAtom(xw.dpy, "CLIPBOARD", 0);
 		XSetSelectionOwner(xw.dpy, clipboard, xw.win, CurrentTime);
 	}
@@ -337,23 +406,16 @@ zoomreset(const Arg *arg)
 void
 scrolltoprompt(const Arg *arg)
 {
-	int x, y;
-	int top = term.scr - term.histf;
-	int bot = term.scr + term.row-1;
-	int dy = arg->i;
-	Line line;
+	int y, dy = arg->i;
 
 	if (!dy || tisaltscr())
 		return;
 
-	for (y = dy; y >= top && y <= bot; y += dy) {
-		for (line = TLINE(y), x = 0; x < term.col; x++) {
-			if (line[x].extra & EXT_FTCS_PROMPT_PS1)
-				goto scroll;
-		}
-	}
+	/* scroll as far as possible if there is no prompt */
+	if ((y = findprompt(-term.scr, dy)) == INT_MIN)
+		y = dy < 0 ? -term.histf - 1 : term.row;
+	y += term.scr;
 
-scroll:
 	if (dy < 0)
 		kscrollup(&((Arg){ .i = -y }));
 	else
@@ -460,7 +522,7 @@ mousesel(XEvent *e, int done)
 
 	selextend(evcol(e), evrow(e), seltype, done);
 	if (done)
-		setsel(getsel(), e->xbutton.time);
+		ownsel(e->xbutton.time);
 }
 
 void
@@ -596,6 +658,11 @@ propnotify(XEvent *e)
 	Atom clipboard = XInternAtom(xw.dpy, "CLIPBOARD", 0);
 
 	xpev = &e->xproperty;
+	if (xpev->window != xw.win) {
+		if (xpev->state == PropertyDelete)
+			selincrsend(xpev->window, xpev->atom);
+		return;
+	}
 	if (xpev->state == PropertyNewValue &&
 			(xpev->atom == XA_PRIMARY ||
 			 xpev->atom == clipboard)) {
@@ -710,13 +777,86 @@ selclear_(XEvent *e)
 	selclear();
 }
 
+static int
+selignoreerror(Display *dpy, XErrorEvent *e)
+{
+	selxerror = 1;
+	return 0;
+}
+
+/* sends the next chunk when the requestor has deleted the property */
+void
+selincrsend(Window requestor, Atom property)
+{
+	SelTransfer **tp, *t;
+	int (*xerrorhandler)(Display *, XErrorEvent *);
+	size_t n;
+
+	for (tp = &seltransfers; (t = *tp); tp = &t->next) {
+		if (t->requestor == requestor && t->property == property)
+			break;
+	}
+	if (!t)
+		return;
+
+	/* the requestor can go away in the middle of the transfer */
+	selxerror = 0;
+	xerrorhandler = XSetErrorHandler(selignoreerror);
+	n = MIN(t->text->len - t->off, xsel.incrsize);
+	XChangeProperty(xw.dpy, requestor, property, t->target, 8,
+			PropModeReplace, (uchar *)t->text->str + t->off, n);
+	t->off += n;
+	/* an empty chunk ends the transfer */
+	if (n == 0 || selxerror)
+		XSelectInput(xw.dpy, requestor, NoEventMask);
+	XSync(xw.dpy, False);
+	XSetErrorHandler(xerrorhandler);
+
+	if (n == 0 || selxerror) {
+		*tp = t->next;
+		seltextunref(t->text);
+		free(t);
+	}
+}
+
+static void
+selincrstart(XSelectionRequestEvent *xsre, SelText *text)
+{
+	SelTransfer *t;
+	long len = text->len;
+
+	/* a new request for the same property replaces the old transfer */
+	for (t = seltransfers; t; t = t->next) {
+		if (t->requestor == xsre->requestor && t->property == xsre->property)
+			break;
+	}
+	if (!t) {
+		t = xmalloc(sizeof(SelTransfer));
+		t->requestor = xsre->requestor;
+		t->property = xsre->property;
+		t->next = seltransfers;
+		seltransfers = t;
+	} else {
+		seltextunref(t->text);
+	}
+	t->target = xsre->target;
+	t->text = seltextref(text);
+	t->off = 0;
+
+	/* the requestor deletes the property to ask for every chunk */
+	XSelectInput(xw.dpy, xsre->requestor, PropertyChangeMask);
+	XChangeProperty(xsre->display, xsre->requestor, xsre->property,
+			XInternAtom(xw.dpy, "INCR", 0), 32, PropModeReplace,
+			(uchar *)&len, 1);
+}
+
 void
 selrequest(XEvent *e)
 {
 	XSelectionRequestEvent *xsre;
 	XSelectionEvent xev;
 	Atom xa_targets, string, clipboard;
-	char *seltext;
+	SelText *seltext;
 
 	xsre = (XSelectionRequestEvent *) e;
 	xev.type = SelectionNotify;
@@ -743,6 +883,7 @@ selrequest(XEvent *e)
 		 * xith XA_STRING non ascii characters may be incorrect in the
 		 * requestor. It is not our problem, use utf8.
 		 */
+		xkeepsel();
 		clipboard = XInternAtom(xw.dpy, "CLIPBOARD", 0);
 		if (xsre->selection == XA_PRIMARY) {
 			seltext = xsel.primary;
@@ -755,10 +896,15 @@ selrequest(XEvent *e)
 			return;
 		}
 		if (seltext != NULL) {
-			XChangeProperty(xsre->display, xsre->requestor,
-					xsre->property, xsre->target,
-					8, PropModeReplace,
-					(uchar *)seltext, strlen(seltext));
+			/* our own window receives the text in one piece */
+			if (seltext->len > xsel.incrsize && xsre->requestor != xw.win) {
+				selincrstart(xsre, seltext);
+			} else {
+				XChangeProperty(xsre->display, xsre->requestor,
+						xsre->property, xsre->target,
+						8, PropModeReplace,
+						(uchar *)seltext->str, seltext->len);
+			}
 			xev.property = xsre->property;
 		}
 	}
@@ -774,8 +920,26 @@ setsel(char *str, Time t)
 	if (!str)
 		return;
 
-	free(xsel.primary);
-	xsel.primary = str;
+	seltextunref(xsel.primary);
+	xsel.primary = seltextnew(str);
+	xsel.lazy &= ~LAZY_PRIMARY;
+
+	XSetSelectionOwner(xw.dpy, XA_PRIMARY, xw.win, t);
+	if (XGetSelectionOwner(xw.dpy, XA_PRIMARY) != xw.win)
+		selclear();
+
+	clipcopy(NULL);
+}
+
+void
+ownsel(Time t)
+{
+	if (!hassel())
+		return;
+
+	seltextunref(xsel.primary);
+	xsel.primary = NULL;
+	xsel.lazy |= LAZY_PRIMARY;
 
 	XSetSelectionOwner(xw.dpy, XA_PRIMARY, xw.win, t);
 	if (XGetSelectionOwner(xw.dpy, XA_PRIMARY) != xw.win)
@@ -797,6 +961,12 @@ xsetsel(char *str)
 	setsel(str, CurrentTime);
 }
 
+void
+xownsel(void)
+{
+	ownsel(CurrentTime);
+}
+
 void
 brelease(XEvent *e)
 {
@@ -1484,6 +1654,8 @@ xinit(int cols, int rows)
 	clock_gettime(CLOCK_MONOTONIC, &xsel.tclick2);
 	xsel.primary = NULL;
 	xsel.clipboard = NULL;
+	/* leave room for the request header in every chunk */
+	xsel.incrsize = MIN(XMaxRequestSize(xw.dpy) * 4 - 256, 1 << 16);
 	xsel.xtarget = XInternAtom(xw.dpy, "UTF8_STRING", 0);
 	if (xsel.xtarget == None)
 		xsel.xtarget = XA_STRING;
@@ -1566,9 +1738,10 @@ xmakeglyphfontspecs_ligatures(XftGlyphFontSpec *specs, const Glyph *glyphs, int
 			cluster_xp += shaped.positions[code_idx].x_advance / 64.;
 			cluster_yp += shaped.positions[code_idx].y_advance / 64.;
 			numspecs++;
-		} else {
-			/* If it's not found, try to fetch it through the font cache. */
-			rune = glyphs[idx].u;
+		} else if (code_idx == 0 || idx != shaped.glyphs[code_idx - 1].cluster) {
+			/* If it's not found, try to fetch it through the font cache.
+			 * Only the first code point of a cluster is looked up. */
+			rune = GLYPHRUNE(glyphs[idx].u);
 			for (f = 0; f < frclen; f++) {
 				glyphidx = XftCharIndex(xw.dpy, frc[f].font, rune);
 				/* Everything correct. */
@@ -1658,7 +1831,7 @@ xmakeglyphfontspecs_noligatures(XftGlyphFontSpec *specs, const Glyph *glyphs, in
 
 	for (i = 0, xp = winx, yp = winy + font->ascent + win.cyo; i < len; ++i) {
 		/* Fetch rune and mode for current glyph. */
-		rune = glyphs[i].u;
+		rune = GLYPHRUNE(glyphs[i].u);
 		mode = glyphs[i].mode;
 
 		/* Skip dummy wide-character spacing. */
@@ -2027,7 +2200,7 @@ xdrawglyphfontspecs(const XftGlyphFontSpec *specs, Glyph base, int len, int x, i
 		}
 
 		/* underline url (openurlonclick patch) */
-		if (activeurl.draw && y >= activeurl.y1 && y <= activeurl.y2)
+		if (isurlcurrent() && y >= activeurl.y1 && y <= activeurl.y2)
 			drawurl(fg, base.mode, x, y, charlen, url_yoffset, underline_thickness);
 	}
 }
@@ -2271,7 +2444,7 @@ xstartdraw(void)
 void
 xdrawline_ligatures(Line line, int x1, int y1, int x2)
 {
-	int i, j, x, ox, numspecs;
+	int i, j, x, ox, numspecs, sx1, sx2;
 	Glyph new;
 	GlyphFontSeq *seq = xw.specseq;
 	XftGlyphFontSpec *specs = xw.specbuf;
@@ -2285,14 +2458,20 @@ xdrawline_ligatures(Line line, int x1, int y1, int x2)
 	/* Draw line in 2 passes: background and foreground. This way wide glyphs
 	   won't get truncated (#223) */
 
+	/* the selected columns break the runs by reversing them */
+	if (!selrow(y1, &sx1, &sx2))
+		sx1 = sx2 = -1;
+
 	/* background */
 	i = j = ox = 0;
 	for (x = x1; x < x2; x++) {
 		new = line[x];
 		if (new.mode & ATTR_WDUMMY)
 			continue;
-		if (selected(x, y1))
+		if (BETWEEN(x, sx1, sx2))
 			new.mode ^= ATTR_REVERSE;
+		if ((new.mode & ATTR_HYPERLINK) && !hyperlinkurl(new.hlink))
+			new.mode &= ~ATTR_HYPERLINK;
 		if ((i > 0) && ATTRCMP(seq[j].base, new)) {
 			numspecs = xmakeglyphfontspecs_ligatures(specs, &line[ox], x - ox, ox, y1);
 			xdrawglyphfontspecs(specs, seq[j].base, numspecs, ox, y1, DRAW_BG, x - ox);
@@ -2333,7 +2512,7 @@ xdrawline_ligatures(Line line, int x1, int y1, int x2)
 void
 xdrawline_noligatures(Line line, int x1, int y1, int x2)
 {
-	int i, x, ox, numspecs;
+	int i, x, ox, numspecs, sx1, sx2;
 	int numspecs_cached;
 	Glyph base, new;
 	XftGlyphFontSpec *specs;
@@ -2346,6 +2525,10 @@ xdrawline_noligatures(Line line, int x1, int y1, int x2)
 
 	numspecs_cached = xmakeglyphfontspecs_noligatures(xw.specbuf, &line[x1], x2 - x1, x1, y1);
 
+	/* the selected columns break the runs by reversing them */
+	if (!selrow(y1, &sx1, &sx2))
+		sx1 = sx2 = -1;
+
 	/* Draw line in 2 passes: background and foreground. This way wide glyphs
 	   won't get truncated (#223) */
 	for (int dmode = DRAW_BG; dmode <= DRAW_FG; dmode <<= 1) {
@@ -2360,8 +2543,10 @@ xdrawline_noligatures(Line line, int x1, int y1, int x2)
 			new = line[x];
 			if (new.mode & ATTR_WDUMMY)
 				continue;
-			if (selected(x, y1))
+			if (BETWEEN(x, sx1, sx2))
 				new.mode ^= ATTR_REVERSE;
+			if ((new.mode & ATTR_HYPERLINK) && !hyperlinkurl(new.hlink))
+				new.mode &= ~ATTR_HYPERLINK;
 			if (i > 0 && ATTRCMP(base, new)) {
 				xdrawglyphfontspecs(specs, base, i, ox, y1, dmode, x - ox);
 				specs += i;
@@ -2385,6 +2570,8 @@ xdrawline_noligatures(Line line, int x1, int y1, int x2)
 void
 xdrawline(Line line, int x1, int y1, int x2)
 {
+	line = kbds_overlayline(line, y1);
+
 	#if !DISABLE_LIGATURES
 	if (ligatures)
 		xdrawline_ligatures(line, x1, y1, x2);
@@ -2393,7 +2580,6 @@ xdrawline(Line line, int x1, int y1, int x2)
 		xdrawline_noligatures(line, x1, y1, x2);
 
 	term.dirtyimg[y1] = 1;
-	kbds_drawstatusbar(y1);
 }
 
 void
@@ -2404,7 +2590,7 @@ xfinishdraw(void)
 	XGCValues gcvalues;
 	GC gc = NULL;
 	int width, height;
-	int cx, cy, del, desty, mode, x1, x2, xend;
+	int cx, cy, del, desty, mode, x1, x2, xend, y;
 	int bw = borderpx, bh = borderpx;
 	Line line;
 	Glyph g;
@@ -2418,16 +2604,20 @@ xfinishdraw(void)
 			cx = term.c.x, cy = (!IS_SET(MODE_HIDE) && term.scr == 0) ? term.c.y : -1;
 	}
 
-	for (im = term.images; im; im = next) {
+	/* the images are sorted by row, so find the first one in the view
+	 * and stop at the first one below it */
+	for (im = term.imagestail; im && im->prev && IMGROW(im->prev) + term.scr >= 0; im = im->prev)
+		;
+	for (; im && (y = IMGROW(im) + term.scr) < term.row; im = next) {
 		next = im->next;
 
 		/* do not draw or process the image, if it is not visible or
 		 * the image line is not dirty */
-		if (im->x >= term.col || im->y >= term.row || im->y < 0 || !term.dirtyimg[im->y])
+		if (im->x >= term.col || y < 0 || !term.dirtyimg[y])
 			continue;
 
 		/* do not draw the image on the search bar */
-		if (im->y == term.row-1 && IS_SET(MODE_KBDSELECT) && kbds_issearchmode())
+		if (y == term.row-1 && IS_SET(MODE_KBDSELECT) && kbds_issearchmode())
 			continue;
 
 		/* scale the image */
@@ -2496,14 +2686,14 @@ xfinishdraw(void)
 		}
 
 		/* set the clip mask */
-		desty = bh + im->y * win.ch;
+		desty = bh + y * win.ch;
 		if (im->clipmask) {
 			XSetClipMask(xw.dpy, gc, (Drawable)im->clipmask);
 			XSetClipOrigin(xw.dpy, gc, bw + im->x * win.cw, desty);
 		}
 
 		/* draw only the parts of the image that are not erased */
-		line = TLINE(im->y) + im->x;
+		line = TLINE(y) + im->x;
 		xend = MIN(im->x + im->cols, term.col);
 		for (del = 1, x1 = im->x; x1 < xend; x1 = x2) {
 			mode = line->extra & EXT_SIXEL;
@@ -2527,7 +2717,7 @@ xfinishdraw(void)
 			delete_image(im);
 
 		/* Redraw the cursor if it is behind the image */
-		if (cy == im->y && (line[cx-xend+1].extra & EXT_SIXEL)) {
+		if (cy == y && (line[cx-xend+1].extra & EXT_SIXEL)) {
 			g = (Glyph){ .u = ' ', mode = 0, .fg = defaultfg, .bg = defaultbg, .extra = 0 };
 			xdrawcursor(cx, cy, g, cx, cy, NULL);
 		}
@@ -2859,10 +3049,10 @@ run(void)
 	XEvent ev;
 	int rev, w = win.w, h = win.h;
 	fd_set rfd;
-	int xfd = XConnectionNumber(xw.dpy), ttyfd, xev, drawing;
+	int xfd = XConnectionNumber(xw.dpy), ttyfd, chldfd, xev, drawing;
 	struct timespec seltv, *tv, now, trigger;
 	struct timespec lastscroll, lastblink, cursorlastblink;
-	double timeout, cursortimeout, scrolltimeout, vbelltimeout;
+	double timeout, cursortimeout, scrolltimeout, vbelltimeout, searchtimeout;
 
 	/* Waiting for window mapping */
 	do {
@@ -2881,6 +3071,7 @@ run(void)
 	} while (ev.type != MapNotify);
 
 	ttyfd = ttynew(opt_line, shell, opt_io, opt_cmd);
+	chldfd = ttychildfd();
 	cresize(w, h);
 
 	lastscroll = (struct timespec){0};
@@ -2888,9 +3079,15 @@ run(void)
 	cursorlastblink = (struct timespec){0};
 
 	for (timeout = -1, drawing = 0;;) {
+		ttycheckexit();
+
 		FD_ZERO(&rfd);
 		FD_SET(ttyfd, &rfd);
 		FD_SET(xfd, &rfd);
+		/* the exit of the shell is not missed between the check and
+		 * pselect() while a background job keeps the pty open */
+		if (chldfd >= 0)
+			FD_SET(chldfd, &rfd);
 
 		if (XPending(xw.dpy) || ttyread_pending())
 			timeout = 0;  /* existing events might not set xfd */
@@ -2899,7 +3096,7 @@ run(void)
 		seltv.tv_nsec = 1E6 * (timeout - 1E3 * seltv.tv_sec);
 		tv = timeout >= 0 ? &seltv : NULL;
 
-		if (pselect(MAX(xfd, ttyfd)+1, &rfd, NULL, NULL, tv, NULL) < 0) {
+		if (pselect(MAX(MAX(xfd, ttyfd), chldfd)+1, &rfd, NULL, NULL, tv, NULL) < 0) {
 			if (errno == EINTR)
 				continue;
 			die("select failed: %s\n", strerror(errno));
@@ -2991,6 +3188,8 @@ run(void)
 			}
 			timeout = (timeout >= 0) ? MIN(timeout, scrolltimeout) : scrolltimeout;
 		}
+		if ((searchtimeout = kbds_searchpoll()) >= 0)
+			timeout = (timeout >= 0) ? MIN(timeout, searchtimeout) : searchtimeout;
 
 		if (visualbell.active && visualbell.timeout <= TIMEDIFF(now, visualbell.lastbell)) {
 			visualbell.frame = TIMEDIFF(now, visualbell.firstbell) / visualbell.frametime;
@@ -3006,7 +3205,6 @@ run(void)
 		draw();
 		XFlush(xw.dpy);
 		drawing = 0;
-		activeurl.draw = 0;
 
 		if (visualbell.active) {
 			clock_gettime(CLOCK_MONOTONIC, &now);
@@ -3129,6 +3327,7 @@ run:
 	xinit(cols, rows);
 	xsetenv();
 	selinit();
+	kbds_compilepatterns();
 	if (opt_dir && chdir(opt_dir))
 		fprintf(stderr, "Can't change to working directory %s\n", opt_dir);
 	if (opt_fullscreen)